@@ -1,16 +1,74 @@
+#include "compiler.h"
+
 #include <iostream>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <cstdint>
 #include <cctype>
 #include <fstream>
+#include <cstring>
+#include <cstddef>
+#include <type_traits>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <charconv>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
 
 using namespace std;
 
-enum TokenType
+namespace
+{
+
+// An error in the program being compiled. It ends the compilation of that
+// program only: compile() reports it as the result's Diagnostic.
+class CompileError : public runtime_error
+{
+private:
+    DiagnosticKind errorKind;
+    int errorLine;
+
+public:
+    CompileError(DiagnosticKind kind, int line, const string &message)
+        : runtime_error(message), errorKind(kind), errorLine(line) {}
+
+    DiagnosticKind kind() const
+    {
+        return errorKind;
+    }
+    int line() const
+    {
+        return errorLine;
+    }
+};
+
+// Throws a CompileError whose message is the parts written one after another.
+// line is 0 when the error is not tied to one.
+template <typename... Parts>
+[[noreturn]] void compileError(DiagnosticKind kind, int line, const Parts &...parts)
+{
+    ostringstream message;
+    (message << ... << parts);
+    throw CompileError(kind, line, message.str());
+}
+
+enum TokenType : uint8_t
 {
     T_INT,
     T_FLOAT,
@@ -42,13 +100,474 @@ enum TokenType
     T_OR,
     T_WHILE,
     T_FOR,
+    T_LBRACKET,
+    T_RBRACKET,
     T_EOF,
 };
 
+typedef uint32_t SymbolId;
+const SymbolId NO_SYMBOL = 0;
+
+// Interns identifier and literal spellings. Each distinct spelling is hashed
+// and copied once; everything downstream refers to it by its integer id.
+//
+// Ids are handed out by one writer (the lexer), but text() may be called from
+// other threads for any id they have already received: neither the spelling
+// storage nor the id table is ever moved once allocated.
+class StringInterner
+{
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    static const size_t FIRST_SEGMENT_SIZE = 1024;
+    static const size_t SEGMENT_COUNT = 40; // Segment k holds FIRST_SEGMENT_SIZE << k ids
+
+    unique_ptr<string_view[]> segments[SEGMENT_COUNT];
+    size_t count;
+    unordered_map<string_view, SymbolId> ids;
+    vector<unique_ptr<char[]>> blocks;
+    vector<unique_ptr<char[]>> largeStrings;
+    size_t blockUsed;
+    size_t blockCapacity;
+
+    // Copies text into block storage, which is never moved once allocated
+    const char *store(string_view text)
+    {
+        if (text.size() > BLOCK_SIZE / 4)
+        {
+            largeStrings.emplace_back(new char[text.size()]);
+            copy(text.begin(), text.end(), largeStrings.back().get());
+            return largeStrings.back().get();
+        }
+        if (blocks.empty() || blockUsed + text.size() > blockCapacity)
+        {
+            blocks.emplace_back(new char[BLOCK_SIZE]);
+            blockUsed = 0;
+            blockCapacity = BLOCK_SIZE;
+        }
+        char *dest = blocks.back().get() + blockUsed;
+        copy(text.begin(), text.end(), dest);
+        blockUsed += text.size();
+        return dest;
+    }
+
+    string_view &slot(size_t id) const
+    {
+        size_t scaled = id / FIRST_SEGMENT_SIZE + 1;
+        size_t segment = 0;
+        while (scaled >>= 1)
+        {
+            segment++;
+        }
+        size_t segmentStart = ((size_t(1) << segment) - 1) * FIRST_SEGMENT_SIZE;
+        return segments[segment][id - segmentStart];
+    }
+
+    void append(string_view text)
+    {
+        size_t scaled = count / FIRST_SEGMENT_SIZE + 1;
+        if ((scaled & (scaled - 1)) == 0 && count % FIRST_SEGMENT_SIZE == 0)
+        {
+            // First id of a new segment
+            size_t segment = 0;
+            while (scaled >>= 1)
+            {
+                segment++;
+            }
+            segments[segment].reset(new string_view[FIRST_SEGMENT_SIZE << segment]);
+        }
+        slot(count) = text;
+        count++;
+    }
+
+public:
+    StringInterner() : count(0), blockUsed(0), blockCapacity(0)
+    {
+        append(string_view()); // NO_SYMBOL
+    }
+    StringInterner(const StringInterner &) = delete;
+    StringInterner &operator=(const StringInterner &) = delete;
+
+    SymbolId intern(string_view text)
+    {
+        auto it = ids.find(text);
+        if (it != ids.end())
+        {
+            return it->second;
+        }
+        string_view stored(store(text), text.size());
+        SymbolId id = static_cast<SymbolId>(count);
+        append(stored);
+        ids.emplace(stored, id);
+        return id;
+    }
+
+    // Gives text the next id without copying it or making it findable by
+    // intern(). For spellings that outlive the interner and are never looked
+    // up again, such as those in a mapped IR file.
+    SymbolId reference(string_view text)
+    {
+        SymbolId id = static_cast<SymbolId>(count);
+        append(text);
+        return id;
+    }
+
+    string_view text(SymbolId id) const
+    {
+        return slot(id);
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+};
+
+struct Keyword
+{
+    string_view text;
+    TokenType type;
+};
+
+// Reserved words. To add one, append it here; the static_assert below fails
+// if the new spelling collides with an existing one in keywordHash.
+constexpr Keyword KEYWORDS[] = {
+    {"int", T_INT},
+    {"float", T_FLOAT},
+    {"double", T_DOUBLE},
+    {"string", T_STRING},
+    {"bool", T_BOOL},
+    {"char", T_CHAR},
+    {"if", T_IF},
+    {"else", T_ELSE},
+    {"return", T_RETURN},
+    {"while", T_WHILE},
+    {"for", T_FOR},
+};
+
+const size_t KEYWORD_SLOTS = 32;
+
+// Perfect hash over the length and first two characters of each keyword
+constexpr size_t keywordHash(size_t length, unsigned char first, unsigned char second)
+{
+    return (length + first + 4 * second) & (KEYWORD_SLOTS - 1);
+}
+
+struct KeywordTable
+{
+    Keyword slots[KEYWORD_SLOTS];
+    size_t minLength;
+    size_t maxLength;
+    bool collisionFree;
+};
+
+constexpr KeywordTable buildKeywordTable()
+{
+    KeywordTable table{};
+    table.minLength = SIZE_MAX;
+    table.maxLength = 0;
+    table.collisionFree = true;
+    for (const Keyword &keyword : KEYWORDS)
+    {
+        size_t slot = keywordHash(keyword.text.size(), keyword.text[0], keyword.text[1]);
+        if (!table.slots[slot].text.empty())
+        {
+            table.collisionFree = false;
+        }
+        table.slots[slot] = keyword;
+        table.minLength = min(table.minLength, keyword.text.size());
+        table.maxLength = max(table.maxLength, keyword.text.size());
+    }
+    return table;
+}
+
+constexpr KeywordTable KEYWORD_TABLE = buildKeywordTable();
+static_assert(KEYWORD_TABLE.collisionFree, "keywordHash collides; retune its multipliers or KEYWORD_SLOTS");
+static_assert(KEYWORD_TABLE.minLength >= 2, "keywordHash reads the first two characters");
+
+// Returns the keyword's token type, or T_ID for any other word. One hash and
+// at most one comparison; nothing is allocated.
+inline TokenType classifyKeyword(string_view word)
+{
+    if (word.size() < KEYWORD_TABLE.minLength || word.size() > KEYWORD_TABLE.maxLength)
+    {
+        return T_ID;
+    }
+    const Keyword &candidate = KEYWORD_TABLE.slots[keywordHash(word.size(), word[0], word[1])];
+    return candidate.text == word ? candidate.type : T_ID;
+}
+
+// Spelling of tokens whose text is fixed by their type
+string_view fixedTokenText(TokenType type)
+{
+    switch (type)
+    {
+    case T_INT:
+        return "int";
+    case T_FLOAT:
+        return "float";
+    case T_DOUBLE:
+        return "double";
+    case T_STRING:
+        return "string";
+    case T_BOOL:
+        return "bool";
+    case T_CHAR:
+        return "char";
+    case T_IF:
+        return "if";
+    case T_ELSE:
+        return "else";
+    case T_RETURN:
+        return "return";
+    case T_WHILE:
+        return "while";
+    case T_FOR:
+        return "for";
+    case T_ASSIGN:
+        return "=";
+    case T_PLUS:
+        return "+";
+    case T_MINUS:
+        return "-";
+    case T_MUL:
+        return "*";
+    case T_DIV:
+        return "/";
+    case T_LPAREN:
+        return "(";
+    case T_RPAREN:
+        return ")";
+    case T_LBRACE:
+        return "{";
+    case T_RBRACE:
+        return "}";
+    case T_LBRACKET:
+        return "[";
+    case T_RBRACKET:
+        return "]";
+    case T_SEMICOLON:
+        return ";";
+    case T_GT:
+        return ">";
+    case T_LT:
+        return "<";
+    case T_EQ:
+        return "==";
+    case T_NEQ:
+        return "!=";
+    case T_AND:
+        return "&&";
+    case T_OR:
+        return "||";
+    default:
+        return "";
+    }
+}
+
+// A single token as read back from a TokenStream
 struct Token
 {
     TokenType type;
-    string value;
+    uint32_t offset; // Byte offset of the token in the source
+    SymbolId id;     // Interned spelling for identifiers and literals
+};
+
+inline string_view tokenValue(const Token &token, const StringInterner &names)
+{
+    return token.id != NO_SYMBOL ? names.text(token.id) : fixedTokenText(token.type);
+}
+
+// Token stream stored as parallel arrays (9 bytes per token) so that the
+// parser's scans over token types stay within a few cache lines.
+class TokenStream
+{
+private:
+    const StringInterner *names;
+    vector<TokenType> kinds;
+    vector<uint32_t> offsets;
+    vector<SymbolId> ids;
+
+public:
+    explicit TokenStream(const StringInterner &names) : names(&names) {}
+
+    void push(TokenType type, uint32_t offset, SymbolId id)
+    {
+        kinds.push_back(type);
+        offsets.push_back(offset);
+        ids.push_back(id);
+    }
+
+    void push(const Token &token)
+    {
+        push(token.type, token.offset, token.id);
+    }
+
+    size_t size() const
+    {
+        return kinds.size();
+    }
+
+    TokenType type(size_t i) const
+    {
+        return kinds[i];
+    }
+
+    SymbolId id(size_t i) const
+    {
+        return ids[i];
+    }
+
+    Token operator[](size_t i) const
+    {
+        return Token{kinds[i], offsets[i], ids[i]};
+    }
+
+    string_view value(size_t i) const
+    {
+        return tokenValue((*this)[i], *names);
+    }
+};
+
+// Producer of tokens for the parser. Tokens are handed over in batches so the
+// virtual call is amortized; after T_EOF a source keeps returning T_EOF.
+class TokenSource
+{
+public:
+    virtual ~TokenSource() {}
+
+    // Writes between 1 and capacity tokens to out and returns how many
+    virtual size_t fill(Token *out, size_t capacity) = 0;
+};
+
+// Replays an already materialized TokenStream
+class TokenStreamReader : public TokenSource
+{
+private:
+    const TokenStream &tokens;
+    size_t pos;
+
+public:
+    explicit TokenStreamReader(const TokenStream &tokens) : tokens(tokens), pos(0) {}
+
+    size_t fill(Token *out, size_t capacity) override
+    {
+        size_t count = 0;
+        while (count < capacity && pos < tokens.size())
+        {
+            out[count++] = tokens[pos++];
+        }
+        if (count == 0)
+        {
+            out[count++] = tokens[tokens.size() - 1];
+        }
+        return count;
+    }
+};
+
+// Lookahead window over a TokenSource, kept in a fixed ring so the parser's
+// memory use does not grow with the input
+class TokenBuffer
+{
+private:
+    static const size_t RING_SIZE = 256;
+
+    TokenSource &source;
+    Token ring[RING_SIZE];
+    size_t head; // Tokens consumed so far
+    size_t tail; // Tokens fetched so far
+
+    void refill()
+    {
+        size_t slot = tail % RING_SIZE;
+        size_t room = min(RING_SIZE - (tail - head), RING_SIZE - slot);
+        tail += source.fill(ring + slot, room);
+    }
+
+public:
+    explicit TokenBuffer(TokenSource &source) : source(source), head(0), tail(0) {}
+
+    // Token `ahead` positions past the current one (at most RING_SIZE - 1)
+    const Token &peek(size_t ahead = 0)
+    {
+        while (tail - head <= ahead)
+        {
+            refill();
+        }
+        return ring[(head + ahead) % RING_SIZE];
+    }
+
+    void advance()
+    {
+        peek();
+        head++;
+    }
+};
+
+// Read-only source text. Where mmap is available the file is mapped instead of
+// copied, so lexing a large file costs no more than the mapping itself.
+class SourceFile
+{
+private:
+    const char *data;
+    size_t length;
+    bool mapped;
+    string buffer;
+
+public:
+    SourceFile() : data(nullptr), length(0), mapped(false) {}
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    ~SourceFile()
+    {
+#ifdef HAVE_MMAP
+        if (mapped)
+        {
+            munmap(const_cast<char *>(data), length);
+        }
+#endif
+    }
+
+    bool open(const char *path)
+    {
+#ifdef HAVE_MMAP
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(addr);
+                length = st.st_size;
+                mapped = true;
+                close(fd);
+                return true;
+            }
+        }
+        close(fd);
+#endif
+        // Empty files, pipes and platforms without mmap are read into memory
+        ifstream file(path, ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+        return true;
+    }
+
+    string_view text() const
+    {
+        return string_view(data, length);
+    }
 };
 
 struct Symbol
@@ -56,61 +575,157 @@ struct Symbol
     TokenType type;
     int scopeLevel;
     bool initialized;
+    int32_t length;  // Elements of an array; 0 for a scalar
+    uint32_t offset; // Of the name in its declaration
 };
 
 class SymbolTable
 {
 private:
-    map<string, Symbol> symbols;
+    const StringInterner &names;
+    vector<Symbol> symbols; // Indexed by SymbolId
+    vector<bool> declared;
+    vector<SymbolId> order; // Declaration order
+    const SymbolTable *outer;
+    uint32_t outerEnd;
 
-public:
-    void insert(string &name, TokenType type, int scopeLevel)
+    // The declaration of `name` visible here, or null
+    const Symbol *find(SymbolId name) const
     {
-        if (symbols.find(name) == symbols.end())
+        if (name < declared.size() && declared[name])
         {
-            symbols[name] = {type, scopeLevel, false};
+            return &symbols[name];
         }
-        else
+        if (outer)
         {
-            cout << "Error: Redefinition of variable '" << name << "'." << endl;
-            exit(1);
+            const Symbol *symbol = outer->find(name);
+            if (symbol && symbol->offset < outerEnd)
+            {
+                return symbol;
+            }
         }
+        return nullptr;
     }
 
-    bool lookup(const string &name)
+public:
+    explicit SymbolTable(const StringInterner &names) : names(names), outer(nullptr), outerEnd(0) {}
+
+    // Makes the variables `table` declares before source offset `end` visible
+    // here too, as if declared earlier in this table. They are not copied and
+    // do not appear in entries() or records().
+    void inherit(const SymbolTable &table, uint32_t end)
     {
-        return symbols.find(name) != symbols.end();
+        outer = &table;
+        outerEnd = end;
     }
 
-    Symbol &get(const string &name)
+    void insert(SymbolId name, TokenType type, int scopeLevel, int32_t length = 0, uint32_t offset = 0)
     {
-        if (lookup(name))
+        if (!lookup(name))
         {
-            return symbols[name];
+            if (name >= symbols.size())
+            {
+                symbols.resize(name + 1);
+                declared.resize(name + 1, false);
+            }
+            symbols[name] = {type, scopeLevel, false, length, offset};
+            declared[name] = true;
+            order.push_back(name);
         }
         else
         {
-            cout << "Error: Variable '" << name << "' not declared." << endl;
-            exit(1);
+            compileError(DIAGNOSTIC_SEMANTIC, 0, "Error: Redefinition of variable '", names.text(name), "'.");
         }
     }
 
-    void markInitialized(const string &name)
+    bool lookup(SymbolId name) const
     {
-        if (lookup(name))
+        return find(name) != nullptr;
+    }
+
+    // Ints the variable occupies in memory
+    int32_t storageSize(SymbolId name) const
+    {
+        const Symbol *symbol = find(name);
+        return symbol && symbol->length > 0 ? symbol->length : 1;
+    }
+
+    const Symbol &get(SymbolId name) const
+    {
+        const Symbol *symbol = find(name);
+        if (!symbol)
+        {
+            compileError(DIAGNOSTIC_SEMANTIC, 0, "Error: Variable '", names.text(name), "' not declared.");
+        }
+        return *symbol;
+    }
+
+    // Inherited variables are left as they are
+    void markInitialized(SymbolId name)
+    {
+        if (name < declared.size() && declared[name])
         {
             symbols[name].initialized = true;
         }
     }
-    void printTable() const
+
+    // Names this table declares, in the order they were declared
+    const vector<SymbolId> &declarations() const
+    {
+        return order;
+    }
+
+    // Moves the declarations at or after source offset `from` by `delta`
+    // bytes, for an edit before them
+    void shiftDeclarations(uint32_t from, int64_t delta)
+    {
+        for (SymbolId name : order)
+        {
+            if (symbols[name].offset >= from)
+            {
+                symbols[name].offset = static_cast<uint32_t>(symbols[name].offset + delta);
+            }
+        }
+    }
+
+    void moveDeclaration(SymbolId name, uint32_t offset)
+    {
+        symbols[name].offset = offset;
+    }
+
+    // Every declared variable in id order
+    vector<pair<SymbolId, Symbol>> entries() const
+    {
+        vector<pair<SymbolId, Symbol>> result;
+        for (SymbolId id = 0; id < declared.size(); id++)
+        {
+            if (declared[id])
+            {
+                result.emplace_back(id, symbols[id]);
+            }
+        }
+        return result;
+    }
+
+    // Every declared variable, sorted by name
+    vector<SymbolRecord> records() const
     {
-        cout << "Symbol Table:" << endl;
-        cout << "Name\tType\t\tScope\tInitialized" << endl;
-        cout << "--------------------------------------------" << endl;
-        for (const auto &entry : symbols)
+        // Ids are assigned in source order; list the table alphabetically
+        vector<SymbolId> order;
+        for (SymbolId id = 0; id < declared.size(); id++)
         {
-            const string &name = entry.first;
-            const Symbol &symbol = entry.second;
+            if (declared[id])
+            {
+                order.push_back(id);
+            }
+        }
+        sort(order.begin(), order.end(), [this](SymbolId a, SymbolId b)
+             { return names.text(a) < names.text(b); });
+
+        vector<SymbolRecord> result;
+        for (SymbolId id : order)
+        {
+            const Symbol &symbol = symbols[id];
 
             // Convert TokenType to a string for display purposes
             string typeStr;
@@ -137,290 +752,879 @@ public:
             default:
                 typeStr = "unknown";
             }
+            result.push_back(SymbolRecord{string(names.text(id)), typeStr, symbol.length, symbol.scopeLevel,
+                                          symbol.initialized});
+        }
+        return result;
+    }
 
-            cout << name << "\t" << typeStr << "\t\t" << symbol.scopeLevel << "\t"
-                 << (symbol.initialized ? "Yes" : "No") << endl;
+    static void printTable(ostream &out, const vector<SymbolRecord> &records)
+    {
+        out << "Symbol Table:" << endl;
+        out << "Name\tType\t\tScope\tInitialized" << endl;
+        out << "--------------------------------------------" << endl;
+        for (const SymbolRecord &symbol : records)
+        {
+            out << symbol.name << "\t" << symbol.type;
+            if (symbol.length > 0)
+            {
+                out << "[" << symbol.length << "]";
+            }
+            out << "\t\t" << symbol.scope << "\t" << (symbol.initialized ? "Yes" : "No") << endl;
         }
     }
 };
 
-struct TACInstruction
+enum TACOp : uint8_t
 {
-    string op;     // Operator (+, -, *, /, etc.)
-    string arg1;   // First operand
-    string arg2;   // Second operand (if any)
-    string result; // Result variable
+    OP_COPY, // result = arg1
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_GT,
+    OP_LT,
+    OP_EQ,
+    OP_NEQ,
+    OP_AND,
+    OP_OR,
+    OP_LABEL,         // result: label
+    OP_JUMP,          // goto result
+    OP_JUMP_IF_FALSE, // if arg1 == 0 goto result
+    OP_JUMP_IF_TRUE,  // if arg1 != 0 goto result
+    OP_LOAD,          // result = arg1[arg2]
+    OP_STORE,         // result[arg1] = arg2
 };
 
-class TACGenerator
+enum OperandKind : uint8_t
 {
-private:
-    vector<TACInstruction> instructions;
-    int tempCount;
+    OPERAND_NONE,
+    OPERAND_TEMP, // value is the temporary's number
+    OPERAND_VAR,  // value is the variable's SymbolId
+    OPERAND_IMM,  // value is the integer itself
+    OPERAND_LABEL, // value is the label's number
+    OPERAND_ARRAY, // value is the array's SymbolId
+    OPERAND_VTEMP, // value is the vector temporary's number; one lane per array element
+};
 
-public:
-    TACGenerator() : tempCount(0) {}
+struct Operand
+{
+    OperandKind kind;
+    int32_t value;
 
-    const vector<TACInstruction> &getInstructions() const
+    static Operand none()
     {
-        return instructions;
+        return Operand{OPERAND_NONE, 0};
     }
-
-    string newTemp()
+    static Operand temp(int32_t number)
     {
-        return "t" + to_string(tempCount++);
+        return Operand{OPERAND_TEMP, number};
     }
-
-    void addInstruction(const string &op, const string &arg1, const string &arg2, const string &result)
+    static Operand var(SymbolId id)
     {
-        instructions.push_back({op, arg1, arg2, result});
+        return Operand{OPERAND_VAR, static_cast<int32_t>(id)};
     }
-
-    void printInstructions()
+    static Operand imm(int32_t value)
     {
-        cout << "Three-Address Code:" << endl;
-        for (const auto &instr : instructions)
-        {
-            cout << instr.result << " = " << instr.arg1 << " " << instr.op << " " << instr.arg2 << endl;
-        }
+        return Operand{OPERAND_IMM, value};
+    }
+    static Operand label(int32_t number)
+    {
+        return Operand{OPERAND_LABEL, number};
+    }
+    static Operand array(SymbolId id)
+    {
+        return Operand{OPERAND_ARRAY, static_cast<int32_t>(id)};
+    }
+    static Operand vtemp(int32_t number)
+    {
+        return Operand{OPERAND_VTEMP, number};
+    }
+
+    bool operator==(const Operand &other) const
+    {
+        return kind == other.kind && value == other.value;
+    }
+    bool operator!=(const Operand &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// 28 bytes, no heap storage; a program's TAC is one contiguous vector of these
+struct TACInstruction
+{
+    TACOp op;
+    Operand result;
+    Operand arg1;
+    Operand arg2; // OPERAND_NONE for OP_COPY
+};
+
+inline bool isComparison(TACOp op)
+{
+    return op == OP_GT || op == OP_LT || op == OP_EQ || op == OP_NEQ;
+}
+
+inline bool isJump(TACOp op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+// Renders TAC in the "result = arg1 op arg2" text form. Control flow prints
+// as "L0:", "goto L0", "ifFalse t0 goto L0" and "if t0 goto L0"; array
+// accesses as "t0 = a[i]" and "a[i] = t0". A vector temporary v0 stands for
+// as many consecutive elements as the target's vector registers hold.
+class TACPrinter
+{
+private:
+    const StringInterner &names;
+
+public:
+    explicit TACPrinter(const StringInterner &names) : names(names) {}
+
+    static const char *opText(TACOp op)
+    {
+        switch (op)
+        {
+        case OP_COPY:
+            return " ";
+        case OP_ADD:
+            return "+";
+        case OP_SUB:
+            return "-";
+        case OP_MUL:
+            return "*";
+        case OP_DIV:
+            return "/";
+        case OP_GT:
+            return ">";
+        case OP_LT:
+            return "<";
+        case OP_EQ:
+            return "==";
+        case OP_NEQ:
+            return "!=";
+        case OP_AND:
+            return "&&";
+        case OP_OR:
+            return "||";
+        default:
+            return "?";
+        }
+    }
+
+    void printOperand(ostream &out, const Operand &operand) const
+    {
+        switch (operand.kind)
+        {
+        case OPERAND_TEMP:
+            out << 't' << operand.value;
+            break;
+        case OPERAND_VAR:
+        case OPERAND_ARRAY:
+            out << names.text(static_cast<SymbolId>(operand.value));
+            break;
+        case OPERAND_IMM:
+            out << operand.value;
+            break;
+        case OPERAND_LABEL:
+            out << 'L' << operand.value;
+            break;
+        case OPERAND_VTEMP:
+            out << 'v' << operand.value;
+            break;
+        case OPERAND_NONE:
+            break;
+        }
+    }
+
+    string operandText(const Operand &operand) const
+    {
+        ostringstream out;
+        printOperand(out, operand);
+        return out.str();
+    }
+
+    void print(ostream &out, const TACInstruction &instr) const
+    {
+        switch (instr.op)
+        {
+        case OP_LABEL:
+            printOperand(out, instr.result);
+            out << ':' << endl;
+            return;
+        case OP_JUMP:
+            out << "goto ";
+            printOperand(out, instr.result);
+            out << endl;
+            return;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            out << (instr.op == OP_JUMP_IF_FALSE ? "ifFalse " : "if ");
+            printOperand(out, instr.arg1);
+            out << " goto ";
+            printOperand(out, instr.result);
+            out << endl;
+            return;
+        case OP_LOAD:
+            printOperand(out, instr.result);
+            out << " = ";
+            printOperand(out, instr.arg1);
+            out << '[';
+            printOperand(out, instr.arg2);
+            out << ']' << endl;
+            return;
+        case OP_STORE:
+            printOperand(out, instr.result);
+            out << '[';
+            printOperand(out, instr.arg1);
+            out << "] = ";
+            printOperand(out, instr.arg2);
+            out << endl;
+            return;
+        default:
+            break;
+        }
+        printOperand(out, instr.result);
+        out << " = ";
+        printOperand(out, instr.arg1);
+        out << " " << opText(instr.op) << " ";
+        printOperand(out, instr.arg2);
+        out << endl;
+    }
+
+    string format(const TACInstruction &instr) const
+    {
+        ostringstream out;
+        print(out, instr);
+        string text = out.str();
+        text.pop_back(); // Trailing newline
+        return text;
+    }
+};
+
+class TACGenerator
+{
+private:
+    vector<TACInstruction> instructions;
+    int tempCount;
+    int labelCount;
+
+public:
+    TACGenerator() : tempCount(0), labelCount(0) {}
+
+    const vector<TACInstruction> &getInstructions() const
+    {
+        return instructions;
+    }
+
+    vector<TACInstruction> &getInstructions()
+    {
+        return instructions;
+    }
+
+    int getTempCount() const
+    {
+        return tempCount;
+    }
+
+    int getLabelCount() const
+    {
+        return labelCount;
+    }
+
+    Operand newTemp()
+    {
+        return Operand::temp(tempCount++);
+    }
+
+    Operand newLabel()
+    {
+        return Operand::label(labelCount++);
+    }
+
+    void addInstruction(TACOp op, Operand arg1, Operand arg2, Operand result)
+    {
+        instructions.push_back({op, result, arg1, arg2});
+    }
+
+    void addLabel(Operand label)
+    {
+        addInstruction(OP_LABEL, Operand::none(), Operand::none(), label);
+    }
+
+    void addJump(Operand label)
+    {
+        addInstruction(OP_JUMP, Operand::none(), Operand::none(), label);
+    }
+
+    void addJumpIfFalse(Operand condition, Operand label)
+    {
+        addInstruction(OP_JUMP_IF_FALSE, condition, Operand::none(), label);
+    }
+
+    void addJumpIfTrue(Operand condition, Operand label)
+    {
+        addInstruction(OP_JUMP_IF_TRUE, condition, Operand::none(), label);
+    }
+
+    size_t size() const
+    {
+        return instructions.size();
+    }
+
+    // Points the already emitted jumps at the given indices to `label`
+    void patchJumps(const vector<size_t> &jumps, Operand label)
+    {
+        for (size_t index : jumps)
+        {
+            instructions[index].result = label;
+        }
+    }
+
+    // Removes and returns the instructions emitted since `mark` (a previous
+    // size of the instruction list), for re-emitting later with append()
+    vector<TACInstruction> cutFrom(size_t mark)
+    {
+        vector<TACInstruction> cut(instructions.begin() + mark, instructions.end());
+        instructions.resize(mark);
+        return cut;
+    }
+
+    void append(const vector<TACInstruction> &code)
+    {
+        instructions.insert(instructions.end(), code.begin(), code.end());
+    }
+
+    // Moves out the instructions generated so far; temporaries keep numbering on
+    vector<TACInstruction> takeInstructions()
+    {
+        vector<TACInstruction> taken;
+        taken.swap(instructions);
+        return taken;
+    }
+};
+
+// Character classes for the lexer. Matches isspace/isdigit/isalpha in the C
+// locale without the per-call locale lookup.
+enum CharClass : uint8_t
+{
+    CC_SPACE = 1,
+    CC_DIGIT = 2,
+    CC_ALPHA = 4,
+};
+
+struct CharClassTable
+{
+    uint8_t bits[256];
+};
+
+constexpr CharClassTable buildCharClassTable()
+{
+    CharClassTable table{};
+    for (int c = 0; c < 256; c++)
+    {
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+            table.bits[c] |= CC_SPACE;
+        if (c >= '0' && c <= '9')
+            table.bits[c] |= CC_DIGIT;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            table.bits[c] |= CC_ALPHA;
+    }
+    return table;
+}
+
+constexpr CharClassTable CHAR_CLASSES = buildCharClassTable();
+
+inline bool hasCharClass(char c, uint8_t classes)
+{
+    return (CHAR_CLASSES.bits[static_cast<unsigned char>(c)] & classes) != 0;
+}
+
+// Byte-scanning kernels behind the lexer's hot loops. Each scans [p, end) and
+// returns the first byte that stops the scan, or end if none does.
+struct ScanKernels
+{
+    const char *name;
+    // First non-whitespace byte; adds the newlines skipped to `newlines`
+    const char *(*skipWhitespace)(const char *p, const char *end, size_t &newlines);
+    // First occurrence of `byte`
+    const char *(*findByte)(const char *p, const char *end, char byte);
+    // The '*' of the first "*/"; adds the newlines before it to `newlines`
+    const char *(*findCommentEnd)(const char *p, const char *end, size_t &newlines);
+    // First byte that is not a letter or digit
+    const char *(*skipAlnum)(const char *p, const char *end);
+};
+
+const char *skipWhitespaceScalar(const char *p, const char *end, size_t &newlines)
+{
+    while (p < end && hasCharClass(*p, CC_SPACE))
+    {
+        newlines += (*p == '\n');
+        p++;
+    }
+    return p;
+}
+
+const char *findByteScalar(const char *p, const char *end, char byte)
+{
+    while (p < end && *p != byte)
+        p++;
+    return p;
+}
+
+const char *findCommentEndScalar(const char *p, const char *end, size_t &newlines)
+{
+    while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/'))
+    {
+        newlines += (*p == '\n');
+        p++;
+    }
+    return p;
+}
+
+const char *skipAlnumScalar(const char *p, const char *end)
+{
+    while (p < end && hasCharClass(*p, CC_ALPHA | CC_DIGIT))
+        p++;
+    return p;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_X86_SCAN 1
+
+// Bytes in [lo, lo + span] compare equal to themselves under min_epu8 once
+// shifted down by lo, which gives an unsigned range test with SSE2 alone.
+#define SSE2_IN_RANGE(v, lo, span) \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)), _mm_set1_epi8(span)), _mm_sub_epi8(v, _mm_set1_epi8(lo)))
+#define AVX2_IN_RANGE(v, lo, span) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8(lo)), _mm256_set1_epi8(span)), _mm256_sub_epi8(v, _mm256_set1_epi8(lo)))
+
+__attribute__((target("sse2"))) const char *skipWhitespaceSSE2(const char *p, const char *end, size_t &newlines)
+{
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), SSE2_IN_RANGE(chunk, '\t', '\r' - '\t'));
+        uint32_t spaceMask = _mm_movemask_epi8(space);
+        uint32_t newlineMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+        if (spaceMask != 0xFFFF)
+        {
+            uint32_t stop = __builtin_ctz(~spaceMask);
+            newlines += __builtin_popcount(newlineMask & ((1u << stop) - 1));
+            return p + stop;
+        }
+        newlines += __builtin_popcount(newlineMask);
+        p += 16;
+    }
+    return skipWhitespaceScalar(p, end, newlines);
+}
+
+__attribute__((target("sse2"))) const char *findByteSSE2(const char *p, const char *end, char byte)
+{
+    __m128i target = _mm_set1_epi8(byte);
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, target));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return findByteScalar(p, end, byte);
+}
+
+__attribute__((target("sse2"))) const char *findCommentEndSSE2(const char *p, const char *end, size_t &newlines)
+{
+    // Each step also reads the byte after the chunk to pair '*' with '/'
+    while (end - p >= 17)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+        uint32_t closeMask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('*')), _mm_cmpeq_epi8(next, _mm_set1_epi8('/'))));
+        uint32_t newlineMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+        if (closeMask != 0)
+        {
+            uint32_t stop = __builtin_ctz(closeMask);
+            newlines += __builtin_popcount(newlineMask & ((1u << stop) - 1));
+            return p + stop;
+        }
+        newlines += __builtin_popcount(newlineMask);
+        p += 16;
+    }
+    return findCommentEndScalar(p, end, newlines);
+}
+
+__attribute__((target("sse2"))) const char *skipAlnumSSE2(const char *p, const char *end)
+{
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+        __m128i alnum = _mm_or_si128(SSE2_IN_RANGE(lower, 'a', 'z' - 'a'), SSE2_IN_RANGE(chunk, '0', 9));
+        uint32_t mask = _mm_movemask_epi8(alnum);
+        if (mask != 0xFFFF)
+        {
+            return p + __builtin_ctz(~mask);
+        }
+        p += 16;
+    }
+    return skipAlnumScalar(p, end);
+}
+
+__attribute__((target("avx2"))) const char *skipWhitespaceAVX2(const char *p, const char *end, size_t &newlines)
+{
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')), AVX2_IN_RANGE(chunk, '\t', '\r' - '\t'));
+        uint32_t spaceMask = _mm256_movemask_epi8(space);
+        uint32_t newlineMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')));
+        if (spaceMask != 0xFFFFFFFFu)
+        {
+            uint32_t stop = __builtin_ctz(~spaceMask);
+            newlines += __builtin_popcount(newlineMask & ((1u << stop) - 1));
+            return p + stop;
+        }
+        newlines += __builtin_popcount(newlineMask);
+        p += 32;
+    }
+    return skipWhitespaceSSE2(p, end, newlines);
+}
+
+__attribute__((target("avx2"))) const char *findByteAVX2(const char *p, const char *end, char byte)
+{
+    __m256i target = _mm256_set1_epi8(byte);
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, target));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return findByteSSE2(p, end, byte);
+}
+
+__attribute__((target("avx2"))) const char *findCommentEndAVX2(const char *p, const char *end, size_t &newlines)
+{
+    while (end - p >= 33)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 1));
+        uint32_t closeMask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('*')), _mm256_cmpeq_epi8(next, _mm256_set1_epi8('/'))));
+        uint32_t newlineMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')));
+        if (closeMask != 0)
+        {
+            uint32_t stop = __builtin_ctz(closeMask);
+            newlines += __builtin_popcount(newlineMask & ((1u << stop) - 1));
+            return p + stop;
+        }
+        newlines += __builtin_popcount(newlineMask);
+        p += 32;
+    }
+    return findCommentEndSSE2(p, end, newlines);
+}
+
+__attribute__((target("avx2"))) const char *skipAlnumAVX2(const char *p, const char *end)
+{
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i lower = _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+        __m256i alnum = _mm256_or_si256(AVX2_IN_RANGE(lower, 'a', 'z' - 'a'), AVX2_IN_RANGE(chunk, '0', 9));
+        uint32_t mask = _mm256_movemask_epi8(alnum);
+        if (mask != 0xFFFFFFFFu)
+        {
+            return p + __builtin_ctz(~mask);
+        }
+        p += 32;
+    }
+    return skipAlnumSSE2(p, end);
+}
+#endif
+
+// Picks the widest kernels the running CPU supports
+ScanKernels selectScanKernels()
+{
+#ifdef HAVE_X86_SCAN
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return {"avx2", skipWhitespaceAVX2, findByteAVX2, findCommentEndAVX2, skipAlnumAVX2};
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return {"sse2", skipWhitespaceSSE2, findByteSSE2, findCommentEndSSE2, skipAlnumSSE2};
+    }
+#endif
+    return {"scalar", skipWhitespaceScalar, findByteScalar, findCommentEndScalar, skipAlnumScalar};
+}
+
+const ScanKernels &scanKernels()
+{
+    static const ScanKernels kernels = selectScanKernels();
+    return kernels;
+}
+
+class Lexer : public TokenSource
+{
+private:
+    string_view src;
+    size_t pos;
+    int line;
+    StringInterner &interner;
+    const ScanKernels &scan;
+
+    const char *at(size_t offset) const
+    {
+        return src.data() + offset;
+    }
+
+    const char *end() const
+    {
+        return src.data() + src.size();
     }
-};
-
-class Lexer
-{
-private:
-    string src;
-    size_t pos;
-    int line;
 
 public:
-    Lexer(const string &src)
+    Lexer(string_view src, StringInterner &interner) : interner(interner), scan(scanKernels())
     {
+        if (src.size() > UINT32_MAX)
+        {
+            compileError(DIAGNOSTIC_INPUT, 0, "Error: Source files larger than 4 GB are not supported");
+        }
         this->src = src;
         this->pos = 0;
         this->line = 1;
     }
 
-    vector<Token> tokenize()
+    StringInterner &getInterner()
     {
-        vector<Token> tokens;
+        return interner;
+    }
+
+    // Resumes scanning at `offset`, which must be where a token or the
+    // whitespace before one starts, with `line` as the current line
+    void seek(size_t offset, int line)
+    {
+        this->pos = min(offset, src.size());
+        this->line = line;
+    }
 
+    // Scans the next token. Once the input is exhausted every call returns T_EOF.
+    Token next()
+    {
         while (pos < src.size())
         {
             char current = src[pos];
-            if (current == '\n')
-            {
-                line++;
-            }
-
-            if (isspace(current))
+            if (hasCharClass(current, CC_SPACE))
             {
-                pos++;
+                size_t newlines = 0;
+                pos = scan.skipWhitespace(at(pos), end(), newlines) - at(0);
+                line += newlines;
                 continue;
             }
             // Single line comment
             if (current == '/' && peek() == '/')
             {
-                pos += 2;
-                while (src[pos] != '\n')
-                {
-                    pos++;
-                }
+                pos = scan.findByte(at(pos + 2), end(), '\n') - at(0);
                 continue;
             }
             // Multi-line comment
             if (current == '/' && peek() == '*')
             {
-                pos += 2;
-                while (pos < src.size())
-                {
-                    if (src[pos] == '*' && peek() == '/')
-                    {
-                        pos += 2;
-                        break;
-                    }
-                    pos++;
-                }
+                size_t newlines = 0;
+                const char *close = scan.findCommentEnd(at(pos + 2), end(), newlines);
+                line += newlines;
+                pos = close == end() ? src.size() : close - at(0) + 2;
                 continue;
             }
 
-            if (isdigit(current))
+            uint32_t start = static_cast<uint32_t>(pos);
+            if (hasCharClass(current, CC_DIGIT))
             {
-                tokens.push_back(Token{T_NUM, consumeNumber()});
-                continue;
+                return Token{T_NUM, start, interner.intern(consumeNumber())};
             }
             if (current == '"')
             {
-                tokens.push_back(Token{T_SENTENCE, consumeString()});
-                continue;
+                return Token{T_SENTENCE, start, interner.intern(consumeString())};
             }
             if (current == '\'')
             {
-                tokens.push_back(Token{T_SENTENCE, consumeString()});
-                continue;
+                return Token{T_SENTENCE, start, interner.intern(consumeString())};
             }
 
-            if (isalpha(current))
-            {
-                string word = consumeWord();
-                if (word == "int")
-                    tokens.push_back(Token{T_INT, word});
-                else if (word == "float")
-                    tokens.push_back(Token{T_FLOAT, word});
-                else if (word == "double")
-                    tokens.push_back(Token{T_DOUBLE, word});
-                else if (word == "string")
-                    tokens.push_back(Token{T_STRING, word});
-                else if (word == "bool")
-                    tokens.push_back(Token{T_BOOL, word});
-                else if (word == "char")
-                    tokens.push_back(Token{T_CHAR, word});
-                else if (word == "if")
-                    tokens.push_back(Token{T_IF, word});
-                else if (word == "else")
-                    tokens.push_back(Token{T_ELSE, word});
-                else if (word == "return")
-                    tokens.push_back(Token{T_RETURN, word});
-                else if (word == "while")
-                    tokens.push_back(Token{T_WHILE, word});
-                else if (word == "for")
-                    tokens.push_back(Token{T_FOR, word});
-                else
-                    tokens.push_back(Token{T_ID, word});
-                continue;
+            if (hasCharClass(current, CC_ALPHA))
+            {
+                string_view word = consumeWord();
+                TokenType type = classifyKeyword(word);
+                return Token{type, start, type == T_ID ? interner.intern(word) : NO_SYMBOL};
             }
 
+            TokenType type;
             switch (current)
             {
             case '=':
                 if (peek() == '=')
                 {
                     pos++;
-                    tokens.push_back(Token{T_EQ, "=="});
+                    type = T_EQ;
                 }
                 else
                 {
-                    tokens.push_back(Token{T_ASSIGN, "="});
+                    type = T_ASSIGN;
                 }
                 break;
             case '+':
-                tokens.push_back(Token{T_PLUS, "+"});
+                type = T_PLUS;
                 break;
             case '-':
-                tokens.push_back(Token{T_MINUS, "-"});
+                type = T_MINUS;
                 break;
             case '*':
-                tokens.push_back(Token{T_MUL, "*"});
+                type = T_MUL;
                 break;
             case '/':
-                tokens.push_back(Token{T_DIV, "/"});
+                type = T_DIV;
                 break;
             case '(':
-                tokens.push_back(Token{T_LPAREN, "("});
+                type = T_LPAREN;
                 break;
             case ')':
-                tokens.push_back(Token{T_RPAREN, ")"});
+                type = T_RPAREN;
                 break;
             case '{':
-                tokens.push_back(Token{T_LBRACE, "{"});
+                type = T_LBRACE;
                 break;
             case '}':
-                tokens.push_back(Token{T_RBRACE, "}"});
+                type = T_RBRACE;
+                break;
+            case '[':
+                type = T_LBRACKET;
+                break;
+            case ']':
+                type = T_RBRACKET;
                 break;
             case ';':
-                tokens.push_back(Token{T_SEMICOLON, ";"});
+                type = T_SEMICOLON;
                 break;
             case '>':
-                tokens.push_back(Token{T_GT, ">"});
+                type = T_GT;
                 break;
             case '<':
-                tokens.push_back(Token{T_LT, "<"});
+                type = T_LT;
                 break;
             case '&':
                 if (peek() == '&')
                 {
                     pos++;
-                    tokens.push_back(Token{T_AND, "&&"});
+                    type = T_AND;
                 }
                 else
                 {
-                    cout << "Unexpected character '&' at line " << line << endl;
-                    exit(1);
+                    compileError(DIAGNOSTIC_LEXICAL, line, "Unexpected character '&' at line ", line);
                 }
                 break;
             case '|':
                 if (peek() == '|')
                 {
                     pos++;
-                    tokens.push_back(Token{T_OR, "||"});
+                    type = T_OR;
                 }
                 else
                 {
-                    cout << "Unexpected character '|' at line " << line << endl;
-                    exit(1);
+                    compileError(DIAGNOSTIC_LEXICAL, line, "Unexpected character '|' at line ", line);
                 }
                 break;
             case '!':
                 if (peek() == '=')
                 {
                     pos++;
-                    tokens.push_back(Token{T_NEQ, "!="});
+                    type = T_NEQ;
                 }
                 else
                 {
-                    cout << "Unexpected character '!' at line " << line << endl;
-                    exit(1);
+                    compileError(DIAGNOSTIC_LEXICAL, line, "Unexpected character '!' at line ", line);
                 }
                 break;
             default:
-                cout << "Unexpected character: " << current << " at line " << line << endl;
-                exit(1);
+                compileError(DIAGNOSTIC_LEXICAL, line, "Unexpected character: ", current, " at line ", line);
             }
             pos++;
+            return Token{type, start, NO_SYMBOL};
         }
-        tokens.push_back(Token{T_EOF, ""});
-        return tokens;
+        return Token{T_EOF, static_cast<uint32_t>(pos), NO_SYMBOL};
     }
 
-    char peek()
+    size_t fill(Token *out, size_t capacity) override
     {
-        if (pos + 1 >= src.size())
-            return '\0';
+        for (size_t i = 0; i < capacity; i++)
+        {
+            out[i] = next();
+            if (out[i].type == T_EOF)
+            {
+                return i + 1;
+            }
+        }
+        return capacity;
+    }
+
+    // Lexes the whole input up front, for printTokens and other whole-file uses
+    TokenStream tokenize()
+    {
+        TokenStream tokens(interner);
+        Token token;
+        do
+        {
+            token = next();
+            tokens.push(token);
+        } while (token.type != T_EOF);
+        return tokens;
+    }
+
+
+    char peek()
+    {
+        if (pos + 1 >= src.size())
+            return '\0';
         return src[pos + 1];
     }
 
-    string consumeNumber()
+    string_view consumeNumber()
     {
         size_t start = pos;
-        while (pos < src.size() && isdigit(src[pos]))
+        while (pos < src.size() && hasCharClass(src[pos], CC_DIGIT))
             pos++;
         return src.substr(start, pos - start);
     }
 
-    string consumeWord()
+    string_view consumeWord()
     {
         size_t start = pos;
-        while (pos < src.size() && isalnum(src[pos]))
-            pos++;
+        pos = scan.skipAlnum(at(pos), end()) - at(0);
         return src.substr(start, pos - start);
     }
-    string consumeString()
+    string_view consumeString()
     {
-        pos++; // Skip the opening double quote
+        char quote = src[pos];
+        pos++; // Skip the opening quote
         size_t start = pos;
-        while (pos < src.size() && src[pos] != '"')
-        {
-            pos++;
-        }
+        pos = scan.findByte(at(pos), end(), quote) - at(0);
 
         if (pos >= src.size())
         {
-            cout << "Error: Unterminated string at line " << line << endl
-                 << "Hint: Check if all your strings are enclosed in double quotes" << endl;
-            exit(1);
+            compileError(DIAGNOSTIC_LEXICAL, line, "Error: Unterminated string at line ", line,
+                         "\nHint: Check if all your strings are enclosed in double quotes");
         }
 
-        string str = src.substr(start, pos - start);
+        string_view str = src.substr(start, pos - start);
         pos++; // Skip the closing quote
 
         return str;
@@ -430,6 +1634,13 @@ public:
     {
         return line;
     }
+
+    // Line containing the given source offset. Only reads the source, so it
+    // is safe to call from a thread other than the one lexing.
+    int lineOf(uint32_t offset) const
+    {
+        return 1 + static_cast<int>(count(src.begin(), src.begin() + min<size_t>(offset, src.size()), '\n'));
+    }
     string tokenTypeToString(TokenType type)
     {
         switch (type)
@@ -492,6 +1703,10 @@ public:
             return "T_WHILE";
         case T_FOR:
             return "T_FOR";
+        case T_LBRACKET:
+            return "T_LBRACKET";
+        case T_RBRACKET:
+            return "T_RBRACKET";
         case T_EOF:
             return "T_EOF";
         case T_SENTENCE:
@@ -500,119 +1715,252 @@ public:
             return "UNKNOWN";
         }
     }
-    void printTokens(const vector<Token> &tokens)
+    void printToken(ostream &out, const Token &token)
+    {
+        out << "Type: " << tokenTypeToString(token.type)
+            << ", Value: " << tokenValue(token, interner) << endl;
+    }
+    void printTokens(ostream &out, const TokenStream &tokens)
     {
-        cout << "Tokens:" << endl;
-        for (const Token &token : tokens)
+        out << "Tokens:" << endl;
+        for (size_t i = 0; i < tokens.size(); i++)
         {
-            cout << "Type: " << tokenTypeToString(token.type)
-                 << ", Value: " << token.value << endl;
+            printToken(out, tokens[i]);
         }
     }
 };
 
+// What an expression compiles to. Values (arithmetic, comparisons) are an
+// operand. && and || compile to jumping code instead: control falls through
+// when the expression is true and leaves through one of `falseJumps` when it
+// is false; `trueJumps` are taken when true and must land on the fall-through
+// path. Both hold instruction indices whose targets are patched later.
+struct ExprResult
+{
+    Operand value;
+    vector<size_t> trueJumps;
+    vector<size_t> falseJumps;
+    bool jumping;
+};
+
+// Points in a block the parser reports to a block handler: before its open
+// brace, before each statement directly in it and before its close brace
+enum BlockEvent
+{
+    BLOCK_OPENS,
+    BLOCK_STATEMENT,
+    BLOCK_CLOSES
+};
+
 class Parser
 {
 private:
-    vector<Token> tokens;
-    size_t pos;
+    TokenBuffer tokens;
     Lexer &lexer;
+    const StringInterner &names;
     SymbolTable symbolTable;
     int currentScopeLevel;
     TACGenerator tacGenerator;
+    function<void(vector<TACInstruction> &&)> tacBatchHandler;
+    size_t tacBatchSize;
+    function<void(BlockEvent)> blockHandler;
+    int loopSteps; // For loop steps being parsed, whose code is moved
+    size_t failedAt;
+
+    // Throws a CompileError for the source at `offset`: the parts, then " at line N"
+    template <typename... Parts>
+    [[noreturn]] void errorAt(DiagnosticKind kind, size_t offset, const Parts &...parts)
+    {
+        failedAt = offset;
+        int line = lexer.lineOf(offset);
+        compileError(kind, line, parts..., " at line ", line);
+    }
 
 public:
-    Parser(const vector<Token> &tokens, Lexer &lexer)
-        : tokens(tokens), pos(0), lexer(lexer), currentScopeLevel(0) {}
+    Parser(TokenSource &source, Lexer &lexer)
+        : tokens(source), lexer(lexer), names(lexer.getInterner()),
+          symbolTable(names), currentScopeLevel(0), tacBatchSize(0), loopSteps(0), failedAt(SIZE_MAX) {}
 
     void parseProgram()
     {
-        while (tokens[pos].type != T_EOF)
+        while (tokens.peek().type != T_EOF)
         {
             parseStatement();
+            if (tacBatchHandler && tacGenerator.getInstructions().size() >= tacBatchSize)
+            {
+                tacBatchHandler(tacGenerator.takeInstructions());
+            }
         }
-        cout << "Parsing completed successfully! No Syntax Error" << endl;
+    }
+
+    // Hands finished TAC to `handler` in batches of at least `batchSize`
+    // instructions as parsing proceeds, instead of keeping all of it in the
+    // TACGenerator. Batches are cut only between top-level statements.
+    void setTACBatchHandler(function<void(vector<TACInstruction> &&)> handler, size_t batchSize)
+    {
+        tacBatchHandler = handler;
+        tacBatchSize = batchSize;
+    }
+
+    // Calls `handler` at each point of a block listed in BlockEvent, where
+    // it can read the parser's position and output so far. Blocks in a for
+    // loop's step are left out: their code moves after the body.
+    void setBlockHandler(function<void(BlockEvent)> handler)
+    {
+        blockHandler = handler;
     }
 
     void parseStatement()
     {
-        if (tokens[pos].type == T_INT || tokens[pos].type == T_FLOAT || tokens[pos].type == T_DOUBLE ||
-            tokens[pos].type == T_STRING || tokens[pos].type == T_CHAR || tokens[pos].type == T_BOOL)
+        if (tokens.peek().type == T_INT || tokens.peek().type == T_FLOAT || tokens.peek().type == T_DOUBLE ||
+            tokens.peek().type == T_STRING || tokens.peek().type == T_CHAR || tokens.peek().type == T_BOOL)
         {
             parseDeclaration();
         }
-        else if (tokens[pos].type == T_ID)
+        else if (tokens.peek().type == T_ID)
         {
             parseAssignment();
         }
-        else if (tokens[pos].type == T_IF)
+        else if (tokens.peek().type == T_IF)
         {
             parseIfStatement();
         }
-        else if (tokens[pos].type == T_RETURN)
+        else if (tokens.peek().type == T_RETURN)
         {
             parseReturnStatement();
         }
-        else if (tokens[pos].type == T_LBRACE)
+        else if (tokens.peek().type == T_LBRACE)
         {
             parseBlock();
         }
-        else if (tokens[pos].type == T_WHILE || tokens[pos].type == T_FOR)
+        else if (tokens.peek().type == T_WHILE || tokens.peek().type == T_FOR)
         {
             parseLoop();
         }
         else
         {
-            cout << "Syntax error: unexpected token " << tokens[pos].value << " at line " << lexer.getLineNumber() << endl;
-            exit(1);
+            errorAt(DIAGNOSTIC_SYNTAX, tokens.peek().offset, "Syntax error: unexpected token ", tokenValue(tokens.peek(), names));
         }
     }
 
     void parseBlock()
     {
+        bool report = blockHandler && loopSteps == 0;
+        if (report)
+        {
+            blockHandler(BLOCK_OPENS);
+        }
         expect(T_LBRACE);
-        while (tokens[pos].type != T_RBRACE && tokens[pos].type != T_EOF)
+        while (tokens.peek().type != T_RBRACE && tokens.peek().type != T_EOF)
         {
+            if (report)
+            {
+                blockHandler(BLOCK_STATEMENT);
+            }
             parseStatement();
         }
+        if (report)
+        {
+            blockHandler(BLOCK_CLOSES);
+        }
         expect(T_RBRACE);
     }
 
     void parseDeclaration()
     {
-        TokenType varType = tokens[pos].type;
-        pos++;
+        TokenType varType = tokens.peek().type;
+        tokens.advance();
 
-        if (tokens[pos].type == T_ID)
+        if (tokens.peek().type == T_ID)
         {
-            string varName = tokens[pos].value;
-            symbolTable.insert(varName, varType, currentScopeLevel);
-            pos++;
+            SymbolId varName = tokens.peek().id;
+            uint32_t offset = tokens.peek().offset;
+            tokens.advance();
+            int32_t length = 0;
+            if (tokens.peek().type == T_LBRACKET)
+            {
+                length = parseArrayLength(varType);
+            }
+            symbolTable.insert(varName, varType, currentScopeLevel, length, offset);
             expect(T_SEMICOLON);
         }
         else
         {
-            cout << "Syntax error: expected identifier after type at line " << lexer.getLineNumber() << endl;
-            exit(1);
+            errorAt(DIAGNOSTIC_SYNTAX, tokens.peek().offset, "Syntax error: expected identifier after type");
+        }
+    }
+
+    // [N] after an array name in a declaration; only int arrays exist
+    int32_t parseArrayLength(TokenType elementType)
+    {
+        expect(T_LBRACKET);
+        Operand length = tokens.peek().type == T_NUM ? parseFactor() : Operand::none();
+        if (elementType != T_INT || length.kind != OPERAND_IMM || length.value == 0)
+        {
+            errorAt(DIAGNOSTIC_SYNTAX, tokens.peek().offset, "Syntax error: arrays need type int and a positive constant length");
+        }
+        expect(T_RBRACKET);
+        return length.value;
+    }
+
+    // [index] after the name of array `name`. Constant indices are checked
+    // against the array's length here; others are not checked at all.
+    Operand parseIndex(SymbolId name)
+    {
+        size_t offset = tokens.peek().offset;
+        expect(T_LBRACKET);
+        Operand index = parseExpression();
+        expect(T_RBRACKET);
+        int32_t length = symbolTable.get(name).length;
+        if (index.kind == OPERAND_IMM && (index.value < 0 || index.value >= length))
+        {
+            errorAt(DIAGNOSTIC_SEMANTIC, offset, "Error: Index ", index.value, " out of bounds for array '", names.text(name),
+                    "' of length ", length);
+        }
+        return index;
+    }
+
+    // Arrays must be indexed and only arrays can be
+    void checkIndexed(SymbolId name, bool indexed, size_t offset)
+    {
+        if (!symbolTable.lookup(name))
+        {
+            errorAt(DIAGNOSTIC_SEMANTIC, offset, "Error: Variable '", names.text(name), "' not declared");
+        }
+        if ((symbolTable.get(name).length > 0) != indexed)
+        {
+            errorAt(DIAGNOSTIC_SEMANTIC, offset, "Error: '", names.text(name), (indexed ? "' is not an array" : "' is an array and needs an index"));
         }
     }
 
     void parseAssignment()
     {
-        string varName = tokens[pos].value;
-        string exprResult;
+        SymbolId varName = tokens.peek().id;
+        Operand exprResult = Operand::none();
 
         if (!symbolTable.lookup(varName))
         {
-            cout << "Error: Variable '" << varName << "' not declared at line " << lexer.getLineNumber() << endl;
-            exit(1);
+            errorAt(DIAGNOSTIC_SEMANTIC, tokens.peek().offset, "Error: Variable '", names.text(varName), "' not declared");
         }
 
-        pos++;
+        size_t offset = tokens.peek().offset;
+        tokens.advance();
+        bool indexed = tokens.peek().type == T_LBRACKET;
+        checkIndexed(varName, indexed, offset);
+        if (indexed)
+        {
+            Operand index = parseIndex(varName);
+            expect(T_ASSIGN);
+            Operand value = parseExpression();
+            expect(T_SEMICOLON);
+            tacGenerator.addInstruction(OP_STORE, index, value, Operand::array(varName));
+            symbolTable.markInitialized(varName);
+            return;
+        }
         expect(T_ASSIGN);
-        if (tokens[pos].type == T_SENTENCE)
+        if (tokens.peek().type == T_SENTENCE)
         {
-            pos++;
+            tokens.advance();
             expect(T_SEMICOLON);
         }
         else
@@ -621,44 +1969,82 @@ public:
             expect(T_SEMICOLON);
         }
 
-        tacGenerator.addInstruction(" ", exprResult, "", varName);
+        tacGenerator.addInstruction(OP_COPY, exprResult, Operand::none(), Operand::var(varName));
         symbolTable.markInitialized(varName);
     }
 
+    //     <cond jumps to Lelse>          <cond jumps to Lend>
+    //     <then>                         <then>
+    //     goto Lend                  Lend:
+    //   Lelse:
+    //     <else>
+    //   Lend:
     void parseIfStatement()
     {
         expect(T_IF);
         expect(T_LPAREN);
-        parseExpression();
+        vector<size_t> falseJumps = parseCondition();
         expect(T_RPAREN);
+        Operand elseLabel = tacGenerator.newLabel();
         parseStatement();
-        if (tokens[pos].type == T_ELSE)
+        if (tokens.peek().type == T_ELSE)
         {
+            Operand endLabel = tacGenerator.newLabel();
+            tacGenerator.addJump(endLabel);
+            tacGenerator.addLabel(elseLabel);
+            tacGenerator.patchJumps(falseJumps, elseLabel);
             expect(T_ELSE);
             parseStatement();
+            tacGenerator.addLabel(endLabel);
+        }
+        else
+        {
+            tacGenerator.addLabel(elseLabel);
+            tacGenerator.patchJumps(falseJumps, elseLabel);
         }
     }
 
+    //     <init>                         (for only)
+    //   Lcond:
+    //     <cond jumps to Lend>
+    //     <body>
+    //     <step>                         (for only)
+    //     goto Lcond
+    //   Lend:
     void parseLoop()
     {
-        if (tokens[pos].type == T_WHILE)
+        Operand condLabel = tacGenerator.newLabel();
+        Operand endLabel = tacGenerator.newLabel();
+        if (tokens.peek().type == T_WHILE)
         {
             expect(T_WHILE);
             expect(T_LPAREN);
-            parseExpression();
+            tacGenerator.addLabel(condLabel);
+            tacGenerator.patchJumps(parseCondition(), endLabel);
             expect(T_RPAREN);
             parseStatement();
+            tacGenerator.addJump(condLabel);
+            tacGenerator.addLabel(endLabel);
         }
-        else if (tokens[pos].type == T_FOR)
+        else if (tokens.peek().type == T_FOR)
         {
             expect(T_FOR);
             expect(T_LPAREN);
             parseStatement();
-            parseExpression();
+            tacGenerator.addLabel(condLabel);
+            tacGenerator.patchJumps(parseCondition(), endLabel);
             expect(T_SEMICOLON);
+            // The step is parsed here but runs after the body
+            size_t stepStart = tacGenerator.size();
+            loopSteps++;
             parseStatement();
+            loopSteps--;
+            vector<TACInstruction> step = tacGenerator.cutFrom(stepStart);
             expect(T_RPAREN);
             parseStatement();
+            tacGenerator.append(step);
+            tacGenerator.addJump(condLabel);
+            tacGenerator.addLabel(endLabel);
         }
     }
 
@@ -669,117 +2055,271 @@ public:
         expect(T_SEMICOLON);
     }
 
-    string parseExpression()
+    static TACOp binaryOp(TokenType type)
     {
-        string lhs = parseTerm();
+        switch (type)
+        {
+        case T_PLUS:
+            return OP_ADD;
+        case T_MINUS:
+            return OP_SUB;
+        case T_MUL:
+            return OP_MUL;
+        case T_DIV:
+            return OP_DIV;
+        case T_GT:
+            return OP_GT;
+        case T_LT:
+            return OP_LT;
+        case T_EQ:
+            return OP_EQ;
+        case T_NEQ:
+            return OP_NEQ;
+        case T_AND:
+            return OP_AND;
+        default:
+            return OP_OR;
+        }
+    }
 
-        while (tokens[pos].type == T_PLUS || tokens[pos].type == T_MINUS || tokens[pos].type == T_GT ||
-               tokens[pos].type == T_LT || tokens[pos].type == T_EQ || tokens[pos].type == T_NEQ ||
-               tokens[pos].type == T_AND || tokens[pos].type == T_OR)
+    // Places a new label here and points `jumps` at it
+    void placeLabel(const vector<size_t> &jumps)
+    {
+        if (jumps.empty())
         {
-            TokenType op = tokens[pos].type;
-            pos++;
-            string rhs = parseTerm();
-            string temp = tacGenerator.newTemp();
-            string opStr;
-            switch (op)
+            return;
+        }
+        Operand label = tacGenerator.newLabel();
+        tacGenerator.addLabel(label);
+        tacGenerator.patchJumps(jumps, label);
+    }
+
+    // Turns a value into jumping code: falls through when it is non-zero
+    void toJumps(ExprResult &expr)
+    {
+        if (!expr.jumping)
+        {
+            expr.falseJumps.push_back(tacGenerator.size());
+            tacGenerator.addJumpIfFalse(expr.value, Operand::none());
+            expr.jumping = true;
+        }
+    }
+
+    // Materializes jumping code as a 0/1 temporary, for when the value of
+    // a condition is stored rather than branched on
+    Operand toValue(ExprResult &expr)
+    {
+        if (!expr.jumping)
+        {
+            return expr.value;
+        }
+        Operand temp = tacGenerator.newTemp();
+        Operand endLabel = tacGenerator.newLabel();
+        placeLabel(expr.trueJumps);
+        tacGenerator.addInstruction(OP_COPY, Operand::imm(1), Operand::none(), temp);
+        tacGenerator.addJump(endLabel);
+        placeLabel(expr.falseJumps);
+        tacGenerator.addInstruction(OP_COPY, Operand::imm(0), Operand::none(), temp);
+        tacGenerator.addLabel(endLabel);
+        return temp;
+    }
+
+    Operand parseExpression()
+    {
+        ExprResult expr = parseLogicalOr();
+        return toValue(expr);
+    }
+
+    // Parses a branch condition. Control falls through when it holds; the
+    // returned jumps, still to be patched, are taken when it does not.
+    vector<size_t> parseCondition()
+    {
+        ExprResult expr = parseLogicalOr();
+        toJumps(expr);
+        placeLabel(expr.trueJumps);
+        return expr.falseJumps;
+    }
+
+    // a || b: a true left side skips the right one
+    ExprResult parseLogicalOr()
+    {
+        ExprResult lhs = parseLogicalAnd();
+        while (tokens.peek().type == T_OR)
+        {
+            tokens.advance();
+            if (lhs.jumping)
             {
-            case T_PLUS:
-                opStr = "+";
-                break;
-            case T_MINUS:
-                opStr = "-";
-                break;
-            case T_GT:
-                opStr = ">";
-                break;
-            case T_LT:
-                opStr = "<";
-                break;
-            case T_EQ:
-                opStr = "==";
-                break;
-            case T_NEQ:
-                opStr = "!=";
-                break;
-            case T_AND:
-                opStr = "&&";
-                break;
-            case T_OR:
-                opStr = "||";
-                break;
-            default:
-                opStr = "?";
+                // Falling through means true; the false exits continue at b
+                lhs.trueJumps.push_back(tacGenerator.size());
+                tacGenerator.addJump(Operand::none());
+                placeLabel(lhs.falseJumps);
+                lhs.falseJumps.clear();
             }
-            tacGenerator.addInstruction(opStr, lhs, rhs, temp);
+            else
+            {
+                lhs.trueJumps.push_back(tacGenerator.size());
+                tacGenerator.addJumpIfTrue(lhs.value, Operand::none());
+                lhs.jumping = true;
+            }
+            ExprResult rhs = parseLogicalAnd();
+            toJumps(rhs);
+            lhs.trueJumps.insert(lhs.trueJumps.end(), rhs.trueJumps.begin(), rhs.trueJumps.end());
+            lhs.falseJumps = move(rhs.falseJumps);
+        }
+        return lhs;
+    }
+
+    // a && b: a false left side skips the right one
+    ExprResult parseLogicalAnd()
+    {
+        ExprResult lhs{parseEquality(), {}, {}, false};
+        while (tokens.peek().type == T_AND)
+        {
+            tokens.advance();
+            toJumps(lhs);
+            placeLabel(lhs.trueJumps);
+            lhs.trueJumps.clear();
+            ExprResult rhs{parseEquality(), {}, {}, false};
+            toJumps(rhs);
+            lhs.falseJumps.insert(lhs.falseJumps.end(), rhs.falseJumps.begin(), rhs.falseJumps.end());
+        }
+        return lhs;
+    }
+
+    Operand parseEquality()
+    {
+        Operand lhs = parseRelational();
+        while (tokens.peek().type == T_EQ || tokens.peek().type == T_NEQ)
+        {
+            TokenType op = tokens.peek().type;
+            tokens.advance();
+            Operand rhs = parseRelational();
+            Operand temp = tacGenerator.newTemp();
+            tacGenerator.addInstruction(binaryOp(op), lhs, rhs, temp);
             lhs = temp;
         }
         return lhs;
     }
 
-    string parseTerm()
+    Operand parseRelational()
     {
-        string lhs = parseFactor();
-        while (tokens[pos].type == T_MUL || tokens[pos].type == T_DIV)
+        Operand lhs = parseAdditive();
+        while (tokens.peek().type == T_GT || tokens.peek().type == T_LT)
         {
-            TokenType op = tokens[pos].type;
-            pos++;
-            string rhs = parseFactor();
-            string temp = tacGenerator.newTemp();
-            string opStr = (op == T_MUL) ? "*" : "/";
-            tacGenerator.addInstruction(opStr, lhs, rhs, temp);
+            TokenType op = tokens.peek().type;
+            tokens.advance();
+            Operand rhs = parseAdditive();
+            Operand temp = tacGenerator.newTemp();
+            tacGenerator.addInstruction(binaryOp(op), lhs, rhs, temp);
             lhs = temp;
         }
         return lhs;
     }
 
-    string parseFactor()
+    Operand parseAdditive()
     {
-        if (tokens[pos].type == T_NUM)
+        Operand lhs = parseTerm();
+        while (tokens.peek().type == T_PLUS || tokens.peek().type == T_MINUS)
         {
-            string numValue = tokens[pos].value;
-            pos++;
-            return numValue;
+            TokenType op = tokens.peek().type;
+            tokens.advance();
+            Operand rhs = parseTerm();
+            Operand temp = tacGenerator.newTemp();
+            tacGenerator.addInstruction(binaryOp(op), lhs, rhs, temp);
+            lhs = temp;
+        }
+        return lhs;
+    }
+
+    Operand parseTerm()
+    {
+        Operand lhs = parseFactor();
+        while (tokens.peek().type == T_MUL || tokens.peek().type == T_DIV)
+        {
+            TokenType op = tokens.peek().type;
+            tokens.advance();
+            Operand rhs = parseFactor();
+            Operand temp = tacGenerator.newTemp();
+            tacGenerator.addInstruction(binaryOp(op), lhs, rhs, temp);
+            lhs = temp;
         }
-        else if (tokens[pos].type == T_ID)
+        return lhs;
+    }
+
+    Operand parseFactor()
+    {
+        if (tokens.peek().type == T_NUM)
         {
-            string varName = tokens[pos].value;
-            pos++;
-            return varName;
+            string_view digits = names.text(tokens.peek().id);
+            long long value = 0;
+            for (char digit : digits)
+            {
+                value = value * 10 + (digit - '0');
+                if (value > INT32_MAX)
+                {
+                    errorAt(DIAGNOSTIC_SEMANTIC, tokens.peek().offset, "Error: Integer literal ", digits, " out of range");
+                }
+            }
+            tokens.advance();
+            return Operand::imm(static_cast<int32_t>(value));
         }
-        else if (tokens[pos].type == T_LPAREN)
+        else if (tokens.peek().type == T_ID)
         {
-            pos++;
-            string exprResult = parseExpression();
+            SymbolId varName = tokens.peek().id;
+            size_t offset = tokens.peek().offset;
+            tokens.advance();
+            if (tokens.peek().type != T_LBRACKET)
+            {
+                if (symbolTable.lookup(varName))
+                    checkIndexed(varName, false, offset);
+                return Operand::var(varName);
+            }
+            checkIndexed(varName, true, offset);
+            Operand index = parseIndex(varName);
+            Operand temp = tacGenerator.newTemp();
+            tacGenerator.addInstruction(OP_LOAD, Operand::array(varName), index, temp);
+            return temp;
+        }
+        else if (tokens.peek().type == T_LPAREN)
+        {
+            tokens.advance();
+            Operand exprResult = parseExpression();
             expect(T_RPAREN);
             return exprResult;
         }
         else
         {
-            cout << "Syntax error: expected number or identifier at line " << lexer.getLineNumber() << endl;
-            exit(1);
+            errorAt(DIAGNOSTIC_SYNTAX, tokens.peek().offset, "Syntax error: expected number or identifier");
         }
     }
 
     void expect(TokenType expected)
     {
-        if (tokens[pos].type == expected)
+        if (tokens.peek().type == expected)
         {
-            pos++;
+            tokens.advance();
         }
         else
         {
-            cout << "Syntax error: expected token " << expected << " at line " << lexer.getLineNumber() << endl;
-            exit(1);
+            errorAt(DIAGNOSTIC_SYNTAX, tokens.peek().offset, "Syntax error: expected token ", lexer.tokenTypeToString(expected));
         }
     }
-    SymbolTable &getSymbolTable()
+    // The token the next statement starts with
+    const Token &peekToken()
     {
-        return symbolTable;
+        return tokens.peek();
+    }
+
+    // Source offset of the last syntax or semantic error thrown, or SIZE_MAX
+    // if it was not tied to a token
+    size_t errorOffset() const
+    {
+        return failedAt;
     }
-    void printTAC()
+
+    SymbolTable &getSymbolTable()
     {
-        tacGenerator.printInstructions();
+        return symbolTable;
     }
     TACGenerator &getTACGenerator()
     {
@@ -787,145 +2327,6664 @@ public:
     }
 };
 
-class CodeGenerator
+// Maximal straight-line run of TAC: entered only at its first instruction,
+// left only after its last. Instruction indices are [begin, end).
+struct BasicBlock
 {
-public:
-    void generateAssembly(const vector<TACInstruction> &intermediateCode)
-    {
-
-        vector<string> assemblyCode;
+    size_t begin;
+    size_t end;
+    vector<size_t> successors;
+    vector<size_t> predecessors;
+};
 
-        for (const auto &instr : intermediateCode)
-        {
-            string instructionString = instr.result + " = " + instr.arg1 + " " + instr.op + " " + instr.arg2;
+// Control-flow graph over a TAC instruction list. Blocks start at labels and
+// after jumps; block 0 is the entry. The graph refers to instructions by
+// index, so it must be rebuilt after the list is edited.
+class ControlFlowGraph
+{
+private:
+    vector<BasicBlock> blocks;
+    unordered_map<int32_t, size_t> blockOfLabel;
 
-            // Process the instruction string as before
-            vector<string> tokens = split(instructionString, ' ');
-            // Parse the instruction
+    void addEdge(size_t from, size_t to)
+    {
+        blocks[from].successors.push_back(to);
+        blocks[to].predecessors.push_back(from);
+    }
 
-            if (tokens.size() == 3 && tokens[1] == "=")
-            {
-                // Handle assignment: a = b
-                if (isNumber(tokens[2]))
-                {
-                    // Move immediate value to variable
-                    assemblyCode.push_back("mov dword [" + tokens[0] + "], " + tokens[2]);
-                }
-                else
-                {
-                    // Move one variable to another
-                    assemblyCode.push_back("mov eax, [" + tokens[2] + "]");
-                    assemblyCode.push_back("mov [" + tokens[0] + "], eax");
-                }
-            }
-            else if (tokens.size() == 5 && (tokens[3] == "+" || tokens[3] == "-" || tokens[3] == "*" || tokens[3] == "/"))
+public:
+    explicit ControlFlowGraph(const vector<TACInstruction> &code)
+    {
+        size_t begin = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            bool labelStarts = code[i].op == OP_LABEL && i > begin;
+            if (labelStarts)
             {
-                // Handle arithmetic operations: t1 = a + b
-                assemblyCode.push_back("mov eax, [" + tokens[2] + "]");
-                if (tokens[3] == "+")
-                    assemblyCode.push_back("add eax, [" + tokens[4] + "]");
-                else if (tokens[3] == "-")
-                    assemblyCode.push_back("sub eax, [" + tokens[4] + "]");
-                else if (tokens[3] == "*")
-                    assemblyCode.push_back("imul eax, [" + tokens[4] + "]");
-                else if (tokens[3] == "/")
-                {
-                    assemblyCode.push_back("mov edx, 0"); // Clear edx for division
-                    assemblyCode.push_back("mov ebx, [" + tokens[4] + "]");
-                    assemblyCode.push_back("idiv ebx");
-                }
-                assemblyCode.push_back("mov [" + tokens[0] + "], eax");
+                blocks.push_back(BasicBlock{begin, i, {}, {}});
+                begin = i;
             }
-            else if (tokens.size() >= 2 && tokens[0] == "return")
+            if (code[i].op == OP_LABEL)
             {
-                // Handle return: return x
-                assemblyCode.push_back("mov eax, [" + tokens[1] + "]");
-                assemblyCode.push_back("ret");
+                blockOfLabel[code[i].result.value] = blocks.size();
             }
-            else if (tokens[0] == "if")
+            if (isJump(code[i].op))
             {
-                // Handle conditional jump: if t1 goto L1
-                assemblyCode.push_back("cmp [" + tokens[1] + "], 0");
-                assemblyCode.push_back("jne " + tokens[3]);
+                blocks.push_back(BasicBlock{begin, i + 1, {}, {}});
+                begin = i + 1;
             }
-            else if (tokens[0].find("L") == 0)
+        }
+        if (begin < code.size() || blocks.empty())
+        {
+            blocks.push_back(BasicBlock{begin, code.size(), {}, {}});
+        }
+
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            const BasicBlock &block = blocks[b];
+            const TACInstruction *last = block.end > block.begin ? &code[block.end - 1] : nullptr;
+            if (last != nullptr && isJump(last->op))
             {
-                // Add labels
-                assemblyCode.push_back(tokens[0] + ":");
+                addEdge(b, blockOfLabel.at(last->result.value));
             }
-            else if (tokens[0] == "goto")
+            bool fallsThrough = last == nullptr || last->op != OP_JUMP;
+            if (fallsThrough && b + 1 < blocks.size())
             {
-                // Handle unconditional jump: goto L2
-                assemblyCode.push_back("jmp " + tokens[1]);
+                addEdge(b, b + 1);
             }
         }
+    }
 
-        // Output the assembly code
-        for (const auto &line : assemblyCode)
-        {
-            cout << line << endl;
-        }
+    size_t size() const
+    {
+        return blocks.size();
     }
 
-private:
-    bool isNumber(const string &s)
+    const BasicBlock &operator[](size_t b) const
     {
-        return !s.empty() && all_of(s.begin(), s.end(), ::isdigit);
+        return blocks[b];
     }
 
-    vector<string> split(const string &str, char delimiter)
+    // Block whose first instruction is the given label
+    size_t blockOf(const Operand &label) const
     {
-        vector<string> tokens;
-        string token;
-        istringstream tokenStream(str);
-        while (getline(tokenStream, token, delimiter))
+        return blockOfLabel.at(label.value);
+    }
+
+    // Block containing instruction index i
+    size_t blockContaining(size_t i) const
+    {
+        size_t lo = 0, hi = blocks.size();
+        while (hi - lo > 1)
         {
-            tokens.push_back(token);
+            size_t mid = (lo + hi) / 2;
+            if (blocks[mid].begin <= i)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    void print(ostream &out) const
+    {
+        out << "Control-Flow Graph:" << endl;
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            out << "B" << b << " [" << blocks[b].begin << ", " << blocks[b].end << ")  preds:";
+            for (size_t p : blocks[b].predecessors)
+                out << " B" << p;
+            out << "  succs:";
+            for (size_t s : blocks[b].successors)
+                out << " B" << s;
+            out << endl;
         }
-        return tokens;
     }
 };
 
-int main(int argc, char *argv[])
+// Immediate dominators of a CFG's blocks, by Cooper, Harvey and Kennedy's
+// iterative algorithm over reverse postorder. Blocks unreachable from the
+// entry have no dominator.
+class DominatorTree
 {
+private:
+    vector<size_t> idom;
+    vector<size_t> order;    // Reverse postorder of the reachable blocks
+    vector<size_t> orderOf;  // Block -> position in `order`
 
-    SymbolTable symTable;
-    TACGenerator icg;
+public:
+    static constexpr size_t NONE = SIZE_MAX;
 
-    if (argc != 2)
+    explicit DominatorTree(const ControlFlowGraph &cfg)
+        : idom(cfg.size(), NONE), orderOf(cfg.size(), NONE)
     {
-        cout << "Usage: " << argv[0] << " <source-file>" << endl;
-        return 1;
+        // Iterative DFS for the postorder; `next` is each block's next successor to visit
+        vector<size_t> next(cfg.size(), 0);
+        vector<bool> visited(cfg.size(), false);
+        vector<size_t> stack(1, 0);
+        visited[0] = true;
+        while (!stack.empty())
+        {
+            size_t b = stack.back();
+            if (next[b] < cfg[b].successors.size())
+            {
+                size_t succ = cfg[b].successors[next[b]++];
+                if (!visited[succ])
+                {
+                    visited[succ] = true;
+                    stack.push_back(succ);
+                }
+                continue;
+            }
+            order.push_back(b);
+            stack.pop_back();
+        }
+        reverse(order.begin(), order.end());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            orderOf[order[i]] = i;
+        }
+
+        idom[0] = 0;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (size_t i = 1; i < order.size(); i++)
+            {
+                size_t b = order[i];
+                size_t newIdom = NONE;
+                for (size_t pred : cfg[b].predecessors)
+                {
+                    if (idom[pred] == NONE)
+                    {
+                        continue; // Unreachable, or not processed yet
+                    }
+                    newIdom = newIdom == NONE ? pred : intersect(pred, newIdom);
+                }
+                if (idom[b] != newIdom)
+                {
+                    idom[b] = newIdom;
+                    changed = true;
+                }
+            }
+        }
     }
 
-    ifstream file(argv[1]);
-    if (!file)
+    // Nearest common dominator of a and b
+    size_t intersect(size_t a, size_t b) const
     {
-        cout << "Error: Cannot open file " << argv[1] << endl;
-        return 1;
+        while (a != b)
+        {
+            while (orderOf[a] > orderOf[b])
+                a = idom[a];
+            while (orderOf[b] > orderOf[a])
+                b = idom[b];
+        }
+        return a;
     }
 
-    string input((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    // The entry is its own immediate dominator
+    size_t immediateDominator(size_t block) const
+    {
+        return idom[block];
+    }
 
-    // Tokenizing phase of the compiler
-    Lexer lexer(input);
-    vector<Token> tokens = lexer.tokenize();
-    lexer.printTokens(tokens);
+    bool dominates(size_t a, size_t b) const
+    {
+        if (idom[b] == NONE || orderOf[a] > orderOf[b])
+        {
+            return false;
+        }
+        // Dominators come first in reverse postorder, so the walk up from b
+        // stops once it passes a
+        while (orderOf[b] > orderOf[a])
+        {
+            b = idom[b];
+        }
+        return b == a;
+    }
 
-    // Parsing phase of the compiler
-    Parser parser(tokens, lexer);
-    parser.parseProgram();
+    const vector<size_t> &reversePostorder() const
+    {
+        return order;
+    }
+};
 
-    parser.getSymbolTable().printTable();
-    // TAC is three address code and intermediate code generation
-    parser.printTAC();
-    CodeGenerator codeGen;
+// Loop found from back edges: edges whose target dominates their source.
+// Back edges to the same header form one loop. Two loops are either
+// disjoint or one nests inside the other.
+struct NaturalLoop
+{
+    static constexpr size_t NONE = SIZE_MAX;
 
-    // Get the TAC instructions from the parser
-    vector<TACInstruction> tacInstructions = parser.getTACGenerator().getInstructions();
+    size_t header;
+    vector<size_t> blocks; // In block order, header included
+    size_t parent;         // Index of the innermost loop around this one, or NONE
 
-    cout << "\nGenerated Assembly Code:" << endl;
-    codeGen.generateAssembly(tacInstructions);
+    bool contains(size_t block) const
+    {
+        return binary_search(blocks.begin(), blocks.end(), block);
+    }
+};
 
-    return 0;
+// Natural loops of a CFG, innermost (smallest) first. Takes time in the
+// size of the CFG plus the loops' sizes; nothing is sized by the CFG per loop.
+vector<NaturalLoop> findNaturalLoops(const ControlFlowGraph &cfg, const DominatorTree &dominators)
+{
+    vector<NaturalLoop> loops;
+    vector<pair<size_t, size_t>> backEdges; // (loop, source)
+    unordered_map<size_t, size_t> loopOfHeader;
+    for (size_t b = 0; b < cfg.size(); b++)
+    {
+        for (size_t header : cfg[b].successors)
+        {
+            if (!dominators.dominates(header, b))
+            {
+                continue;
+            }
+            auto found = loopOfHeader.find(header);
+            if (found == loopOfHeader.end())
+            {
+                found = loopOfHeader.emplace(header, loops.size()).first;
+                loops.push_back(NaturalLoop{header, {header}, NaturalLoop::NONE});
+            }
+            backEdges.emplace_back(found->second, b);
+        }
+    }
+    stable_sort(backEdges.begin(), backEdges.end(), [](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b)
+                { return a.first < b.first; });
+
+    // The loop body is everything that reaches a back edge without passing
+    // through the header. Each loop is built in one go, so a block stamped
+    // with the loop's index is already in it.
+    vector<size_t> stamp(cfg.size(), NaturalLoop::NONE);
+    vector<size_t> worklist;
+    for (size_t edge = 0; edge < backEdges.size();)
+    {
+        size_t index = backEdges[edge].first;
+        NaturalLoop &loop = loops[index];
+        stamp[loop.header] = index;
+        for (; edge < backEdges.size() && backEdges[edge].first == index; edge++)
+        {
+            size_t source = backEdges[edge].second;
+            if (stamp[source] != index)
+            {
+                stamp[source] = index;
+                loop.blocks.push_back(source);
+                worklist.push_back(source);
+            }
+        }
+        while (!worklist.empty())
+        {
+            size_t block = worklist.back();
+            worklist.pop_back();
+            for (size_t pred : cfg[block].predecessors)
+            {
+                if (stamp[pred] != index)
+                {
+                    stamp[pred] = index;
+                    loop.blocks.push_back(pred);
+                    worklist.push_back(pred);
+                }
+            }
+        }
+        sort(loop.blocks.begin(), loop.blocks.end());
+    }
+    sort(loops.begin(), loops.end(), [](const NaturalLoop &a, const NaturalLoop &b)
+         { return a.blocks.size() < b.blocks.size(); });
+
+    // Outermost first, each loop stamps its blocks over those of the loops
+    // around it; what its header holds just before is its parent
+    fill(stamp.begin(), stamp.end(), NaturalLoop::NONE);
+    for (size_t i = loops.size(); i-- > 0;)
+    {
+        loops[i].parent = stamp[loops[i].header];
+        for (size_t b : loops[i].blocks)
+        {
+            stamp[b] = i;
+        }
+    }
+    return loops;
+}
+
+// Prints the CFG followed by its natural loops, for --dump-cfg
+void dumpControlFlow(const vector<TACInstruction> &code, ostream &out)
+{
+    ControlFlowGraph cfg(code);
+    cfg.print(out);
+    DominatorTree dominators(cfg);
+    for (const NaturalLoop &loop : findNaturalLoops(cfg, dominators))
+    {
+        out << "Loop B" << loop.header << ":";
+        for (size_t b : loop.blocks)
+            out << " B" << b;
+        out << endl;
+    }
+}
+
+// Whether code inserted just before the loop header's label runs exactly
+// once each time the loop is entered: the only way in from outside the loop
+// is falling through from the block above.
+bool hasPreheaderSlot(const ControlFlowGraph &cfg, const NaturalLoop &loop, const vector<TACInstruction> &code)
+{
+    size_t header = loop.header;
+    for (size_t pred : cfg[header].predecessors)
+    {
+        if (!loop.contains(pred) && pred + 1 != header)
+        {
+            return false;
+        }
+    }
+    if (header == 0)
+    {
+        return true;
+    }
+    const BasicBlock &above = cfg[header - 1];
+    bool abovePasses = above.end == above.begin || code[above.end - 1].op != OP_JUMP;
+    return !loop.contains(header - 1) && abovePasses && code[cfg[header].begin].op == OP_LABEL;
+}
+
+// Inserts instructions before given indices of a TAC list in one pass.
+// Insertions at the same index keep the order they were added in.
+void insertInstructions(vector<TACInstruction> &code, vector<pair<size_t, TACInstruction>> &insertions)
+{
+    if (insertions.empty())
+    {
+        return;
+    }
+    stable_sort(insertions.begin(), insertions.end(), [](const pair<size_t, TACInstruction> &a, const pair<size_t, TACInstruction> &b)
+                { return a.first < b.first; });
+    vector<TACInstruction> merged;
+    merged.reserve(code.size() + insertions.size());
+    size_t next = 0;
+    for (size_t i = 0; i <= code.size(); i++)
+    {
+        while (next < insertions.size() && insertions[next].first == i)
+        {
+            merged.push_back(insertions[next++].second);
+        }
+        if (i < code.size())
+        {
+            merged.push_back(code[i]);
+        }
+    }
+    code.swap(merged);
+}
+
+// Evaluates a binary TAC operator on constants with the target's 32-bit
+// semantics. Returns false when the result is not a compile-time constant
+// (division by zero, or INT32_MIN / -1 which traps in idiv).
+bool evaluateBinary(TACOp op, int32_t a, int32_t b, int32_t &result)
+{
+    uint32_t ua = static_cast<uint32_t>(a), ub = static_cast<uint32_t>(b);
+    switch (op)
+    {
+    case OP_ADD:
+        result = static_cast<int32_t>(ua + ub);
+        return true;
+    case OP_SUB:
+        result = static_cast<int32_t>(ua - ub);
+        return true;
+    case OP_MUL:
+        result = static_cast<int32_t>(ua * ub);
+        return true;
+    case OP_DIV:
+        if (b == 0 || (a == INT32_MIN && b == -1))
+        {
+            return false;
+        }
+        result = a / b;
+        return true;
+    case OP_GT:
+        result = a > b;
+        return true;
+    case OP_LT:
+        result = a < b;
+        return true;
+    case OP_EQ:
+        result = a == b;
+        return true;
+    case OP_NEQ:
+        result = a != b;
+        return true;
+    case OP_AND:
+        result = a != 0 && b != 0;
+        return true;
+    case OP_OR:
+        result = a != 0 || b != 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Key for maps from variables and temporaries to facts about them
+inline int64_t operandKey(const Operand &operand)
+{
+    return (static_cast<int64_t>(operand.kind) << 32) | static_cast<uint32_t>(operand.value);
+}
+
+// A transformation over a block of TAC. Passes keep running totals of what
+// they changed, reported with --stats.
+class TACPass
+{
+public:
+    virtual ~TACPass() {}
+    virtual void run(vector<TACInstruction> &code) = 0;
+    virtual void printStats(ostream &out) const = 0;
+};
+
+// Folds operators whose operands are constants and propagates constants
+// assigned to variables and temporaries into later uses within a basic block.
+class ConstantPropagation : public TACPass
+{
+private:
+    size_t folded;
+    size_t propagated;
+    size_t removed;
+
+public:
+    ConstantPropagation() : folded(0), propagated(0), removed(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        unordered_map<int64_t, int32_t> constants;
+        vector<bool> foldedTemp(code.size(), false);
+
+        auto substitute = [&](Operand &operand)
+        {
+            if (operand.kind != OPERAND_VAR && operand.kind != OPERAND_TEMP)
+            {
+                return;
+            }
+            auto it = constants.find(operandKey(operand));
+            if (it != constants.end())
+            {
+                operand = Operand::imm(it->second);
+                propagated++;
+            }
+        };
+
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            TACInstruction &instr = code[i];
+            if (instr.op == OP_LABEL)
+            {
+                // Other paths may join here; nothing known carries over
+                constants.clear();
+                continue;
+            }
+            substitute(instr.arg1);
+            if (instr.op != OP_COPY)
+            {
+                substitute(instr.arg2);
+            }
+
+            int32_t value;
+            if (instr.op != OP_COPY && instr.arg1.kind == OPERAND_IMM && instr.arg2.kind == OPERAND_IMM &&
+                evaluateBinary(instr.op, instr.arg1.value, instr.arg2.value, value))
+            {
+                instr = TACInstruction{OP_COPY, instr.result, Operand::imm(value), Operand::none()};
+                foldedTemp[i] = instr.result.kind == OPERAND_TEMP;
+                folded++;
+            }
+
+            if (isJump(instr.op))
+            {
+                continue;
+            }
+            if (instr.op == OP_COPY && instr.arg1.kind == OPERAND_IMM)
+            {
+                constants[operandKey(instr.result)] = instr.arg1.value;
+            }
+            else
+            {
+                constants.erase(operandKey(instr.result));
+            }
+        }
+
+        // Folded temporaries whose every use now reads the constant are dead
+        unordered_map<int32_t, size_t> tempUses;
+        for (const TACInstruction &instr : code)
+        {
+            if (instr.arg1.kind == OPERAND_TEMP)
+                tempUses[instr.arg1.value]++;
+            if (instr.arg2.kind == OPERAND_TEMP)
+                tempUses[instr.arg2.value]++;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            if (foldedTemp[i] && tempUses.count(code[i].result.value) == 0)
+            {
+                removed++;
+                continue;
+            }
+            code[kept++] = code[i];
+        }
+        code.resize(kept);
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "constant propagation: " << folded << " folded, " << propagated << " operands propagated, "
+            << removed << " instructions removed" << endl;
+    }
+};
+
+// Local value numbering. Within a block, an operator applied to operands with
+// the same value numbers as an earlier one is recognized as a repeat: its
+// temporary is replaced by the earlier result and the instruction removed.
+// Assigning to a variable gives it a fresh value number, which invalidates
+// every expression that read its old value.
+class ValueNumbering : public TACPass
+{
+private:
+    struct Expression
+    {
+        TACOp op;
+        uint32_t left;
+        uint32_t right;
+
+        bool operator==(const Expression &other) const
+        {
+            return op == other.op && left == other.left && right == other.right;
+        }
+    };
+
+    struct ExpressionHash
+    {
+        size_t operator()(const Expression &e) const
+        {
+            return (static_cast<size_t>(e.left) * 0x9E3779B1u) ^ (static_cast<size_t>(e.right) << 7) ^ e.op;
+        }
+    };
+
+    struct Available
+    {
+        uint32_t valueNumber;
+        Operand home; // Where the value was computed
+    };
+
+    size_t eliminated;
+    size_t replaced;
+
+    static bool isCommutative(TACOp op)
+    {
+        return op == OP_ADD || op == OP_MUL || op == OP_EQ || op == OP_NEQ || op == OP_AND || op == OP_OR;
+    }
+
+public:
+    ValueNumbering() : eliminated(0), replaced(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        // Temporaries defined once can be renamed program-wide
+        unordered_map<int32_t, int> tempDefinitions;
+        for (const TACInstruction &instr : code)
+        {
+            if (instr.result.kind == OPERAND_TEMP)
+                tempDefinitions[instr.result.value]++;
+        }
+
+        unordered_map<int32_t, Operand> renamed;
+        unordered_map<int64_t, uint32_t> valueOf;
+        unordered_map<Expression, Available, ExpressionHash> available;
+        uint32_t nextValue = 0;
+
+        auto valueNumber = [&](const Operand &operand)
+        {
+            if (operand.kind == OPERAND_NONE)
+            {
+                return nextValue++;
+            }
+            auto it = valueOf.find(operandKey(operand));
+            if (it != valueOf.end())
+            {
+                return it->second;
+            }
+            valueOf.emplace(operandKey(operand), nextValue);
+            return nextValue++;
+        };
+        auto rename = [&](Operand &operand)
+        {
+            if (operand.kind == OPERAND_TEMP)
+            {
+                auto it = renamed.find(operand.value);
+                if (it != renamed.end())
+                    operand = it->second;
+            }
+        };
+
+        size_t kept = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            TACInstruction instr = code[i];
+            rename(instr.arg1);
+            rename(instr.arg2);
+
+            if (instr.op == OP_LABEL || isJump(instr.op))
+            {
+                // Block boundary: values numbered so far may not reach past it
+                valueOf.clear();
+                available.clear();
+                code[kept++] = instr;
+                continue;
+            }
+            if (instr.op == OP_COPY)
+            {
+                valueOf[operandKey(instr.result)] = valueNumber(instr.arg1);
+                code[kept++] = instr;
+                continue;
+            }
+            if (instr.op == OP_STORE)
+            {
+                // The array as a whole takes a new value, so loads from it
+                // before the store do not match loads after it
+                valueOf[operandKey(instr.result)] = nextValue++;
+                code[kept++] = instr;
+                continue;
+            }
+
+            Expression expr{instr.op, valueNumber(instr.arg1), valueNumber(instr.arg2)};
+            if (isCommutative(expr.op) && expr.left > expr.right)
+            {
+                swap(expr.left, expr.right);
+            }
+
+            auto found = available.find(expr);
+            if (found != available.end())
+            {
+                const Available &earlier = found->second;
+                auto home = valueOf.find(operandKey(earlier.home));
+                if (home != valueOf.end() && home->second == earlier.valueNumber)
+                {
+                    if (instr.result.kind == OPERAND_TEMP && earlier.home.kind == OPERAND_TEMP &&
+                        tempDefinitions[instr.result.value] == 1 && tempDefinitions[earlier.home.value] == 1)
+                    {
+                        renamed[instr.result.value] = earlier.home;
+                        eliminated++;
+                        continue;
+                    }
+                    instr = TACInstruction{OP_COPY, instr.result, earlier.home, Operand::none()};
+                    valueOf[operandKey(instr.result)] = earlier.valueNumber;
+                    replaced++;
+                    code[kept++] = instr;
+                    continue;
+                }
+            }
+
+            uint32_t value = nextValue++;
+            available[expr] = Available{value, instr.result};
+            valueOf[operandKey(instr.result)] = value;
+            code[kept++] = instr;
+        }
+        code.resize(kept);
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "value numbering: " << eliminated << " instructions eliminated, " << replaced
+            << " replaced by copies" << endl;
+    }
+};
+
+// Turns conditional jumps on constants, which constant propagation leaves
+// behind for conditions like `if (5 > 3)`, into plain jumps or nothing. Then
+// deletes the blocks no path from the entry reaches, jumps to the very next
+// instruction, and labels that nothing jumps to any more.
+class BranchFolding : public TACPass
+{
+private:
+    size_t folded;
+    size_t unreachable;
+
+public:
+    BranchFolding() : folded(0), unreachable(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            TACInstruction instr = code[i];
+            if ((instr.op == OP_JUMP_IF_FALSE || instr.op == OP_JUMP_IF_TRUE) && instr.arg1.kind == OPERAND_IMM)
+            {
+                folded++;
+                if ((instr.arg1.value != 0) != (instr.op == OP_JUMP_IF_TRUE))
+                {
+                    continue; // Never taken
+                }
+                instr = TACInstruction{OP_JUMP, instr.result, Operand::none(), Operand::none()};
+            }
+            code[kept++] = instr;
+        }
+        code.resize(kept);
+
+        ControlFlowGraph cfg(code);
+        vector<bool> reachable(cfg.size(), false);
+        vector<size_t> worklist(1, 0);
+        reachable[0] = true;
+        while (!worklist.empty())
+        {
+            size_t block = worklist.back();
+            worklist.pop_back();
+            for (size_t succ : cfg[block].successors)
+            {
+                if (!reachable[succ])
+                {
+                    reachable[succ] = true;
+                    worklist.push_back(succ);
+                }
+            }
+        }
+
+        kept = 0;
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                if (!reachable[b])
+                {
+                    unreachable++;
+                    continue;
+                }
+                code[kept++] = code[i];
+            }
+        }
+        code.resize(kept);
+
+        // A jump over nothing but labels lands where falling through would
+        kept = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            bool toNext = false;
+            for (size_t j = i + 1; code[i].op == OP_JUMP && j < code.size() && code[j].op == OP_LABEL; j++)
+            {
+                toNext = toNext || code[j].result == code[i].result;
+            }
+            if (!toNext)
+            {
+                code[kept++] = code[i];
+            }
+        }
+        code.resize(kept);
+
+        unordered_map<int32_t, size_t> jumpsTo;
+        for (const TACInstruction &instr : code)
+        {
+            if (isJump(instr.op))
+                jumpsTo[instr.result.value]++;
+        }
+        kept = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            if (code[i].op != OP_LABEL || jumpsTo.count(code[i].result.value))
+            {
+                code[kept++] = code[i];
+            }
+        }
+        code.resize(kept);
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "branch folding: " << folded << " branches folded, " << unreachable
+            << " unreachable instructions removed" << endl;
+    }
+};
+
+// Removes the copy the parser emits for every assignment by computing
+// `x = a + b` directly instead of through a temporary, then forwards copies
+// `x = y` to later uses of x within a basic block while neither x nor y is
+// reassigned.
+class CopyPropagation : public TACPass
+{
+private:
+    size_t coalesced;
+    size_t propagated;
+
+public:
+    CopyPropagation() : coalesced(0), propagated(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        unordered_map<int32_t, size_t> tempUses;
+        unordered_map<int32_t, size_t> tempDefinitions;
+        for (const TACInstruction &instr : code)
+        {
+            if (instr.arg1.kind == OPERAND_TEMP)
+                tempUses[instr.arg1.value]++;
+            if (instr.arg2.kind == OPERAND_TEMP)
+                tempUses[instr.arg2.value]++;
+            if (instr.result.kind == OPERAND_TEMP)
+                tempDefinitions[instr.result.value]++;
+        }
+
+        // t = a op b; x = t  ->  x = a op b, when that copy is t's only use
+        size_t kept = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            TACInstruction instr = code[i];
+            if (i + 1 < code.size() && instr.result.kind == OPERAND_TEMP && instr.op != OP_LABEL &&
+                !isJump(instr.op) && code[i + 1].op == OP_COPY && code[i + 1].arg1 == instr.result &&
+                tempUses[instr.result.value] == 1 && tempDefinitions[instr.result.value] == 1)
+            {
+                instr.result = code[i + 1].result;
+                coalesced++;
+                i++;
+            }
+            code[kept++] = instr;
+        }
+        code.resize(kept);
+
+        // Destination -> source of the copies still valid at this point
+        unordered_map<int64_t, Operand> copies;
+        auto substitute = [&](Operand &operand)
+        {
+            if (operand.kind != OPERAND_VAR && operand.kind != OPERAND_TEMP)
+            {
+                return;
+            }
+            auto it = copies.find(operandKey(operand));
+            if (it != copies.end())
+            {
+                operand = it->second;
+                propagated++;
+            }
+        };
+
+        for (TACInstruction &instr : code)
+        {
+            if (instr.op == OP_LABEL)
+            {
+                copies.clear();
+                continue;
+            }
+            substitute(instr.arg1);
+            substitute(instr.arg2);
+            if (isJump(instr.op))
+            {
+                continue;
+            }
+
+            // Assigning to x ends copies into x and copies out of x
+            int64_t key = operandKey(instr.result);
+            copies.erase(key);
+            for (auto it = copies.begin(); it != copies.end();)
+            {
+                if (it->second == instr.result)
+                    it = copies.erase(it);
+                else
+                    ++it;
+            }
+            bool copiesName = instr.arg1.kind == OPERAND_VAR || instr.arg1.kind == OPERAND_TEMP;
+            if (instr.op == OP_COPY && copiesName && instr.arg1 != instr.result)
+            {
+                copies[key] = instr.arg1;
+            }
+        }
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "copy propagation: " << coalesced << " copies coalesced, " << propagated << " operands propagated"
+            << endl;
+    }
+};
+
+// Which variables and temporaries are live on exit from each basic block.
+// Only names read in some block before being written there take part in the
+// dataflow; any other name is dead at every block boundary. Every variable is
+// live at program exit, since the final values of the variables are the
+// program's result.
+//
+// Variables are few and usually live across most of the program, so they get
+// bit vectors iterated to a fixed point. Temporaries can number in the
+// thousands but each lives across a few blocks, so each one's live range is
+// walked backwards from the blocks that read it and stored sparsely.
+class Liveness
+{
+private:
+    unordered_map<int64_t, size_t> slotOf; // Variables only
+    size_t words;
+    vector<uint64_t> liveOutBits; // words per block
+    unordered_set<uint64_t> liveOutTemps; // tempKey(block, temporary)
+
+    static bool isName(const Operand &operand)
+    {
+        return operand.kind == OPERAND_VAR || operand.kind == OPERAND_TEMP;
+    }
+
+    static bool definesValue(const TACInstruction &instr)
+    {
+        return instr.op != OP_LABEL && !isJump(instr.op) && isName(instr.result);
+    }
+
+    static uint64_t tempKey(size_t block, int32_t temp)
+    {
+        return uint64_t(block) << 32 | static_cast<uint32_t>(temp);
+    }
+
+    void findLiveVariables(const vector<TACInstruction> &code, const ControlFlowGraph &cfg)
+    {
+        vector<size_t> variableSlots;
+        for (const TACInstruction &instr : code)
+        {
+            for (const Operand *operand : {&instr.arg1, &instr.arg2, &instr.result})
+            {
+                if (operand->kind == OPERAND_VAR && slotOf.emplace(operandKey(*operand), slotOf.size()).second)
+                {
+                    variableSlots.push_back(slotOf.size() - 1);
+                }
+            }
+        }
+
+        words = (slotOf.size() + 63) / 64;
+        vector<uint64_t> useBits(cfg.size() * words, 0);
+        vector<uint64_t> defBits(cfg.size() * words, 0);
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            uint64_t *use = useBits.data() + b * words;
+            uint64_t *def = defBits.data() + b * words;
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                const TACInstruction &instr = code[i];
+                for (const Operand *operand : {&instr.arg1, &instr.arg2})
+                {
+                    auto slot = operand->kind == OPERAND_VAR ? slotOf.find(operandKey(*operand)) : slotOf.end();
+                    if (slot != slotOf.end() && !(def[slot->second / 64] >> (slot->second % 64) & 1))
+                    {
+                        use[slot->second / 64] |= uint64_t(1) << (slot->second % 64);
+                    }
+                }
+                if (definesValue(instr) && instr.result.kind == OPERAND_VAR)
+                {
+                    size_t slot = slotOf.at(operandKey(instr.result));
+                    def[slot / 64] |= uint64_t(1) << (slot % 64);
+                }
+            }
+        }
+
+        // Iterate live-in = use | (live-out & ~def) to a fixed point, visiting
+        // blocks last to first so most facts settle in one sweep
+        liveOutBits.assign(cfg.size() * words, 0);
+        vector<uint64_t> liveInBits(cfg.size() * words, 0);
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (size_t b = cfg.size(); b-- > 0;)
+            {
+                uint64_t *out = liveOutBits.data() + b * words;
+                if (cfg[b].successors.empty())
+                {
+                    for (size_t slot : variableSlots)
+                        out[slot / 64] |= uint64_t(1) << (slot % 64);
+                }
+                for (size_t succ : cfg[b].successors)
+                {
+                    for (size_t w = 0; w < words; w++)
+                        out[w] |= liveInBits[succ * words + w];
+                }
+                for (size_t w = 0; w < words; w++)
+                {
+                    uint64_t in = useBits[b * words + w] | (out[w] & ~defBits[b * words + w]);
+                    changed = changed || in != liveInBits[b * words + w];
+                    liveInBits[b * words + w] = in;
+                }
+            }
+        }
+    }
+
+    void findLiveTemps(const vector<TACInstruction> &code, const ControlFlowGraph &cfg)
+    {
+        // (temporary, block) for each block that defines a temporary, and
+        // for each that reads one it has not defined yet
+        vector<pair<int32_t, size_t>> definitions, exposedUses;
+        unordered_map<int32_t, size_t> lastDefinedIn;
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                const TACInstruction &instr = code[i];
+                for (const Operand *use : {&instr.arg1, &instr.arg2})
+                {
+                    auto def = lastDefinedIn.find(use->value);
+                    if (use->kind == OPERAND_TEMP && (def == lastDefinedIn.end() || def->second != b))
+                    {
+                        exposedUses.emplace_back(use->value, b);
+                    }
+                }
+                if (definesValue(instr) && instr.result.kind == OPERAND_TEMP)
+                {
+                    lastDefinedIn[instr.result.value] = b;
+                    definitions.emplace_back(instr.result.value, b);
+                }
+            }
+        }
+        sort(definitions.begin(), definitions.end());
+        sort(exposedUses.begin(), exposedUses.end());
+
+        // A temporary live on entry to a block is live on exit from its
+        // predecessors, and on entry to those that do not define it. One
+        // stamp array, indexed by block, marks the current temporary's
+        // defining blocks.
+        vector<size_t> defines(cfg.size(), SIZE_MAX);
+        vector<size_t> worklist;
+        size_t nextDefinition = 0;
+        for (size_t use = 0, walk = 0; use < exposedUses.size(); walk++)
+        {
+            int32_t temp = exposedUses[use].first;
+            for (; nextDefinition < definitions.size() && definitions[nextDefinition].first <= temp; nextDefinition++)
+            {
+                if (definitions[nextDefinition].first == temp)
+                    defines[definitions[nextDefinition].second] = walk;
+            }
+            for (; use < exposedUses.size() && exposedUses[use].first == temp; use++)
+            {
+                worklist.push_back(exposedUses[use].second);
+            }
+            while (!worklist.empty())
+            {
+                size_t block = worklist.back();
+                worklist.pop_back();
+                for (size_t pred : cfg[block].predecessors)
+                {
+                    if (liveOutTemps.insert(tempKey(pred, temp)).second && defines[pred] != walk)
+                        worklist.push_back(pred);
+                }
+            }
+        }
+    }
+
+public:
+    Liveness(const vector<TACInstruction> &code, const ControlFlowGraph &cfg)
+    {
+        findLiveVariables(code, cfg);
+        findLiveTemps(code, cfg);
+    }
+
+    bool isLiveOut(size_t block, const Operand &operand) const
+    {
+        if (operand.kind == OPERAND_TEMP)
+        {
+            return liveOutTemps.count(tempKey(block, operand.value)) != 0;
+        }
+        auto slot = slotOf.find(operandKey(operand));
+        if (slot == slotOf.end())
+        {
+            return false;
+        }
+        return liveOutBits[block * words + slot->second / 64] >> (slot->second % 64) & 1;
+    }
+};
+
+// Deletes instructions whose result is never read afterwards: stores to a
+// variable overwritten before any read, and temporaries nothing uses. Runs
+// until nothing more is dead, since each deletion can kill the operands the
+// deleted instruction read.
+class DeadCodeElimination : public TACPass
+{
+private:
+    size_t removed;
+
+public:
+    DeadCodeElimination() : removed(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        bool changed = true;
+        while (changed)
+        {
+            ControlFlowGraph cfg(code);
+            Liveness liveness(code, cfg);
+            vector<bool> dead(code.size(), false);
+            unordered_map<int64_t, bool> liveHere; // Names seen so far in the backward walk
+            changed = false;
+            for (size_t b = 0; b < cfg.size(); b++)
+            {
+                liveHere.clear();
+                for (size_t i = cfg[b].end; i-- > cfg[b].begin;)
+                {
+                    const TACInstruction &instr = code[i];
+                    if (instr.op != OP_LABEL && !isJump(instr.op) &&
+                        (instr.result.kind == OPERAND_VAR || instr.result.kind == OPERAND_TEMP))
+                    {
+                        auto seen = liveHere.find(operandKey(instr.result));
+                        bool live = seen != liveHere.end() ? seen->second : liveness.isLiveOut(b, instr.result);
+                        if (!live)
+                        {
+                            dead[i] = true;
+                            changed = true;
+                            continue;
+                        }
+                        liveHere[operandKey(instr.result)] = false;
+                    }
+                    for (const Operand *use : {&instr.arg1, &instr.arg2})
+                    {
+                        if (use->kind == OPERAND_VAR || use->kind == OPERAND_TEMP)
+                            liveHere[operandKey(*use)] = true;
+                    }
+                }
+            }
+
+            size_t kept = 0;
+            for (size_t i = 0; i < code.size(); i++)
+            {
+                if (dead[i])
+                {
+                    removed++;
+                    continue;
+                }
+                code[kept++] = code[i];
+            }
+            code.resize(kept);
+        }
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "dead code elimination: " << removed << " instructions removed" << endl;
+    }
+};
+
+// Static single assignment view of a TAC list (Cytron et al.). Every
+// definition of a variable or temporary, every phi node and every name's
+// value on entry is an SSA value; each use is resolved to the one value that
+// reaches it. Phi nodes go at the iterated dominance frontiers of the blocks
+// defining a name, for names read in some block before being written there.
+//
+// The TAC itself is not rewritten: values are numbered on the side, and
+// every value of a name maps back to that name. Passes that only replace
+// uses with constants and delete code keep the form conventional (no two
+// values of a name are live at once), so leaving SSA is just dropping the
+// version numbers and phi nodes.
+class SSAForm
+{
+public:
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
+    static constexpr size_t ENTRY_SITE = SIZE_MAX;    // Value held on entry to the program
+    static constexpr size_t PHI_SITE = SIZE_MAX - 1;  // Value merged by a phi node
+
+    struct Value
+    {
+        Operand name;
+        size_t block;
+        size_t site;      // Defining instruction index, ENTRY_SITE or PHI_SITE
+        uint32_t version; // Per-name number, for printing
+    };
+
+    struct Phi
+    {
+        uint32_t result;
+        vector<uint32_t> args; // Parallel to the block's predecessors
+    };
+
+private:
+    const vector<TACInstruction> &code;
+    ControlFlowGraph cfg;
+    DominatorTree dominators;
+    vector<Value> values;
+    vector<vector<Phi>> phis;        // Per block
+    vector<uint32_t> definitions;    // Per instruction
+    vector<uint32_t> uses;           // Per instruction: arg1, arg2
+    unordered_map<int64_t, uint32_t> entryValues;
+
+    static bool isName(const Operand &operand)
+    {
+        return operand.kind == OPERAND_VAR || operand.kind == OPERAND_TEMP;
+    }
+
+    static bool definesValue(const TACInstruction &instr)
+    {
+        return instr.op != OP_LABEL && !isJump(instr.op) && isName(instr.result);
+    }
+
+    uint32_t newValue(const Operand &name, size_t block, size_t site)
+    {
+        values.push_back(Value{name, block, site, 0});
+        return static_cast<uint32_t>(values.size() - 1);
+    }
+
+    // Versions count up in program order, starting with the entry values
+    void numberVersions()
+    {
+        unordered_map<int64_t, uint32_t> versionCount;
+        auto number = [&](uint32_t v)
+        {
+            values[v].version = versionCount[operandKey(values[v].name)]++;
+        };
+        for (uint32_t v = 0; v < values.size(); v++)
+        {
+            if (values[v].site == ENTRY_SITE)
+                number(v);
+        }
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            for (const Phi &phi : phis[b])
+                number(phi.result);
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                if (definitions[i] != NO_VALUE)
+                    number(definitions[i]);
+            }
+        }
+    }
+
+    // By value: callers pass names that live in `values`, which newValue grows
+    uint32_t entryValue(Operand name)
+    {
+        auto it = entryValues.find(operandKey(name));
+        if (it != entryValues.end())
+        {
+            return it->second;
+        }
+        uint32_t value = newValue(name, 0, ENTRY_SITE);
+        entryValues.emplace(operandKey(name), value);
+        return value;
+    }
+
+    void placePhis()
+    {
+        // Dominance frontiers (Cooper, Harvey and Kennedy)
+        vector<vector<size_t>> frontier(cfg.size());
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            if (cfg[b].predecessors.size() < 2 || dominators.immediateDominator(b) == DominatorTree::NONE)
+            {
+                continue;
+            }
+            for (size_t pred : cfg[b].predecessors)
+            {
+                if (dominators.immediateDominator(pred) == DominatorTree::NONE)
+                {
+                    continue;
+                }
+                size_t runner = pred;
+                while (runner != dominators.immediateDominator(b))
+                {
+                    if (frontier[runner].empty() || frontier[runner].back() != b)
+                        frontier[runner].push_back(b);
+                    runner = dominators.immediateDominator(runner);
+                }
+            }
+        }
+
+        // Names needing phis, with the blocks that define them
+        unordered_map<int64_t, vector<size_t>> definingBlocks;
+        unordered_set<int64_t> crossBlock;
+        unordered_map<int64_t, Operand> nameOf;
+        unordered_map<int64_t, size_t> lastDefinedIn;
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                const TACInstruction &instr = code[i];
+                for (const Operand *use : {&instr.arg1, &instr.arg2})
+                {
+                    auto def = lastDefinedIn.find(operandKey(*use));
+                    if (isName(*use) && (def == lastDefinedIn.end() || def->second != b))
+                        crossBlock.insert(operandKey(*use));
+                }
+                if (definesValue(instr))
+                {
+                    int64_t key = operandKey(instr.result);
+                    nameOf.emplace(key, instr.result);
+                    vector<size_t> &blocks = definingBlocks[key];
+                    if (blocks.empty() || blocks.back() != b)
+                        blocks.push_back(b);
+                    lastDefinedIn[key] = b;
+                }
+            }
+        }
+
+        phis.assign(cfg.size(), {});
+        vector<size_t> hasPhiFor(cfg.size(), SIZE_MAX);
+        vector<size_t> queuedFor(cfg.size(), SIZE_MAX);
+        size_t nameIndex = 0;
+        for (auto &entry : definingBlocks)
+        {
+            if (!crossBlock.count(entry.first))
+            {
+                continue;
+            }
+            nameIndex++;
+            const Operand &name = nameOf.at(entry.first);
+            vector<size_t> worklist = entry.second;
+            for (size_t b : worklist)
+                queuedFor[b] = nameIndex;
+            while (!worklist.empty())
+            {
+                size_t b = worklist.back();
+                worklist.pop_back();
+                for (size_t join : frontier[b])
+                {
+                    if (hasPhiFor[join] == nameIndex)
+                    {
+                        continue;
+                    }
+                    hasPhiFor[join] = nameIndex;
+                    phis[join].push_back(Phi{newValue(name, join, PHI_SITE), vector<uint32_t>(cfg[join].predecessors.size(), NO_VALUE)});
+                    if (queuedFor[join] != nameIndex)
+                    {
+                        queuedFor[join] = nameIndex;
+                        worklist.push_back(join);
+                    }
+                }
+            }
+        }
+    }
+
+    // Walks the dominator tree keeping a stack of the current value of each
+    // name, resolving uses and filling in the phi arguments of successors
+    void rename()
+    {
+        vector<vector<size_t>> children(cfg.size());
+        for (size_t b : dominators.reversePostorder())
+        {
+            if (b != 0)
+                children[dominators.immediateDominator(b)].push_back(b);
+        }
+
+        unordered_map<int64_t, vector<uint32_t>> current;
+        auto currentValue = [&](const Operand &name)
+        {
+            auto it = current.find(operandKey(name));
+            return it != current.end() && !it->second.empty() ? it->second.back() : entryValue(name);
+        };
+
+        struct Frame
+        {
+            size_t block;
+            size_t nextChild;
+            vector<int64_t> pushed;
+        };
+        vector<Frame> stack;
+        stack.push_back(Frame{0, 0, {}});
+        bool entering = true;
+        while (!stack.empty())
+        {
+            Frame &frame = stack.back();
+            size_t b = frame.block;
+            if (entering)
+            {
+                for (Phi &phi : phis[b])
+                {
+                    current[operandKey(values[phi.result].name)].push_back(phi.result);
+                    frame.pushed.push_back(operandKey(values[phi.result].name));
+                }
+                for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+                {
+                    const TACInstruction &instr = code[i];
+                    if (isName(instr.arg1))
+                        uses[2 * i] = currentValue(instr.arg1);
+                    if (isName(instr.arg2))
+                        uses[2 * i + 1] = currentValue(instr.arg2);
+                    if (definesValue(instr))
+                    {
+                        definitions[i] = newValue(instr.result, b, i);
+                        current[operandKey(instr.result)].push_back(definitions[i]);
+                        frame.pushed.push_back(operandKey(instr.result));
+                    }
+                }
+                for (size_t succ : cfg[b].successors)
+                {
+                    const vector<size_t> &preds = cfg[succ].predecessors;
+                    for (Phi &phi : phis[succ])
+                    {
+                        for (size_t p = 0; p < preds.size(); p++)
+                        {
+                            if (preds[p] == b)
+                                phi.args[p] = currentValue(values[phi.result].name);
+                        }
+                    }
+                }
+            }
+
+            if (frame.nextChild < children[b].size())
+            {
+                size_t child = children[b][frame.nextChild++];
+                stack.push_back(Frame{child, 0, {}});
+                entering = true;
+                continue;
+            }
+            for (int64_t key : frame.pushed)
+            {
+                current[key].pop_back();
+            }
+            stack.pop_back();
+            entering = false;
+        }
+    }
+
+public:
+    explicit SSAForm(const vector<TACInstruction> &code)
+        : code(code), cfg(code), dominators(cfg), definitions(code.size(), NO_VALUE), uses(2 * code.size(), NO_VALUE)
+    {
+        placePhis();
+        rename();
+        numberVersions();
+    }
+
+    const ControlFlowGraph &graph() const
+    {
+        return cfg;
+    }
+
+    size_t valueCount() const
+    {
+        return values.size();
+    }
+
+    const Value &value(uint32_t v) const
+    {
+        return values[v];
+    }
+
+    const vector<Phi> &phisOf(size_t block) const
+    {
+        return phis[block];
+    }
+
+    // Value defined by instruction i, or NO_VALUE
+    uint32_t definition(size_t i) const
+    {
+        return definitions[i];
+    }
+
+    // Value read by instruction i's arg1 (operand 0) or arg2 (operand 1)
+    uint32_t use(size_t i, int operand) const
+    {
+        return uses[2 * i + operand];
+    }
+
+    size_t phiCount() const
+    {
+        size_t count = 0;
+        for (const vector<Phi> &blockPhis : phis)
+            count += blockPhis.size();
+        return count;
+    }
+
+    // TAC with every name suffixed by its SSA version, and the phi nodes
+    void print(ostream &out, const TACPrinter &printer) const
+    {
+        auto text = [&](const Operand &operand, uint32_t v)
+        {
+            string name = printer.operandText(operand);
+            return v == NO_VALUE ? name : name + "." + to_string(values[v].version);
+        };
+        out << "SSA Form:" << endl;
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            out << "B" << b << ":" << endl;
+            for (const Phi &phi : phis[b])
+            {
+                out << "    " << text(values[phi.result].name, phi.result) << " = phi(";
+                for (size_t a = 0; a < phi.args.size(); a++)
+                {
+                    out << (a ? ", " : "") << (phi.args[a] == NO_VALUE ? "-" : text(values[phi.result].name, phi.args[a]));
+                }
+                out << ")" << endl;
+            }
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                const TACInstruction &instr = code[i];
+                out << "    ";
+                if (instr.op == OP_LABEL || instr.op == OP_JUMP)
+                {
+                    out << printer.format(instr) << endl;
+                }
+                else if (isJump(instr.op))
+                {
+                    out << (instr.op == OP_JUMP_IF_FALSE ? "ifFalse " : "if ") << text(instr.arg1, uses[2 * i])
+                        << " goto " << printer.operandText(instr.result) << endl;
+                }
+                else if (instr.op == OP_LOAD)
+                {
+                    out << text(instr.result, definitions[i]) << " = " << printer.operandText(instr.arg1) << "["
+                        << text(instr.arg2, uses[2 * i + 1]) << "]" << endl;
+                }
+                else if (instr.op == OP_STORE)
+                {
+                    out << printer.operandText(instr.result) << "[" << text(instr.arg1, uses[2 * i]) << "] = "
+                        << text(instr.arg2, uses[2 * i + 1]) << endl;
+                }
+                else
+                {
+                    out << text(instr.result, definitions[i]) << " = " << text(instr.arg1, uses[2 * i]);
+                    if (instr.op != OP_COPY)
+                        out << " " << TACPrinter::opText(instr.op) << " " << text(instr.arg2, uses[2 * i + 1]);
+                    out << endl;
+                }
+            }
+        }
+    }
+};
+
+// Sparse conditional constant propagation (Wegman and Zadeck) over SSAForm.
+// Values start unknown and only move down the lattice unknown -> constant ->
+// varying; a block's code is only evaluated once an edge into it is found
+// executable, so constants flowing around a loop, and branches that can only
+// go one way, are resolved in one sparse pass instead of by iterating
+// dataflow over the whole program to a fixed point.
+//
+// Afterwards uses of constant values become immediates, constant branches
+// become jumps (or go away), and never-executed blocks are deleted.
+class SparseConditionalConstantPropagation : public TACPass
+{
+private:
+    enum LatticeState : uint8_t
+    {
+        UNKNOWN,
+        CONSTANT,
+        VARYING,
+    };
+
+    struct Lattice
+    {
+        LatticeState state;
+        int32_t value;
+    };
+
+    size_t replaced;
+    size_t branchesFolded;
+    size_t removed;
+    size_t phiNodes;
+
+    static bool lower(Lattice &cell, Lattice to)
+    {
+        if (cell.state == VARYING || to.state == UNKNOWN || (cell.state == CONSTANT && to.state == CONSTANT && cell.value == to.value))
+        {
+            return false;
+        }
+        cell = cell.state == UNKNOWN ? to : Lattice{VARYING, 0};
+        return true;
+    }
+
+public:
+    SparseConditionalConstantPropagation() : replaced(0), branchesFolded(0), removed(0), phiNodes(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        if (code.empty())
+        {
+            return;
+        }
+        SSAForm ssa(code);
+        const ControlFlowGraph &cfg = ssa.graph();
+        phiNodes += ssa.phiCount();
+
+        vector<Lattice> lattice(ssa.valueCount(), Lattice{UNKNOWN, 0});
+        for (uint32_t v = 0; v < ssa.valueCount(); v++)
+        {
+            if (ssa.value(v).site == SSAForm::ENTRY_SITE)
+                lattice[v] = Lattice{VARYING, 0}; // Whatever the variable held before the program
+        }
+
+        // SSA edges: for each value, the instructions and phis reading it
+        vector<vector<size_t>> instructionUses(ssa.valueCount());
+        vector<vector<pair<size_t, size_t>>> phiUses(ssa.valueCount()); // (block, phi)
+        vector<size_t> blockOf(code.size());
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                blockOf[i] = b;
+                for (int operand = 0; operand < 2; operand++)
+                {
+                    if (ssa.use(i, operand) != SSAForm::NO_VALUE)
+                        instructionUses[ssa.use(i, operand)].push_back(i);
+                }
+            }
+            for (size_t p = 0; p < ssa.phisOf(b).size(); p++)
+            {
+                for (uint32_t arg : ssa.phisOf(b)[p].args)
+                {
+                    if (arg != SSAForm::NO_VALUE)
+                        phiUses[arg].emplace_back(b, p);
+                }
+            }
+        }
+
+        vector<bool> blockExecutable(cfg.size(), false);
+        vector<vector<bool>> edgeExecutable(cfg.size()); // Parallel to predecessors
+        for (size_t b = 0; b < cfg.size(); b++)
+            edgeExecutable[b].assign(cfg[b].predecessors.size(), false);
+        vector<pair<size_t, size_t>> flowWork; // (from, to) edges; from == to == 0 enters
+        vector<uint32_t> ssaWork;
+
+        auto operandLattice = [&](size_t i, int operand) -> Lattice
+        {
+            const Operand &arg = operand == 0 ? code[i].arg1 : code[i].arg2;
+            if (arg.kind == OPERAND_IMM)
+                return Lattice{CONSTANT, arg.value};
+            uint32_t v = ssa.use(i, operand);
+            return v == SSAForm::NO_VALUE ? Lattice{VARYING, 0} : lattice[v];
+        };
+
+        auto visitPhi = [&](size_t b, size_t p)
+        {
+            const SSAForm::Phi &phi = ssa.phisOf(b)[p];
+            Lattice merged{UNKNOWN, 0};
+            for (size_t a = 0; a < phi.args.size(); a++)
+            {
+                if (!edgeExecutable[b][a])
+                    continue;
+                Lattice incoming = phi.args[a] == SSAForm::NO_VALUE ? Lattice{VARYING, 0} : lattice[phi.args[a]];
+                if (merged.state == UNKNOWN)
+                    merged = incoming;
+                else if (incoming.state == VARYING || (incoming.state == CONSTANT && incoming.value != merged.value))
+                    merged = Lattice{VARYING, 0};
+            }
+            if (lower(lattice[phi.result], merged))
+                ssaWork.push_back(phi.result);
+        };
+
+        // Queues the edges out of block b that can be taken given what is known
+        auto visitTerminator = [&](size_t b)
+        {
+            const TACInstruction *last = cfg[b].end > cfg[b].begin ? &code[cfg[b].end - 1] : nullptr;
+            bool fallsThrough = b + 1 < cfg.size();
+            if (last != nullptr && last->op == OP_JUMP)
+            {
+                flowWork.emplace_back(b, cfg.blockOf(last->result));
+                return;
+            }
+            if (last != nullptr && (last->op == OP_JUMP_IF_FALSE || last->op == OP_JUMP_IF_TRUE))
+            {
+                Lattice condition = operandLattice(cfg[b].end - 1, 0);
+                if (condition.state == UNKNOWN)
+                {
+                    return;
+                }
+                bool jumpOnTrue = last->op == OP_JUMP_IF_TRUE;
+                bool mayJump = condition.state == VARYING || (condition.value != 0) == jumpOnTrue;
+                bool mayFall = condition.state == VARYING || (condition.value != 0) != jumpOnTrue;
+                if (mayJump)
+                    flowWork.emplace_back(b, cfg.blockOf(last->result));
+                fallsThrough = fallsThrough && mayFall;
+            }
+            if (fallsThrough)
+            {
+                flowWork.emplace_back(b, b + 1);
+            }
+        };
+
+        auto visitInstruction = [&](size_t i)
+        {
+            const TACInstruction &instr = code[i];
+            if (isJump(instr.op))
+            {
+                visitTerminator(blockOf[i]);
+                return;
+            }
+            uint32_t defined = ssa.definition(i);
+            if (defined == SSAForm::NO_VALUE)
+            {
+                return;
+            }
+            Lattice result{VARYING, 0};
+            if (instr.op == OP_COPY)
+            {
+                result = instr.arg1.kind == OPERAND_NONE ? Lattice{VARYING, 0} : operandLattice(i, 0);
+            }
+            else
+            {
+                Lattice a = operandLattice(i, 0);
+                Lattice b = operandLattice(i, 1);
+                int32_t value;
+                if (a.state == VARYING || b.state == VARYING)
+                    result = Lattice{VARYING, 0};
+                else if (a.state == UNKNOWN || b.state == UNKNOWN)
+                    result = Lattice{UNKNOWN, 0};
+                else if (evaluateBinary(instr.op, a.value, b.value, value))
+                    result = Lattice{CONSTANT, value};
+            }
+            if (lower(lattice[defined], result))
+                ssaWork.push_back(defined);
+        };
+
+        flowWork.emplace_back(0, 0);
+        while (!flowWork.empty() || !ssaWork.empty())
+        {
+            while (!flowWork.empty())
+            {
+                pair<size_t, size_t> edge = flowWork.back();
+                flowWork.pop_back();
+                size_t b = edge.second;
+                bool newEdge = edge.first == edge.second && edge.second == 0 && !blockExecutable[0];
+                const vector<size_t> &preds = cfg[b].predecessors;
+                for (size_t p = 0; p < preds.size(); p++)
+                {
+                    if (preds[p] == edge.first && blockExecutable[edge.first] && !edgeExecutable[b][p])
+                    {
+                        edgeExecutable[b][p] = true;
+                        newEdge = true;
+                    }
+                }
+                if (!newEdge)
+                {
+                    continue;
+                }
+                for (size_t p = 0; p < ssa.phisOf(b).size(); p++)
+                {
+                    visitPhi(b, p);
+                }
+                if (!blockExecutable[b])
+                {
+                    blockExecutable[b] = true;
+                    for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+                    {
+                        visitInstruction(i);
+                    }
+                    visitTerminator(b);
+                }
+            }
+            while (!ssaWork.empty() && flowWork.empty())
+            {
+                uint32_t v = ssaWork.back();
+                ssaWork.pop_back();
+                for (const pair<size_t, size_t> &use : phiUses[v])
+                {
+                    if (blockExecutable[use.first])
+                        visitPhi(use.first, use.second);
+                }
+                for (size_t i : instructionUses[v])
+                {
+                    if (blockExecutable[blockOf[i]])
+                        visitInstruction(i);
+                }
+            }
+        }
+
+        // Rewrite: leaving SSA is dropping the versions, so constants are
+        // substituted straight into the original TAC
+        size_t kept = 0;
+        for (size_t b = 0; b < cfg.size(); b++)
+        {
+            for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+            {
+                if (!blockExecutable[b])
+                {
+                    removed++;
+                    continue;
+                }
+                TACInstruction instr = code[i];
+                uint32_t defined = ssa.definition(i);
+                if (defined != SSAForm::NO_VALUE && lattice[defined].state == CONSTANT &&
+                    !(instr.op == OP_COPY && instr.arg1.kind == OPERAND_IMM))
+                {
+                    instr = TACInstruction{OP_COPY, instr.result, Operand::imm(lattice[defined].value), Operand::none()};
+                    replaced++;
+                }
+                else
+                {
+                    for (int operand = 0; operand < 2; operand++)
+                    {
+                        Operand &arg = operand == 0 ? instr.arg1 : instr.arg2;
+                        uint32_t v = ssa.use(i, operand);
+                        if (v != SSAForm::NO_VALUE && lattice[v].state == CONSTANT)
+                        {
+                            arg = Operand::imm(lattice[v].value);
+                            replaced++;
+                        }
+                    }
+                }
+                if ((instr.op == OP_JUMP_IF_FALSE || instr.op == OP_JUMP_IF_TRUE) && instr.arg1.kind == OPERAND_IMM)
+                {
+                    branchesFolded++;
+                    if ((instr.arg1.value != 0) != (instr.op == OP_JUMP_IF_TRUE))
+                    {
+                        continue;
+                    }
+                    instr = TACInstruction{OP_JUMP, instr.result, Operand::none(), Operand::none()};
+                }
+                code[kept++] = instr;
+            }
+        }
+        code.resize(kept);
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "sparse conditional constant propagation: " << phiNodes << " phi nodes, " << replaced
+            << " operands replaced, " << branchesFolded << " branches folded, " << removed
+            << " unreachable instructions removed" << endl;
+    }
+};
+
+// Loop-invariant code motion. An instruction in a loop whose operands are
+// constants, variables the loop never assigns, or temporaries already found
+// invariant computes the same value on every iteration, and moves to the
+// loop's preheader slot. Conservatively, only instructions defining a
+// single-definition temporary move; assignments to variables stay put,
+// division only moves when its divisor is a constant that cannot trap, and
+// loads only with a constant index from an array the loop never stores to.
+class LoopInvariantCodeMotion : public TACPass
+{
+private:
+    size_t hoisted;
+
+    static bool canHoist(const TACInstruction &instr)
+    {
+        if (instr.op == OP_LABEL || isJump(instr.op) || instr.result.kind != OPERAND_TEMP)
+        {
+            return false;
+        }
+        if (instr.op == OP_DIV)
+        {
+            return instr.arg2.kind == OPERAND_IMM && instr.arg2.value != 0 && instr.arg2.value != -1;
+        }
+        if (instr.op == OP_LOAD)
+        {
+            return instr.arg2.kind == OPERAND_IMM; // Checked against the length by the parser
+        }
+        return true;
+    }
+
+public:
+    LoopInvariantCodeMotion() : hoisted(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        // Each round hoists out of loops that do not overlap one already
+        // changed this round; an outer loop sees its inner loops' hoisted
+        // code in the next round
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            unordered_map<int32_t, size_t> tempDefinitions;
+            for (const TACInstruction &instr : code)
+            {
+                if (instr.result.kind == OPERAND_TEMP && instr.op != OP_LABEL && !isJump(instr.op))
+                    tempDefinitions[instr.result.value]++;
+            }
+
+            ControlFlowGraph cfg(code);
+            DominatorTree dominators(cfg);
+            vector<NaturalLoop> loops = findNaturalLoops(cfg, dominators);
+            // Loops come innermost first, and a loop overlaps one changed
+            // earlier this round only by containing it
+            vector<bool> containsChanged(loops.size(), false);
+            vector<bool> moved(code.size(), false);
+            vector<pair<size_t, TACInstruction>> insertions;
+            for (size_t index = 0; index < loops.size(); index++)
+            {
+                const NaturalLoop &loop = loops[index];
+                if (containsChanged[index] || !hasPreheaderSlot(cfg, loop, code))
+                {
+                    continue;
+                }
+
+                unordered_set<int64_t> assigned;
+                for (size_t b : loop.blocks)
+                {
+                    for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+                    {
+                        if (code[i].op != OP_LABEL && !isJump(code[i].op) && code[i].result.kind != OPERAND_NONE)
+                            assigned.insert(operandKey(code[i].result));
+                    }
+                }
+
+                unordered_set<int32_t> invariantTemps;
+                auto isInvariant = [&](const Operand &operand)
+                {
+                    switch (operand.kind)
+                    {
+                    case OPERAND_TEMP:
+                        return invariantTemps.count(operand.value) != 0 || assigned.count(operandKey(operand)) == 0;
+                    case OPERAND_VAR:
+                    case OPERAND_ARRAY:
+                        return assigned.count(operandKey(operand)) == 0;
+                    default:
+                        return true;
+                    }
+                };
+
+                vector<size_t> hoistedHere;
+                bool found = true;
+                while (found)
+                {
+                    found = false;
+                    for (size_t b : loop.blocks)
+                    {
+                        for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+                        {
+                            const TACInstruction &instr = code[i];
+                            if (moved[i] || !canHoist(instr) || tempDefinitions[instr.result.value] != 1 ||
+                                !isInvariant(instr.arg1) || !isInvariant(instr.arg2))
+                            {
+                                continue;
+                            }
+                            moved[i] = true;
+                            invariantTemps.insert(instr.result.value);
+                            hoistedHere.push_back(i);
+                            found = true;
+                        }
+                    }
+                }
+                if (!hoistedHere.empty())
+                {
+                    // Keep the hoisted instructions in their original order
+                    sort(hoistedHere.begin(), hoistedHere.end());
+                    for (size_t i : hoistedHere)
+                        insertions.emplace_back(cfg[loop.header].begin, code[i]);
+                    for (size_t outer = loop.parent; outer != NaturalLoop::NONE && !containsChanged[outer];
+                         outer = loops[outer].parent)
+                        containsChanged[outer] = true;
+                    changed = true;
+                }
+            }
+
+            // Remove the moved instructions, shifting insertion points down
+            // by the number removed before them
+            vector<size_t> removedBefore(code.size() + 1, 0);
+            size_t kept = 0;
+            for (size_t i = 0; i < code.size(); i++)
+            {
+                removedBefore[i + 1] = removedBefore[i] + (moved[i] ? 1 : 0);
+                if (!moved[i])
+                    code[kept++] = code[i];
+            }
+            hoisted += code.size() - kept;
+            code.resize(kept);
+            for (pair<size_t, TACInstruction> &insertion : insertions)
+            {
+                insertion.first -= removedBefore[insertion.first];
+            }
+            insertInstructions(code, insertions);
+        }
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "loop-invariant code motion: " << hoisted << " instructions hoisted" << endl;
+    }
+};
+
+// Strength reduction of loop induction variables. In a loop where every
+// assignment to a variable i is a step `i = i + c` (or `i - c`), each product
+// `i * k` is replaced by a new temporary s kept equal to i * k: s = i * k is
+// computed once before the loop, and s = s + c * k follows each step of i.
+class LoopStrengthReduction : public TACPass
+{
+private:
+    size_t reduced;
+    size_t inductionVariables;
+
+    // Amount `instr` adds to its result variable, if it is a step
+    static bool stepOf(const TACInstruction &instr, int32_t &step)
+    {
+        if (instr.op == OP_ADD && instr.arg1 == instr.result && instr.arg2.kind == OPERAND_IMM)
+        {
+            step = instr.arg2.value;
+            return true;
+        }
+        if (instr.op == OP_ADD && instr.arg2 == instr.result && instr.arg1.kind == OPERAND_IMM)
+        {
+            step = instr.arg1.value;
+            return true;
+        }
+        if (instr.op == OP_SUB && instr.arg1 == instr.result && instr.arg2.kind == OPERAND_IMM)
+        {
+            step = static_cast<int32_t>(0u - static_cast<uint32_t>(instr.arg2.value));
+            return true;
+        }
+        return false;
+    }
+
+public:
+    LoopStrengthReduction() : reduced(0), inductionVariables(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        int32_t nextTemp = 0;
+        unordered_map<int32_t, size_t> tempDefinitions;
+        for (const TACInstruction &instr : code)
+        {
+            for (const Operand *operand : {&instr.arg1, &instr.arg2, &instr.result})
+            {
+                if (operand->kind == OPERAND_TEMP)
+                    nextTemp = max(nextTemp, operand->value + 1);
+            }
+            if (instr.result.kind == OPERAND_TEMP)
+                tempDefinitions[instr.result.value]++;
+        }
+
+        ControlFlowGraph cfg(code);
+        DominatorTree dominators(cfg);
+        vector<pair<size_t, TACInstruction>> insertions;
+        unordered_map<int32_t, Operand> renamed; // Temporaries now equal to a reduced product
+        for (const NaturalLoop &loop : findNaturalLoops(cfg, dominators))
+        {
+            if (!hasPreheaderSlot(cfg, loop, code))
+            {
+                continue;
+            }
+
+            // Steps (index, amount) of every variable assigned in the loop;
+            // a variable with any other kind of assignment is not an induction variable
+            unordered_map<int32_t, vector<pair<size_t, int32_t>>> steps;
+            unordered_map<int32_t, bool> isInduction;
+            for (size_t b : loop.blocks)
+            {
+                for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+                {
+                    const TACInstruction &instr = code[i];
+                    if (instr.result.kind != OPERAND_VAR || instr.op == OP_LABEL || isJump(instr.op))
+                    {
+                        continue;
+                    }
+                    int32_t step = 0;
+                    bool isStep = stepOf(instr, step);
+                    auto known = isInduction.emplace(instr.result.value, isStep);
+                    known.first->second = known.first->second && isStep;
+                    if (isStep)
+                        steps[instr.result.value].emplace_back(i, step);
+                }
+            }
+
+            map<pair<int32_t, int32_t>, Operand> products; // (variable, factor) -> temporary
+            for (size_t b : loop.blocks)
+            {
+                for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+                {
+                    TACInstruction &instr = code[i];
+                    if (instr.op != OP_MUL)
+                    {
+                        continue;
+                    }
+                    Operand variable = instr.arg1.kind == OPERAND_VAR ? instr.arg1 : instr.arg2;
+                    Operand factor = instr.arg1.kind == OPERAND_VAR ? instr.arg2 : instr.arg1;
+                    auto induction = isInduction.find(variable.value);
+                    if (variable.kind != OPERAND_VAR || factor.kind != OPERAND_IMM || induction == isInduction.end() ||
+                        !induction->second)
+                    {
+                        continue;
+                    }
+
+                    auto product = products.find({variable.value, factor.value});
+                    if (product == products.end())
+                    {
+                        Operand temp = Operand::temp(nextTemp++);
+                        product = products.emplace(make_pair(variable.value, factor.value), temp).first;
+                        insertions.emplace_back(cfg[loop.header].begin, TACInstruction{OP_MUL, temp, variable, factor});
+                        for (const pair<size_t, int32_t> &step : steps[variable.value])
+                        {
+                            int32_t increment;
+                            evaluateBinary(OP_MUL, step.second, factor.value, increment);
+                            insertions.emplace_back(step.first + 1, TACInstruction{OP_ADD, temp, temp, Operand::imm(increment)});
+                        }
+                        inductionVariables++;
+                    }
+                    if (instr.result.kind == OPERAND_TEMP && tempDefinitions[instr.result.value] == 1)
+                    {
+                        renamed[instr.result.value] = product->second;
+                    }
+                    instr = TACInstruction{OP_COPY, instr.result, product->second, Operand::none()};
+                    reduced++;
+                }
+            }
+        }
+
+        // Uses of a replaced product's temporary read the reduced value
+        // directly, leaving its copy for dead code elimination
+        for (TACInstruction &instr : code)
+        {
+            for (Operand *operand : {&instr.arg1, &instr.arg2})
+            {
+                auto it = operand->kind == OPERAND_TEMP ? renamed.find(operand->value) : renamed.end();
+                if (it != renamed.end())
+                    *operand = it->second;
+            }
+        }
+        insertInstructions(code, insertions);
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "loop strength reduction: " << reduced << " multiplications replaced, " << inductionVariables
+            << " induction products introduced" << endl;
+    }
+};
+
+// Vector registers the loop vectorizer and code generator target
+inline int32_t vectorLanes(VectorISA isa)
+{
+    return isa == VECTOR_AVX2 ? 8 : 4;
+}
+
+// Loop vectorization of counted loops whose body works element by element:
+//
+//   Lc:                                    Lv:
+//     t = i < n                              t' = i < n - (W - 1)
+//     ifFalse t goto Le                      ifFalse t' goto Lc
+//     t1 = b[i]                              v0 = b[i]
+//     t2 = t1 * 3                ->          v2 = v0 * v1        (v1 = 3 in every lane)
+//     a[i] = t2                              a[i] = v2
+//     i = i + 1                              i = i + W
+//     goto Lc                                goto Lv
+//                                          Lc: <the original loop>
+//
+// The vector loop runs while W whole elements remain, and the original loop,
+// left in place, finishes the last n mod W. The body may only index arrays
+// by the counter itself, add, subtract and multiply (there is no packed
+// integer divide), and define temporaries nothing outside it reads; it may
+// not assign variables other than the final step, so there are no
+// reductions. With every index exactly i, no iteration reads an element
+// another one writes, and running W iterations side by side lane-wise gives
+// the same result as running them one after another.
+//
+// Scalar operands (constants, variables the loop does not assign) are
+// broadcast to every lane once before the vector loop. Each loop uses its
+// own vector temporaries v0 to v15, which the code generator maps one to one
+// onto the vector registers.
+class LoopVectorization : public TACPass
+{
+private:
+    static const int32_t MAX_VECTOR_TEMPS = 16;
+
+    int32_t lanes;
+    size_t vectorized;
+
+    static bool isStep(const TACInstruction &instr, const Operand &counter)
+    {
+        return instr.op == OP_ADD && instr.result == counter &&
+               ((instr.arg1 == counter && instr.arg2 == Operand::imm(1)) ||
+                (instr.arg2 == counter && instr.arg1 == Operand::imm(1)));
+    }
+
+    // Vector form of the counted loop `Lc: t = i < n; ifFalse t goto Le;
+    // <body> i = i + 1; goto Lc` at `header`, or false if it does not qualify
+    bool vectorize(const vector<TACInstruction> &code, size_t header, const unordered_map<int32_t, size_t> &tempUses,
+                   const unordered_map<int32_t, size_t> &labelUses, int32_t &nextTemp, int32_t &nextLabel,
+                   vector<TACInstruction> &out)
+    {
+        if (header + 3 >= code.size())
+        {
+            return false;
+        }
+        const TACInstruction &label = code[header];
+        const TACInstruction &compare = code[header + 1];
+        const TACInstruction &exit = code[header + 2];
+        Operand counter, bound;
+        if (compare.op == OP_LT && compare.arg1.kind == OPERAND_VAR)
+        {
+            counter = compare.arg1;
+            bound = compare.arg2;
+        }
+        else if (compare.op == OP_GT && compare.arg2.kind == OPERAND_VAR)
+        {
+            counter = compare.arg2;
+            bound = compare.arg1;
+        }
+        else
+        {
+            return false;
+        }
+        auto labelUse = labelUses.find(label.result.value);
+        auto compareUse = tempUses.find(compare.result.value);
+        if (labelUse == labelUses.end() || labelUse->second != 1 || compare.result.kind != OPERAND_TEMP ||
+            compareUse == tempUses.end() || compareUse->second != 1 || exit.op != OP_JUMP_IF_FALSE ||
+            exit.arg1 != compare.result || bound == counter)
+        {
+            return false;
+        }
+
+        // Straight-line body up to the step and the jump back
+        size_t begin = header + 3, end = begin;
+        while (end < code.size() && code[end].op != OP_LABEL && !isJump(code[end].op))
+        {
+            end++;
+        }
+        if (end >= code.size() || end - begin < 2 || code[end].op != OP_JUMP || code[end].result != label.result ||
+            !isStep(code[end - 1], counter))
+        {
+            return false;
+        }
+        size_t step = end - 1;
+
+        // Body temporaries must be defined once and read only in the body
+        unordered_map<int32_t, size_t> bodyUses;
+        unordered_set<int32_t> bodyTemps;
+        for (size_t i = begin; i < step; i++)
+        {
+            const TACInstruction &instr = code[i];
+            for (const Operand *use : {&instr.arg1, &instr.arg2})
+            {
+                if (use->kind == OPERAND_TEMP)
+                    bodyUses[use->value]++;
+            }
+            if (instr.result.kind == OPERAND_TEMP && !bodyTemps.insert(instr.result.value).second)
+            {
+                return false;
+            }
+        }
+        for (int32_t temp : bodyTemps)
+        {
+            auto uses = tempUses.find(temp);
+            if (uses != tempUses.end() && uses->second != bodyUses[temp])
+                return false;
+        }
+        if ((bound.kind == OPERAND_TEMP && bodyTemps.count(bound.value)) || bound.kind == OPERAND_NONE)
+        {
+            return false;
+        }
+
+        // Vector temporary for each body temporary and broadcast scalar
+        unordered_map<int64_t, Operand> vectorOf;
+        vector<TACInstruction> broadcasts;
+        vector<TACInstruction> body;
+        int32_t nextVector = 0;
+        bool ok = true;
+        bool stores = false;
+        auto vectorOperand = [&](const Operand &operand)
+        {
+            auto it = vectorOf.find(operandKey(operand));
+            if (it != vectorOf.end())
+            {
+                return it->second;
+            }
+            bool scalar = operand.kind == OPERAND_IMM || (operand.kind == OPERAND_VAR && operand != counter) ||
+                          (operand.kind == OPERAND_TEMP && !bodyTemps.count(operand.value));
+            if (!scalar)
+            {
+                ok = false; // The counter's own value, or a temporary used before its definition
+                return Operand::none();
+            }
+            Operand vector = Operand::vtemp(nextVector++);
+            broadcasts.push_back(TACInstruction{OP_COPY, vector, operand, Operand::none()});
+            vectorOf.emplace(operandKey(operand), vector);
+            return vector;
+        };
+        for (size_t i = begin; i < step && ok; i++)
+        {
+            const TACInstruction &instr = code[i];
+            switch (instr.op)
+            {
+            case OP_LOAD:
+                if (instr.arg2 != counter || instr.result.kind != OPERAND_TEMP)
+                {
+                    return false;
+                }
+                vectorOf[operandKey(instr.result)] = Operand::vtemp(nextVector++);
+                body.push_back(TACInstruction{OP_LOAD, vectorOf[operandKey(instr.result)], instr.arg1, counter});
+                break;
+            case OP_STORE:
+                if (instr.arg1 != counter)
+                {
+                    return false;
+                }
+                body.push_back(TACInstruction{OP_STORE, instr.result, counter, vectorOperand(instr.arg2)});
+                stores = true;
+                break;
+            case OP_COPY:
+                if (instr.result.kind != OPERAND_TEMP || instr.arg1.kind == OPERAND_NONE)
+                {
+                    return false;
+                }
+                vectorOf[operandKey(instr.result)] = vectorOperand(instr.arg1);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            {
+                if (instr.result.kind != OPERAND_TEMP)
+                {
+                    return false;
+                }
+                Operand left = vectorOperand(instr.arg1);
+                Operand right = vectorOperand(instr.arg2);
+                vectorOf[operandKey(instr.result)] = Operand::vtemp(nextVector++);
+                body.push_back(TACInstruction{instr.op, vectorOf[operandKey(instr.result)], left, right});
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        if (!ok || !stores || nextVector > MAX_VECTOR_TEMPS)
+        {
+            return false;
+        }
+
+        // Guard: W elements remain while i < n - (W - 1)
+        Operand vectorLabel = Operand::label(nextLabel++);
+        Operand remaining = Operand::temp(nextTemp++);
+        out.insert(out.end(), broadcasts.begin(), broadcasts.end());
+        out.push_back(TACInstruction{OP_LABEL, vectorLabel, Operand::none(), Operand::none()});
+        if (bound.kind == OPERAND_IMM)
+        {
+            if (bound.value < INT32_MIN + (lanes - 1))
+            {
+                return false;
+            }
+            out.push_back(TACInstruction{OP_LT, remaining, counter, Operand::imm(bound.value - (lanes - 1))});
+        }
+        else
+        {
+            Operand last = Operand::temp(nextTemp++);
+            out.push_back(TACInstruction{OP_ADD, last, counter, Operand::imm(lanes - 1)});
+            out.push_back(TACInstruction{OP_LT, remaining, last, bound});
+        }
+        out.push_back(TACInstruction{OP_JUMP_IF_FALSE, label.result, remaining, Operand::none()});
+        out.insert(out.end(), body.begin(), body.end());
+        out.push_back(TACInstruction{OP_ADD, counter, counter, Operand::imm(lanes)});
+        out.push_back(TACInstruction{OP_JUMP, vectorLabel, Operand::none(), Operand::none()});
+        return true;
+    }
+
+public:
+    explicit LoopVectorization(int32_t lanes) : lanes(lanes), vectorized(0) {}
+
+    void run(vector<TACInstruction> &code) override
+    {
+        int32_t nextTemp = 0, nextLabel = 0;
+        unordered_map<int32_t, size_t> tempUses;
+        unordered_map<int32_t, size_t> labelUses;
+        for (const TACInstruction &instr : code)
+        {
+            for (const Operand *operand : {&instr.arg1, &instr.arg2, &instr.result})
+            {
+                if (operand->kind == OPERAND_TEMP)
+                    nextTemp = max(nextTemp, operand->value + 1);
+                if (operand->kind == OPERAND_LABEL)
+                    nextLabel = max(nextLabel, operand->value + 1);
+            }
+            if (instr.arg1.kind == OPERAND_TEMP)
+                tempUses[instr.arg1.value]++;
+            if (instr.arg2.kind == OPERAND_TEMP)
+                tempUses[instr.arg2.value]++;
+            if (isJump(instr.op))
+                labelUses[instr.result.value]++;
+        }
+
+        vector<TACInstruction> out;
+        out.reserve(code.size());
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            size_t mark = out.size();
+            if (code[i].op == OP_LABEL && !vectorize(code, i, tempUses, labelUses, nextTemp, nextLabel, out))
+            {
+                out.resize(mark);
+            }
+            else if (code[i].op == OP_LABEL)
+            {
+                vectorized++;
+            }
+            out.push_back(code[i]);
+        }
+        code.swap(out);
+    }
+
+    void printStats(ostream &out) const override
+    {
+        out << "loop vectorization: " << vectorized << " loops vectorized, " << lanes << " lanes" << endl;
+    }
+};
+
+// Runs the passes enabled at an -O level, in order
+class PassManager
+{
+private:
+    vector<unique_ptr<TACPass>> passes;
+
+public:
+    explicit PassManager(int optLevel, VectorISA isa = VECTOR_SSE)
+    {
+        if (optLevel >= 1)
+        {
+            passes.emplace_back(new ConstantPropagation());
+            passes.emplace_back(new SparseConditionalConstantPropagation());
+            passes.emplace_back(new BranchFolding());
+            passes.emplace_back(new CopyPropagation());
+            passes.emplace_back(new LoopInvariantCodeMotion());
+            passes.emplace_back(new LoopStrengthReduction());
+            passes.emplace_back(new ValueNumbering());
+            passes.emplace_back(new DeadCodeElimination());
+        }
+        if (optLevel >= 2)
+        {
+            passes.emplace_back(new LoopVectorization(vectorLanes(isa)));
+        }
+    }
+
+    bool empty() const
+    {
+        return passes.empty();
+    }
+
+    void run(vector<TACInstruction> &code)
+    {
+        for (auto &pass : passes)
+        {
+            pass->run(code);
+        }
+    }
+
+    void printStats(ostream &out) const
+    {
+        for (const auto &pass : passes)
+        {
+            pass->printStats(out);
+        }
+    }
+};
+
+// Range of instruction indices over which a temporary holds a value that is
+// still needed: from its definition to its last use
+struct LiveInterval
+{
+    int32_t temp;
+    size_t start;
+    size_t end;
+};
+
+// Live intervals of every temporary in a block of TAC, ordered by start.
+// A temporary used in a different basic block from its definition is live
+// across every block on the paths between them (including around loop back
+// edges), and its interval is widened to cover those blocks.
+vector<LiveInterval> computeLiveIntervals(const vector<TACInstruction> &code)
+{
+    ControlFlowGraph cfg(code);
+    vector<LiveInterval> intervals;
+    unordered_map<int32_t, size_t> intervalOf;
+    unordered_map<int32_t, size_t> lastDefinedIn; // Temp -> block of its latest definition so far
+    vector<pair<int32_t, size_t>> exposedUses;    // Uses not preceded by a definition in their block
+
+    auto touch = [&](const Operand &operand, size_t index, size_t block, bool isDefinition)
+    {
+        if (operand.kind != OPERAND_TEMP)
+        {
+            return;
+        }
+        auto it = intervalOf.find(operand.value);
+        if (it == intervalOf.end())
+        {
+            it = intervalOf.emplace(operand.value, intervals.size()).first;
+            intervals.push_back(LiveInterval{operand.value, index, index});
+        }
+        intervals[it->second].end = max(intervals[it->second].end, index);
+        intervals[it->second].start = min(intervals[it->second].start, index);
+        if (isDefinition)
+        {
+            lastDefinedIn[operand.value] = block;
+        }
+        else
+        {
+            auto def = lastDefinedIn.find(operand.value);
+            if (def == lastDefinedIn.end() || def->second != block)
+            {
+                exposedUses.emplace_back(operand.value, block);
+            }
+        }
+    };
+    for (size_t b = 0; b < cfg.size(); b++)
+    {
+        for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+        {
+            touch(code[i].arg1, i, b, false);
+            touch(code[i].arg2, i, b, false);
+            touch(code[i].result, i, b, code[i].op != OP_LABEL && !isJump(code[i].op));
+        }
+    }
+
+    // Walk backwards from each exposed use until reaching blocks that define
+    // the temporary, widening its interval over every block passed through
+    unordered_map<int32_t, vector<size_t>> definingBlocks;
+    for (size_t b = 0; b < cfg.size(); b++)
+    {
+        for (size_t i = cfg[b].begin; i < cfg[b].end; i++)
+        {
+            if (code[i].result.kind == OPERAND_TEMP)
+                definingBlocks[code[i].result.value].push_back(b);
+        }
+    }
+    vector<size_t> visitedFor(cfg.size(), SIZE_MAX);
+    vector<size_t> worklist;
+    for (size_t u = 0; u < exposedUses.size(); u++)
+    {
+        int32_t temp = exposedUses[u].first;
+        LiveInterval &interval = intervals[intervalOf[temp]];
+        const vector<size_t> &defs = definingBlocks[temp];
+        worklist.assign(1, exposedUses[u].second);
+        interval.start = min(interval.start, cfg[exposedUses[u].second].begin);
+        while (!worklist.empty())
+        {
+            size_t block = worklist.back();
+            worklist.pop_back();
+            for (size_t pred : cfg[block].predecessors)
+            {
+                if (visitedFor[pred] == u)
+                {
+                    continue;
+                }
+                visitedFor[pred] = u;
+                // Live out of pred
+                interval.end = max(interval.end, cfg[pred].end - 1);
+                if (find(defs.begin(), defs.end(), pred) == defs.end())
+                {
+                    interval.start = min(interval.start, cfg[pred].begin);
+                    worklist.push_back(pred);
+                }
+            }
+        }
+    }
+
+    sort(intervals.begin(), intervals.end(), [](const LiveInterval &a, const LiveInterval &b)
+         { return a.start < b.start; });
+    return intervals;
+}
+
+// x86 registers the code generator names. al and cl are the low bytes of
+// eax and ecx; xmmN is the low half of ymmN.
+enum Register : uint8_t
+{
+    REG_EAX,
+    REG_ECX,
+    REG_EDX,
+    REG_EBX,
+    REG_ESI,
+    REG_EDI,
+    REG_EBP,
+    REG_AL,
+    REG_CL,
+    REG_XMM0,
+    REG_XMM1,
+    REG_XMM2,
+    REG_XMM3,
+    REG_XMM4,
+    REG_XMM5,
+    REG_XMM6,
+    REG_XMM7,
+    REG_XMM8,
+    REG_XMM9,
+    REG_XMM10,
+    REG_XMM11,
+    REG_XMM12,
+    REG_XMM13,
+    REG_XMM14,
+    REG_XMM15,
+    REG_YMM0,
+    REG_YMM1,
+    REG_YMM2,
+    REG_YMM3,
+    REG_YMM4,
+    REG_YMM5,
+    REG_YMM6,
+    REG_YMM7,
+    REG_YMM8,
+    REG_YMM9,
+    REG_YMM10,
+    REG_YMM11,
+    REG_YMM12,
+    REG_YMM13,
+    REG_YMM14,
+    REG_YMM15,
+    NO_REGISTER,
+};
+
+const char *const REGISTER_NAMES[] = {
+    "eax", "ecx", "edx", "ebx", "esi", "edi", "ebp", "al", "cl",
+    "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+    "ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "ymm5", "ymm6", "ymm7",
+    "ymm8", "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15"};
+static_assert(sizeof(REGISTER_NAMES) / sizeof(REGISTER_NAMES[0]) == NO_REGISTER, "one name per Register");
+
+// Full register a byte register is part of
+inline Register fullRegister(Register reg)
+{
+    return reg == REG_AL ? REG_EAX : reg == REG_CL ? REG_ECX
+                                                   : reg;
+}
+
+// eax, ecx and edx (and their byte parts) only ever carry values within the
+// code for a single TAC instruction
+inline bool isScratch(Register reg)
+{
+    reg = fullRegister(reg);
+    return reg == REG_EAX || reg == REG_ECX || reg == REG_EDX;
+}
+
+// Registers handed out to temporaries. eax and edx are kept free as the
+// accumulator and idiv's high half, ecx as a scratch register.
+const Register ALLOCATABLE_REGISTERS[] = {REG_EBX, REG_ESI, REG_EDI, REG_EBP};
+const int REGISTER_COUNT = sizeof(ALLOCATABLE_REGISTERS) / sizeof(ALLOCATABLE_REGISTERS[0]);
+const int8_t SPILLED = -1;
+
+// Linear-scan register allocation (Poletto & Sarkar). Temporaries that do not
+// get a register are spilled to their memory slot [tN].
+class RegisterAllocator
+{
+private:
+    int32_t firstTemp;
+    vector<int8_t> assignment; // Indexed by temp - firstTemp
+    size_t spillCount;
+
+public:
+    RegisterAllocator() : firstTemp(0), spillCount(0) {}
+
+    void allocate(const vector<TACInstruction> &code)
+    {
+        vector<LiveInterval> intervals = computeLiveIntervals(code);
+        assignment.clear();
+        spillCount = 0;
+        if (intervals.empty())
+        {
+            return;
+        }
+
+        int32_t lastTemp = intervals[0].temp;
+        firstTemp = intervals[0].temp;
+        for (const LiveInterval &interval : intervals)
+        {
+            firstTemp = min(firstTemp, interval.temp);
+            lastTemp = max(lastTemp, interval.temp);
+        }
+        assignment.assign(lastTemp - firstTemp + 1, SPILLED);
+
+        vector<const LiveInterval *> active; // Sorted by increasing end
+        bool registerFree[REGISTER_COUNT];
+        fill(registerFree, registerFree + REGISTER_COUNT, true);
+
+        for (const LiveInterval &current : intervals)
+        {
+            // Expire intervals that ended before this one starts. An interval
+            // ending here still holds an operand of the defining instruction.
+            while (!active.empty() && active.front()->end < current.start)
+            {
+                registerFree[assignment[active.front()->temp - firstTemp]] = true;
+                active.erase(active.begin());
+            }
+
+            int8_t reg = SPILLED;
+            for (int r = 0; r < REGISTER_COUNT; r++)
+            {
+                if (registerFree[r])
+                {
+                    reg = static_cast<int8_t>(r);
+                    break;
+                }
+            }
+
+            if (reg == SPILLED)
+            {
+                // Spill whichever of the current and active intervals ends last
+                const LiveInterval *victim = active.back();
+                spillCount++;
+                if (victim->end <= current.end)
+                {
+                    continue;
+                }
+                reg = assignment[victim->temp - firstTemp];
+                assignment[victim->temp - firstTemp] = SPILLED;
+                active.pop_back();
+            }
+
+            assignment[current.temp - firstTemp] = reg;
+            registerFree[reg] = false;
+            auto position = upper_bound(active.begin(), active.end(), &current,
+                                        [](const LiveInterval *a, const LiveInterval *b)
+                                        { return a->end < b->end; });
+            active.insert(position, &current);
+        }
+    }
+
+    // Register holding a temporary, or NO_REGISTER if it lives in memory
+    Register registerOf(int32_t temp) const
+    {
+        size_t index = static_cast<size_t>(temp - firstTemp);
+        if (temp < firstTemp || index >= assignment.size() || assignment[index] == SPILLED)
+        {
+            return NO_REGISTER;
+        }
+        return ALLOCATABLE_REGISTERS[assignment[index]];
+    }
+
+    size_t getSpillCount() const
+    {
+        return spillCount;
+    }
+};
+
+// Growable buffer that generated assembly is written into
+class AsmBuffer
+{
+private:
+    string buffer;
+
+public:
+    AsmBuffer &operator<<(string_view text)
+    {
+        buffer.append(text.data(), text.size());
+        return *this;
+    }
+
+    AsmBuffer &operator<<(char c)
+    {
+        buffer.push_back(c);
+        return *this;
+    }
+
+    AsmBuffer &operator<<(int32_t value)
+    {
+        char digits[12];
+        char *end = to_chars(digits, digits + sizeof(digits), value).ptr;
+        buffer.append(digits, end - digits);
+        return *this;
+    }
+
+    string_view text() const
+    {
+        return buffer;
+    }
+};
+
+enum X86Op : uint8_t
+{
+    X86_MOV,
+    X86_MOVZX,
+    X86_ADD,
+    X86_SUB,
+    X86_IMUL,
+    X86_IMUL_WIDE, // imul r/m: edx:eax = eax * r/m
+    X86_IDIV,
+    X86_CDQ,
+    X86_XOR,
+    X86_AND,
+    X86_OR,
+    X86_CMP,
+    X86_TEST,
+    X86_SHL,
+    X86_SAR,
+    X86_SHR,
+    X86_NEG,
+    X86_LEA,
+    X86_SETG,
+    X86_SETL,
+    X86_SETE,
+    X86_SETNE,
+    X86_JMP,
+    X86_JG,
+    X86_JLE,
+    X86_JL,
+    X86_JGE,
+    X86_JE,
+    X86_JNE,
+    X86_MOVD,   // movd xmm, r32
+    X86_PSHUFD, // pshufd xmm, xmm, imm
+    X86_MOVDQU,
+    X86_MOVDQA,
+    X86_PADDD,
+    X86_PSUBD,
+    X86_PMULLD,
+    X86_VMOVD,
+    X86_VPBROADCASTD, // vpbroadcastd ymm, xmm
+    X86_VMOVDQU,
+    X86_VPADDD, // AVX forms take two sources: op dest, src, src2
+    X86_VPSUBD,
+    X86_VPMULLD,
+    X86_LABEL,
+    X86_DELETED, // Removed by the peephole optimizer; not emitted
+};
+
+const char *const X86_MNEMONICS[] = {
+    "mov", "movzx", "add", "sub", "imul", "imul", "idiv", "cdq", "xor", "and", "or", "cmp", "test",
+    "shl", "sar", "shr", "neg", "lea", "setg", "setl", "sete", "setne", "jmp", "jg", "jle", "jl", "jge", "je", "jne",
+    "movd", "pshufd", "movdqu", "movdqa", "paddd", "psubd", "pmulld",
+    "vmovd", "vpbroadcastd", "vmovdqu", "vpaddd", "vpsubd", "vpmulld"};
+static_assert(sizeof(X86_MNEMONICS) / sizeof(X86_MNEMONICS[0]) == X86_LABEL, "one mnemonic per instruction X86Op");
+
+inline bool isConditionalJump(X86Op op)
+{
+    return op >= X86_JG && op <= X86_JNE;
+}
+
+// Jump taken exactly when `op` is not. Conditions come in pairs.
+inline X86Op invertJump(X86Op op)
+{
+    return static_cast<X86Op>(X86_JG + ((op - X86_JG) ^ 1));
+}
+
+enum X86OperandKind : uint8_t
+{
+    X86_OPERAND_NONE,
+    X86_OPERAND_REG,   // value: Register
+    X86_OPERAND_IMM,   // value: the constant
+    X86_OPERAND_VAR,   // value: SymbolId of [name]
+    X86_OPERAND_SLOT,  // value: temp number of spill slot [tN]
+    X86_OPERAND_LABEL, // value: label number
+    X86_OPERAND_ADDRESS, // [base + index * scale], only as lea's source
+    X86_OPERAND_ELEMENT, // [name + index * scale + displacement]; value: the array's SymbolId
+};
+
+struct X86Operand
+{
+    X86OperandKind kind;
+    Register base;
+    Register index;
+    uint8_t scale;
+    int32_t value;
+    int32_t displacement;
+
+    static X86Operand none() { return {X86_OPERAND_NONE, NO_REGISTER, NO_REGISTER, 0, 0, 0}; }
+    static X86Operand reg(Register r) { return {X86_OPERAND_REG, NO_REGISTER, NO_REGISTER, 0, r, 0}; }
+    static X86Operand imm(int32_t v) { return {X86_OPERAND_IMM, NO_REGISTER, NO_REGISTER, 0, v, 0}; }
+    static X86Operand var(int32_t id) { return {X86_OPERAND_VAR, NO_REGISTER, NO_REGISTER, 0, id, 0}; }
+    static X86Operand slot(int32_t temp) { return {X86_OPERAND_SLOT, NO_REGISTER, NO_REGISTER, 0, temp, 0}; }
+    static X86Operand label(int32_t n) { return {X86_OPERAND_LABEL, NO_REGISTER, NO_REGISTER, 0, n, 0}; }
+
+    // [base + index*scale + displacement] for lea; base or index may be NO_REGISTER
+    static X86Operand address(Register base, Register index, uint8_t scale, int32_t displacement = 0)
+    {
+        return {X86_OPERAND_ADDRESS, base, index, scale, 0, displacement};
+    }
+
+    // Element of an int array; index is NO_REGISTER for a constant element
+    static X86Operand element(int32_t array, Register index, int32_t displacement)
+    {
+        return {X86_OPERAND_ELEMENT, NO_REGISTER, index, 4, array, displacement};
+    }
+
+    bool isReg() const
+    {
+        return kind == X86_OPERAND_REG;
+    }
+
+    bool isReg(Register r) const
+    {
+        return kind == X86_OPERAND_REG && value == r;
+    }
+
+    bool isImm(int32_t v) const
+    {
+        return kind == X86_OPERAND_IMM && value == v;
+    }
+
+    bool isMemory() const
+    {
+        return kind == X86_OPERAND_VAR || kind == X86_OPERAND_SLOT || kind == X86_OPERAND_ELEMENT;
+    }
+
+    bool operator==(const X86Operand &other) const
+    {
+        return kind == other.kind && value == other.value && base == other.base && index == other.index &&
+               scale == other.scale && displacement == other.displacement;
+    }
+
+    bool operator!=(const X86Operand &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// One assembly instruction, "op dest, src", before it is written out as text
+struct X86Instr
+{
+    X86Op op;
+    X86Operand dest;
+    X86Operand src;
+    X86Operand src2; // pshufd's immediate, or the second source of an AVX operation
+};
+
+// Sliding-window peephole optimizer over generated x86. Each rule looks at
+// the instruction at a position and the ones after it and either rewrites
+// them in place (marking removed ones X86_DELETED) or leaves them alone.
+// After a rewrite the window backs up so the result can match again.
+//
+// Rules rely on two properties of the code generator's output: scratch
+// registers (eax, ecx, edx) are dead between TAC instructions, and flags are
+// never live across a label or jump.
+class PeepholeOptimizer
+{
+private:
+    typedef bool (*Rule)(vector<X86Instr> &code, size_t i);
+
+    struct RuleEntry
+    {
+        const char *name;
+        Rule apply;
+    };
+
+    static const RuleEntry RULES[];
+    static const size_t RULE_COUNT;
+
+    vector<size_t> hits;
+
+    // Index of the next instruction after i that was not deleted
+    static size_t next(const vector<X86Instr> &code, size_t i)
+    {
+        do
+        {
+            i++;
+        } while (i < code.size() && code[i].op == X86_DELETED);
+        return i;
+    }
+
+    static bool writesFlags(X86Op op)
+    {
+        return op == X86_ADD || op == X86_SUB || op == X86_IMUL || op == X86_IMUL_WIDE || op == X86_IDIV ||
+               op == X86_XOR || op == X86_AND || op == X86_OR || op == X86_CMP || op == X86_TEST ||
+               op == X86_SHL || op == X86_SAR || op == X86_SHR || op == X86_NEG;
+    }
+
+    static bool readsFlags(X86Op op)
+    {
+        return isConditionalJump(op) || (op >= X86_SETG && op <= X86_SETNE);
+    }
+
+    // Whether anything after instruction i reads the flags it leaves behind
+    static bool flagsDeadAfter(const vector<X86Instr> &code, size_t i)
+    {
+        for (size_t j = next(code, i); j < code.size(); j = next(code, j))
+        {
+            X86Op op = code[j].op;
+            if (readsFlags(op))
+                return false;
+            if (writesFlags(op) || op == X86_LABEL || op == X86_JMP)
+                return true;
+        }
+        return true;
+    }
+
+    static bool mentions(const X86Operand &operand, Register reg)
+    {
+        if (operand.kind == X86_OPERAND_ADDRESS || operand.kind == X86_OPERAND_ELEMENT)
+        {
+            return operand.base == reg || operand.index == reg;
+        }
+        return operand.isReg() && fullRegister(static_cast<Register>(operand.value)) == reg;
+    }
+
+    // Whether the scratch register `reg` is overwritten or abandoned after
+    // instruction i before anything reads it
+    static bool scratchDeadAfter(const vector<X86Instr> &code, size_t i, Register reg)
+    {
+        for (size_t j = next(code, i); j < code.size(); j = next(code, j))
+        {
+            const X86Instr &instr = code[j];
+            switch (instr.op)
+            {
+            case X86_LABEL:
+            case X86_JMP:
+                return true;
+            case X86_IDIV:
+                return false; // Reads edx:eax
+            case X86_IMUL_WIDE:
+                if (reg == REG_EAX || mentions(instr.dest, reg))
+                    return false;
+                if (reg == REG_EDX)
+                    return true;
+                continue;
+            case X86_CDQ:
+                if (reg == REG_EAX)
+                    return false;
+                if (reg == REG_EDX)
+                    return true;
+                continue;
+            case X86_MOV:
+            case X86_MOVZX:
+            case X86_LEA:
+                if (mentions(instr.src, reg) || (!instr.dest.isReg() && mentions(instr.dest, reg)))
+                    return false;
+                if (instr.dest.isReg(reg))
+                    return true;
+                continue;
+            default:
+                if (mentions(instr.src, reg) || mentions(instr.dest, reg) || mentions(instr.src2, reg))
+                    return false;
+                continue;
+            }
+        }
+        return true;
+    }
+
+    static bool isArithmetic(X86Op op)
+    {
+        return op == X86_ADD || op == X86_SUB || op == X86_AND || op == X86_OR || op == X86_XOR;
+    }
+
+    // mov r, r
+    static bool removeSelfMove(vector<X86Instr> &code, size_t i)
+    {
+        if (code[i].op != X86_MOV || !code[i].dest.isReg() || code[i].dest != code[i].src)
+        {
+            return false;
+        }
+        code[i].op = X86_DELETED;
+        return true;
+    }
+
+    // mov [m], r / mov r2, [m]  ->  mov [m], r / mov r2, r
+    static bool forwardStore(vector<X86Instr> &code, size_t i)
+    {
+        size_t j = next(code, i);
+        if (j >= code.size() || code[i].op != X86_MOV || !code[i].dest.isMemory() || !code[i].src.isReg() ||
+            code[j].op != X86_MOV || code[j].src != code[i].dest || !code[j].dest.isReg())
+        {
+            return false;
+        }
+        code[j].src = code[i].src;
+        return true;
+    }
+
+    // mov eax, [m] / op eax, x / mov [m], eax  ->  op dword [m], x
+    static bool mergeReadModifyWrite(vector<X86Instr> &code, size_t i)
+    {
+        size_t j = next(code, i);
+        size_t k = j < code.size() ? next(code, j) : j;
+        if (k >= code.size() || code[i].op != X86_MOV || !code[i].dest.isReg() || !code[i].src.isMemory())
+        {
+            return false;
+        }
+        Register reg = static_cast<Register>(code[i].dest.value);
+        const X86Operand &memory = code[i].src;
+        X86Op op = code[j].op;
+        bool modifies = isArithmetic(op) || op == X86_SHL || op == X86_SAR || op == X86_SHR || op == X86_NEG;
+        if (!isScratch(reg) || !modifies || mentions(memory, reg) || !code[j].dest.isReg(reg) || code[j].src.isMemory() ||
+            mentions(code[j].src, reg) || code[k].op != X86_MOV || code[k].dest != memory || !code[k].src.isReg(reg) ||
+            !scratchDeadAfter(code, k, reg))
+        {
+            return false;
+        }
+        code[i] = X86Instr{code[j].op, memory, code[j].src, X86Operand::none()};
+        code[j].op = X86_DELETED;
+        code[k].op = X86_DELETED;
+        return true;
+    }
+
+    // mov r, imm / op x, r  ->  op x, imm, when r is a dead scratch register
+    static bool mergeImmediate(vector<X86Instr> &code, size_t i)
+    {
+        size_t j = next(code, i);
+        if (j >= code.size() || code[i].op != X86_MOV || !code[i].dest.isReg() ||
+            code[i].src.kind != X86_OPERAND_IMM)
+        {
+            return false;
+        }
+        Register reg = static_cast<Register>(code[i].dest.value);
+        X86Op op = code[j].op;
+        bool takesImmediate = op == X86_MOV || op == X86_CMP || isArithmetic(op);
+        if (!isScratch(reg) || !takesImmediate || !code[j].src.isReg(reg) || mentions(code[j].dest, reg) ||
+            !scratchDeadAfter(code, j, reg))
+        {
+            return false;
+        }
+        code[j].src = code[i].src;
+        code[i].op = X86_DELETED;
+        return true;
+    }
+
+    // lea r, [r + d]  ->  add r, d, when flags are dead, so that it can
+    // merge with the load and store around it
+    static bool leaToAdd(vector<X86Instr> &code, size_t i)
+    {
+        const X86Instr &instr = code[i];
+        if (instr.op != X86_LEA || instr.src.index != NO_REGISTER || !instr.dest.isReg(instr.src.base) ||
+            !flagsDeadAfter(code, i))
+        {
+            return false;
+        }
+        code[i] = X86Instr{X86_ADD, instr.dest, X86Operand::imm(instr.src.displacement), X86Operand::none()};
+        return true;
+    }
+
+    // mov r, 0  ->  xor r, r (2 bytes instead of 5), when flags are dead
+    static bool zeroWithXor(vector<X86Instr> &code, size_t i)
+    {
+        if (code[i].op != X86_MOV || !code[i].dest.isReg() || !code[i].src.isImm(0) || !flagsDeadAfter(code, i))
+        {
+            return false;
+        }
+        code[i] = X86Instr{X86_XOR, code[i].dest, code[i].dest, X86Operand::none()};
+        return true;
+    }
+
+    // cmp r, 0  ->  test r, r (same flags, one byte shorter)
+    static bool testForZero(vector<X86Instr> &code, size_t i)
+    {
+        if (code[i].op != X86_CMP || !code[i].dest.isReg() || !code[i].src.isImm(0))
+        {
+            return false;
+        }
+        code[i] = X86Instr{X86_TEST, code[i].dest, code[i].dest, X86Operand::none()};
+        return true;
+    }
+
+    // add x, 0 / sub x, 0 / imul r, 1, when flags are dead
+    static bool removeIdentity(vector<X86Instr> &code, size_t i)
+    {
+        X86Op op = code[i].op;
+        bool identity = ((op == X86_ADD || op == X86_SUB || op == X86_OR || op == X86_XOR) && code[i].src.isImm(0)) ||
+                        (op == X86_IMUL && code[i].src.isImm(1));
+        if (!identity || !flagsDeadAfter(code, i))
+        {
+            return false;
+        }
+        code[i].op = X86_DELETED;
+        return true;
+    }
+
+    // cmp/test whose flags nothing reads, once the jump after it is gone
+    static bool removeDeadCompare(vector<X86Instr> &code, size_t i)
+    {
+        if ((code[i].op != X86_CMP && code[i].op != X86_TEST) || !flagsDeadAfter(code, i))
+        {
+            return false;
+        }
+        code[i].op = X86_DELETED;
+        return true;
+    }
+
+    // mov into a scratch register nothing reads afterwards
+    static bool removeDeadMove(vector<X86Instr> &code, size_t i)
+    {
+        if ((code[i].op != X86_MOV && code[i].op != X86_MOVZX) || !code[i].dest.isReg() ||
+            !isScratch(static_cast<Register>(code[i].dest.value)) ||
+            !scratchDeadAfter(code, i, static_cast<Register>(code[i].dest.value)))
+        {
+            return false;
+        }
+        code[i].op = X86_DELETED;
+        return true;
+    }
+
+    // Whether label `target` is among the labels directly following i
+    static bool labelFollows(const vector<X86Instr> &code, size_t i, const X86Operand &target)
+    {
+        for (size_t j = next(code, i); j < code.size() && code[j].op == X86_LABEL; j = next(code, j))
+        {
+            if (code[j].dest == target)
+                return true;
+        }
+        return false;
+    }
+
+    // jmp L / L:  ->  L:
+    static bool removeJumpToNext(vector<X86Instr> &code, size_t i)
+    {
+        if ((code[i].op != X86_JMP && !isConditionalJump(code[i].op)) || !labelFollows(code, i, code[i].dest))
+        {
+            return false;
+        }
+        code[i].op = X86_DELETED;
+        return true;
+    }
+
+    // jcc L1 / jmp L2 / L1:  ->  jncc L2 / L1:
+    static bool invertBranchOverJump(vector<X86Instr> &code, size_t i)
+    {
+        size_t j = next(code, i);
+        if (j >= code.size() || !isConditionalJump(code[i].op) || code[j].op != X86_JMP ||
+            !labelFollows(code, j, code[i].dest))
+        {
+            return false;
+        }
+        code[i] = X86Instr{invertJump(code[i].op), code[j].dest, X86Operand::none(), X86Operand::none()};
+        code[j].op = X86_DELETED;
+        return true;
+    }
+
+public:
+    PeepholeOptimizer() : hits(RULE_COUNT, 0) {}
+
+    void run(vector<X86Instr> &code)
+    {
+        size_t i = 0;
+        while (i < code.size())
+        {
+            bool fired = false;
+            for (size_t r = 0; r < RULE_COUNT && code[i].op != X86_DELETED; r++)
+            {
+                if (RULES[r].apply(code, i))
+                {
+                    hits[r]++;
+                    fired = true;
+                }
+            }
+            if (fired)
+            {
+                // A rewrite can complete a pattern starting up to two
+                // instructions earlier
+                for (int back = 0; back < 2 && i > 0; back++)
+                {
+                    do
+                    {
+                        i--;
+                    } while (i > 0 && code[i].op == X86_DELETED);
+                }
+                continue;
+            }
+            i++;
+        }
+
+        size_t kept = 0;
+        for (const X86Instr &instr : code)
+        {
+            if (instr.op != X86_DELETED)
+                code[kept++] = instr;
+        }
+        code.resize(kept);
+    }
+
+    void printStats(ostream &out) const
+    {
+        out << "peephole:";
+        for (size_t r = 0; r < RULE_COUNT; r++)
+        {
+            out << ' ' << RULES[r].name << '=' << hits[r];
+        }
+        out << endl;
+    }
+};
+
+const PeepholeOptimizer::RuleEntry PeepholeOptimizer::RULES[] = {
+    {"self-move", &PeepholeOptimizer::removeSelfMove},
+    {"store-forward", &PeepholeOptimizer::forwardStore},
+    {"lea-add", &PeepholeOptimizer::leaToAdd},
+    {"read-modify-write", &PeepholeOptimizer::mergeReadModifyWrite},
+    {"merge-immediate", &PeepholeOptimizer::mergeImmediate},
+    {"identity", &PeepholeOptimizer::removeIdentity},
+    {"zero-xor", &PeepholeOptimizer::zeroWithXor},
+    {"test-zero", &PeepholeOptimizer::testForZero},
+    {"dead-compare", &PeepholeOptimizer::removeDeadCompare},
+    {"dead-move", &PeepholeOptimizer::removeDeadMove},
+    {"jump-to-next", &PeepholeOptimizer::removeJumpToNext},
+    {"branch-over-jump", &PeepholeOptimizer::invertBranchOverJump},
+};
+const size_t PeepholeOptimizer::RULE_COUNT = sizeof(RULES) / sizeof(RULES[0]);
+
+// Nonterminals of the instruction selection grammar: the forms a subtree's
+// value can be delivered in
+enum Nonterminal : uint8_t
+{
+    NT_OPERAND, // Leaf used as it stands: register, memory or immediate
+    NT_IMM,     // Constant leaf
+    NT_BASE,    // Any register; read, never written
+    NT_INDEX,   // Register times 1, 2, 4 or 8
+    NT_ADDRESS, // base + index*scale + displacement, computed by lea
+    NT_REG,     // Register the tree may overwrite
+    NT_COUNT,
+};
+
+// What a tile emits; the code generator reduces a labelled tree by it
+enum TileAction : uint8_t
+{
+    TILE_FREE, // Chain rule that emits nothing
+    TILE_MOV,
+    TILE_LEA,
+    TILE_ADD,
+    TILE_SUB,
+    TILE_IMUL,
+    TILE_IMUL_IMMEDIATE, // imul r, r/m, imm
+    TILE_SHL,
+    TILE_LEA_SHL, // x * (3, 5 or 9) << k
+    TILE_SCALE,
+    TILE_BASE_INDEX,
+    TILE_SCALE_PLUS_ONE, // [x + x*2], [x + x*4] or [x + x*8]
+    TILE_DISPLACEMENT,
+};
+
+// Condition on a tile's immediate (its NT_IMM child) or its other operand
+enum TileConstraint : uint8_t
+{
+    CONSTRAINT_NONE,
+    CONSTRAINT_SCALE_FACTOR,      // 2, 4 or 8
+    CONSTRAINT_SCALE_PLUS_ONE,    // 3, 5 or 9
+    CONSTRAINT_POWER_OF_TWO,      // 2^k, k >= 1
+    CONSTRAINT_SHIFTED_PLUS_ONE,  // (3, 5 or 9) * 2^k, k >= 1
+    CONSTRAINT_NOT_IMMEDIATE,     // The NT_OPERAND child is not a constant
+};
+
+// One pattern of the grammar. Rules with an operator match an ADD, SUB or
+// MUL node whose children can be delivered as `left` and `right`; chain
+// rules (op OP_COPY) turn a node already delivered as `left` into `result`.
+// Costs are in cycles, roughly: imul is 3, everything else 1.
+struct TileRule
+{
+    const char *name;
+    Nonterminal result;
+    TACOp op;
+    Nonterminal left;
+    Nonterminal right;
+    TileConstraint constraint;
+    TileAction action;
+    int32_t cost;
+};
+
+// Node of an expression tree rebuilt from TAC: an ADD, SUB or MUL, or a leaf
+// operand (op OP_COPY). Children come before their parents in the tree.
+struct SelectionNode
+{
+    TACOp op;
+    Operand leaf;
+    bool registerLeaf; // Leaf is a temporary held in a register
+    int32_t left;
+    int32_t right;
+    int32_t cost[NT_COUNT];
+    int8_t rule[NT_COUNT]; // Index into InstructionSelector::RULES, or LEAF_RULE
+};
+
+// BURS-style instruction selection (Fraser, Hanson and Proebsting). Labelling
+// visits a tree bottom-up and records, for every nonterminal, the cheapest
+// rule that delivers each node in it; the code generator then reduces the
+// root as NT_REG by following the recorded rules down. Tiles that span
+// several nodes are what make `a + b*4` a single lea.
+class InstructionSelector
+{
+public:
+    static constexpr int32_t NO_COST = INT32_MAX;
+    static constexpr int8_t LEAF_RULE = -1;
+    static constexpr int8_t NO_RULE = -2;
+    static const TileRule RULES[];
+    static const size_t RULE_COUNT;
+
+private:
+    static bool satisfies(const vector<SelectionNode> &tree, const SelectionNode &node, const TileRule &rule)
+    {
+        if (rule.constraint == CONSTRAINT_NONE)
+        {
+            return true;
+        }
+        if (rule.constraint == CONSTRAINT_NOT_IMMEDIATE)
+        {
+            const SelectionNode &operand = tree[rule.left == NT_OPERAND ? node.left : node.right];
+            return operand.leaf.kind != OPERAND_IMM;
+        }
+        int32_t value = tree[rule.left == NT_IMM ? node.left : node.right].leaf.value;
+        uint32_t magnitude = static_cast<uint32_t>(value);
+        int shift = value > 0 ? __builtin_ctz(magnitude) : 0;
+        uint32_t odd = magnitude >> shift;
+        switch (rule.constraint)
+        {
+        case CONSTRAINT_SCALE_FACTOR:
+            return value == 2 || value == 4 || value == 8;
+        case CONSTRAINT_SCALE_PLUS_ONE:
+            return value == 3 || value == 5 || value == 9;
+        case CONSTRAINT_POWER_OF_TWO:
+            return value > 1 && odd == 1;
+        case CONSTRAINT_SHIFTED_PLUS_ONE:
+            return value > 0 && shift > 0 && (odd == 3 || odd == 5 || odd == 9);
+        default:
+            return false;
+        }
+    }
+
+    static void record(SelectionNode &node, Nonterminal result, int64_t cost, size_t rule, bool &changed)
+    {
+        if (cost < node.cost[result])
+        {
+            node.cost[result] = static_cast<int32_t>(cost);
+            node.rule[result] = static_cast<int8_t>(rule);
+            changed = true;
+        }
+    }
+
+public:
+    // Labels every node; children must already be labelled, which holds
+    // when nodes are visited in order
+    static void label(vector<SelectionNode> &tree)
+    {
+        for (SelectionNode &node : tree)
+        {
+            fill(node.cost, node.cost + NT_COUNT, NO_COST);
+            fill(node.rule, node.rule + NT_COUNT, NO_RULE);
+            bool changed = false;
+            if (node.op == OP_COPY)
+            {
+                node.cost[NT_OPERAND] = 0;
+                node.rule[NT_OPERAND] = LEAF_RULE;
+                if (node.leaf.kind == OPERAND_IMM)
+                {
+                    node.cost[NT_IMM] = 0;
+                    node.rule[NT_IMM] = LEAF_RULE;
+                }
+                if (node.registerLeaf)
+                {
+                    node.cost[NT_BASE] = 0;
+                    node.rule[NT_BASE] = LEAF_RULE;
+                }
+            }
+            else
+            {
+                for (size_t r = 0; r < RULE_COUNT; r++)
+                {
+                    const TileRule &rule = RULES[r];
+                    if (rule.op != node.op)
+                        continue;
+                    int32_t left = tree[node.left].cost[rule.left];
+                    int32_t right = tree[node.right].cost[rule.right];
+                    if (left == NO_COST || right == NO_COST || !satisfies(tree, node, rule))
+                        continue;
+                    record(node, rule.result, static_cast<int64_t>(rule.cost) + left + right, r, changed);
+                }
+            }
+
+            // Chain rules, until none lowers a cost
+            do
+            {
+                changed = false;
+                for (size_t r = 0; r < RULE_COUNT; r++)
+                {
+                    const TileRule &rule = RULES[r];
+                    if (rule.op == OP_COPY && node.cost[rule.left] != NO_COST)
+                    {
+                        record(node, rule.result, static_cast<int64_t>(rule.cost) + node.cost[rule.left], r, changed);
+                    }
+                }
+            } while (changed);
+        }
+    }
+};
+
+// Ties go to the earlier rule, so cheaper-to-encode forms come first
+const TileRule InstructionSelector::RULES[] = {
+    {"mov", NT_REG, OP_COPY, NT_OPERAND, NT_COUNT, CONSTRAINT_NONE, TILE_MOV, 1},
+    {"lea", NT_REG, OP_COPY, NT_ADDRESS, NT_COUNT, CONSTRAINT_NONE, TILE_LEA, 1},
+    {"base", NT_BASE, OP_COPY, NT_REG, NT_COUNT, CONSTRAINT_NONE, TILE_FREE, 0},
+    {"index", NT_INDEX, OP_COPY, NT_BASE, NT_COUNT, CONSTRAINT_NONE, TILE_FREE, 0},
+    {"address-base", NT_ADDRESS, OP_COPY, NT_BASE, NT_COUNT, CONSTRAINT_NONE, TILE_FREE, 0},
+    {"address-index", NT_ADDRESS, OP_COPY, NT_INDEX, NT_COUNT, CONSTRAINT_NONE, TILE_FREE, 0},
+    {"add", NT_REG, OP_ADD, NT_REG, NT_OPERAND, CONSTRAINT_NONE, TILE_ADD, 1},
+    {"add", NT_REG, OP_ADD, NT_OPERAND, NT_REG, CONSTRAINT_NONE, TILE_ADD, 1},
+    {"add", NT_REG, OP_ADD, NT_REG, NT_REG, CONSTRAINT_NONE, TILE_ADD, 1},
+    {"sub", NT_REG, OP_SUB, NT_REG, NT_OPERAND, CONSTRAINT_NONE, TILE_SUB, 1},
+    {"sub", NT_REG, OP_SUB, NT_REG, NT_REG, CONSTRAINT_NONE, TILE_SUB, 1},
+    {"shl", NT_REG, OP_MUL, NT_REG, NT_IMM, CONSTRAINT_POWER_OF_TWO, TILE_SHL, 1},
+    {"lea-shl", NT_REG, OP_MUL, NT_REG, NT_IMM, CONSTRAINT_SHIFTED_PLUS_ONE, TILE_LEA_SHL, 2},
+    {"imul", NT_REG, OP_MUL, NT_OPERAND, NT_IMM, CONSTRAINT_NOT_IMMEDIATE, TILE_IMUL_IMMEDIATE, 3},
+    {"imul", NT_REG, OP_MUL, NT_IMM, NT_OPERAND, CONSTRAINT_NOT_IMMEDIATE, TILE_IMUL_IMMEDIATE, 3},
+    {"imul", NT_REG, OP_MUL, NT_REG, NT_OPERAND, CONSTRAINT_NONE, TILE_IMUL, 3},
+    {"imul", NT_REG, OP_MUL, NT_OPERAND, NT_REG, CONSTRAINT_NONE, TILE_IMUL, 3},
+    {"imul", NT_REG, OP_MUL, NT_REG, NT_REG, CONSTRAINT_NONE, TILE_IMUL, 3},
+    {"scale", NT_INDEX, OP_MUL, NT_BASE, NT_IMM, CONSTRAINT_SCALE_FACTOR, TILE_SCALE, 0},
+    {"scale", NT_INDEX, OP_MUL, NT_IMM, NT_BASE, CONSTRAINT_SCALE_FACTOR, TILE_SCALE, 0},
+    {"base-index", NT_ADDRESS, OP_ADD, NT_BASE, NT_INDEX, CONSTRAINT_NONE, TILE_BASE_INDEX, 0},
+    {"base-index", NT_ADDRESS, OP_ADD, NT_INDEX, NT_BASE, CONSTRAINT_NONE, TILE_BASE_INDEX, 0},
+    {"scale-plus-one", NT_ADDRESS, OP_MUL, NT_BASE, NT_IMM, CONSTRAINT_SCALE_PLUS_ONE, TILE_SCALE_PLUS_ONE, 0},
+    {"scale-plus-one", NT_ADDRESS, OP_MUL, NT_IMM, NT_BASE, CONSTRAINT_SCALE_PLUS_ONE, TILE_SCALE_PLUS_ONE, 0},
+    {"displacement", NT_ADDRESS, OP_ADD, NT_ADDRESS, NT_IMM, CONSTRAINT_NONE, TILE_DISPLACEMENT, 0},
+    {"displacement", NT_ADDRESS, OP_ADD, NT_IMM, NT_ADDRESS, CONSTRAINT_NONE, TILE_DISPLACEMENT, 0},
+    {"displacement", NT_ADDRESS, OP_SUB, NT_ADDRESS, NT_IMM, CONSTRAINT_NONE, TILE_DISPLACEMENT, 0},
+};
+const size_t InstructionSelector::RULE_COUNT = sizeof(RULES) / sizeof(RULES[0]);
+
+class CodeGenerator
+{
+private:
+    static constexpr size_t MAX_TREE_NODES = 32;
+
+    const StringInterner &names;
+    RegisterAllocator registers;
+    vector<X86Instr> program;
+    bool optimize;
+    VectorISA isa;
+    PeepholeOptimizer peephole;
+    size_t treeCount;
+    size_t foldedCount;
+    size_t leaCount;
+
+    X86Operand location(const Operand &operand) const
+    {
+        switch (operand.kind)
+        {
+        case OPERAND_IMM:
+            return X86Operand::imm(operand.value);
+        case OPERAND_TEMP:
+        {
+            Register reg = registers.registerOf(operand.value);
+            return reg != NO_REGISTER ? X86Operand::reg(reg) : X86Operand::slot(operand.value);
+        }
+        case OPERAND_VAR:
+            return X86Operand::var(operand.value);
+        case OPERAND_LABEL:
+            return X86Operand::label(operand.value);
+        case OPERAND_VTEMP:
+            return X86Operand::reg(vectorRegister(operand));
+        default:
+            return X86Operand::none();
+        }
+    }
+
+    // Vector temporary vN lives in xmmN or ymmN
+    Register vectorRegister(const Operand &vtemp) const
+    {
+        return static_cast<Register>((isa == VECTOR_AVX2 ? REG_YMM0 : REG_XMM0) + vtemp.value);
+    }
+
+    void emit(X86Op op, X86Operand dest = X86Operand::none(), X86Operand src = X86Operand::none(),
+              X86Operand src2 = X86Operand::none())
+    {
+        program.push_back(X86Instr{op, dest, src, src2});
+    }
+
+    void emit(X86Op op, Register dest, const Operand &src)
+    {
+        emit(op, X86Operand::reg(dest), location(src));
+    }
+
+    void emit(X86Op op, const Operand &dest, Register src)
+    {
+        emit(op, location(dest), X86Operand::reg(src));
+    }
+
+    // Source or destination operand: a register, [x], [t0], 5 or L0
+    void writeOperand(AsmBuffer &out, const X86Operand &operand) const
+    {
+        switch (operand.kind)
+        {
+        case X86_OPERAND_REG:
+            out << REGISTER_NAMES[operand.value];
+            break;
+        case X86_OPERAND_IMM:
+            out << operand.value;
+            break;
+        case X86_OPERAND_VAR:
+            out << '[' << names.text(static_cast<SymbolId>(operand.value)) << ']';
+            break;
+        case X86_OPERAND_SLOT:
+            out << "[t" << operand.value << ']';
+            break;
+        case X86_OPERAND_LABEL:
+            out << 'L' << operand.value;
+            break;
+        case X86_OPERAND_ADDRESS:
+        {
+            const char *separator = "";
+            out << '[';
+            if (operand.base != NO_REGISTER)
+            {
+                out << REGISTER_NAMES[operand.base];
+                separator = " + ";
+            }
+            if (operand.index != NO_REGISTER)
+            {
+                out << separator << REGISTER_NAMES[operand.index];
+                if (operand.scale != 1)
+                    out << '*' << static_cast<int32_t>(operand.scale);
+                separator = " + ";
+            }
+            if (operand.displacement < 0 && *separator != '\0' && operand.displacement != INT32_MIN)
+            {
+                out << " - " << -operand.displacement;
+            }
+            else if (operand.displacement != 0 || *separator == '\0')
+            {
+                out << separator << operand.displacement;
+            }
+            out << ']';
+            break;
+        }
+        case X86_OPERAND_ELEMENT:
+            out << '[' << names.text(static_cast<SymbolId>(operand.value));
+            if (operand.index != NO_REGISTER)
+            {
+                out << " + " << REGISTER_NAMES[operand.index] << '*' << static_cast<int32_t>(operand.scale);
+            }
+            if (operand.displacement != 0)
+            {
+                out << " + " << operand.displacement;
+            }
+            out << ']';
+            break;
+        case X86_OPERAND_NONE:
+            break;
+        }
+    }
+
+    // Memory operands get a size when no register operand implies one
+    void write(AsmBuffer &out, const X86Instr &instr) const
+    {
+        if (instr.op == X86_LABEL)
+        {
+            writeOperand(out, instr.dest);
+            out << ":\n";
+            return;
+        }
+        out << X86_MNEMONICS[instr.op];
+        if (instr.dest.kind != X86_OPERAND_NONE)
+        {
+            bool sized = (instr.dest.isMemory() || instr.src.isMemory()) && !instr.dest.isReg() && !instr.src.isReg();
+            out << (sized ? " dword " : " ");
+            writeOperand(out, instr.dest);
+        }
+        if (instr.src.kind != X86_OPERAND_NONE)
+        {
+            out << ", ";
+            writeOperand(out, instr.src);
+        }
+        if (instr.src2.kind != X86_OPERAND_NONE)
+        {
+            out << ", ";
+            writeOperand(out, instr.src2);
+        }
+        out << '\n';
+    }
+
+    bool inRegister(const Operand &operand) const
+    {
+        return operand.kind == OPERAND_TEMP && registers.registerOf(operand.value) != NO_REGISTER;
+    }
+
+    static X86Op arithmeticOp(TACOp op)
+    {
+        return op == OP_ADD ? X86_ADD : op == OP_SUB ? X86_SUB
+                                                     : X86_IMUL;
+    }
+
+    // Memory operand for array[index]. A constant index becomes a
+    // displacement; any other index is read through a register.
+    X86Operand element(const Operand &array, const Operand &index)
+    {
+        if (index.kind == OPERAND_IMM)
+        {
+            return X86Operand::element(array.value, NO_REGISTER, static_cast<int32_t>(static_cast<uint32_t>(index.value) * 4));
+        }
+        if (inRegister(index))
+        {
+            return X86Operand::element(array.value, registers.registerOf(index.value), 0);
+        }
+        emit(X86_MOV, REG_ECX, index);
+        return X86Operand::element(array.value, REG_ECX, 0);
+    }
+
+    void translateLoad(const TACInstruction &instr)
+    {
+        X86Operand source = element(instr.arg1, instr.arg2);
+        Register work = inRegister(instr.result) ? registers.registerOf(instr.result.value) : REG_EAX;
+        emit(X86_MOV, X86Operand::reg(work), source);
+        if (!inRegister(instr.result))
+        {
+            emit(X86_MOV, instr.result, work);
+        }
+    }
+
+    void translateStore(const TACInstruction &instr)
+    {
+        X86Operand target = element(instr.result, instr.arg1);
+        if (instr.arg2.kind == OPERAND_IMM || inRegister(instr.arg2))
+        {
+            emit(X86_MOV, target, location(instr.arg2));
+        }
+        else
+        {
+            emit(X86_MOV, REG_EAX, instr.arg2);
+            emit(X86_MOV, target, X86Operand::reg(REG_EAX));
+        }
+    }
+
+    // Instructions on vector temporaries: whole-register loads and stores of
+    // consecutive elements, broadcasts of a scalar to every lane, and lane-wise
+    // arithmetic. SSE arithmetic overwrites its first operand, so the result
+    // register is first made a copy of it.
+    void translateVector(const TACInstruction &instr)
+    {
+        bool avx = isa == VECTOR_AVX2;
+        switch (instr.op)
+        {
+        case OP_LOAD:
+            emit(avx ? X86_VMOVDQU : X86_MOVDQU, location(instr.result), element(instr.arg1, instr.arg2));
+            return;
+        case OP_STORE:
+            emit(avx ? X86_VMOVDQU : X86_MOVDQU, element(instr.result, instr.arg1), location(instr.arg2));
+            return;
+        case OP_COPY:
+        {
+            Register lanes = vectorRegister(instr.result);
+            Register low = static_cast<Register>(REG_XMM0 + instr.result.value);
+            Register scalar = inRegister(instr.arg1) ? registers.registerOf(instr.arg1.value) : REG_EAX;
+            if (scalar == REG_EAX)
+            {
+                emit(X86_MOV, REG_EAX, instr.arg1);
+            }
+            emit(avx ? X86_VMOVD : X86_MOVD, X86Operand::reg(low), X86Operand::reg(scalar));
+            if (avx)
+            {
+                emit(X86_VPBROADCASTD, X86Operand::reg(lanes), X86Operand::reg(low));
+            }
+            else
+            {
+                emit(X86_PSHUFD, X86Operand::reg(lanes), X86Operand::reg(lanes), X86Operand::imm(0));
+            }
+            return;
+        }
+        default:
+        {
+            X86Op op = instr.op == OP_ADD ? X86_PADDD : instr.op == OP_SUB ? X86_PSUBD
+                                                                             : X86_PMULLD;
+            if (avx)
+            {
+                op = static_cast<X86Op>(op - X86_PADDD + X86_VPADDD);
+                emit(op, location(instr.result), location(instr.arg1), location(instr.arg2));
+                return;
+            }
+            if (instr.result != instr.arg1)
+            {
+                emit(X86_MOVDQA, location(instr.result), location(instr.arg1));
+            }
+            emit(op, location(instr.result), location(instr.arg2));
+            return;
+        }
+        }
+    }
+
+    void translateCopy(const TACInstruction &instr)
+    {
+        const Operand &dest = instr.result;
+        const Operand &src = instr.arg1;
+        if (src.kind == OPERAND_NONE)
+        {
+            return; // String assignments have no value to move
+        }
+        if (inRegister(dest) || src.kind == OPERAND_IMM || inRegister(src))
+        {
+            emit(X86_MOV, location(dest), location(src));
+        }
+        else
+        {
+            emit(X86_MOV, REG_EAX, src);
+            emit(X86_MOV, dest, REG_EAX);
+        }
+    }
+
+    void translateArithmetic(const TACInstruction &instr)
+    {
+        // Compute in the result's register when it has one, else in eax
+        Register work = inRegister(instr.result) ? registers.registerOf(instr.result.value) : REG_EAX;
+        emit(X86_MOV, work, instr.arg1);
+        emit(arithmeticOp(instr.op), work, instr.arg2);
+        if (!inRegister(instr.result))
+        {
+            emit(X86_MOV, instr.result, work);
+        }
+    }
+
+    // While a tree is reduced: which scratch registers are free, and the
+    // register of the root's result, which the chain of instructions that
+    // build the root's value is computed in directly when it can be. A leaf
+    // in that register read after the chain first writes it clobbers the tree.
+    bool scratchFree[REG_EDX + 1];
+    bool scratchExhausted;
+    Register target;
+    bool targetWritten;
+    bool targetClobbered;
+
+    Register takeRegister(Register preferred)
+    {
+        if (preferred != NO_REGISTER && preferred == target)
+        {
+            targetWritten = true;
+            return target;
+        }
+        for (int r = REG_EAX; r <= REG_EDX; r++)
+        {
+            if (scratchFree[r])
+            {
+                scratchFree[r] = false;
+                return static_cast<Register>(r);
+            }
+        }
+        scratchExhausted = true;
+        return REG_EAX;
+    }
+
+    void releaseRegister(Register reg)
+    {
+        if (reg <= REG_EDX)
+        {
+            scratchFree[reg] = true;
+        }
+    }
+
+    X86Operand leafLocation(const Operand &leaf)
+    {
+        if (targetWritten && inRegister(leaf) && registers.registerOf(leaf.value) == target)
+        {
+            targetClobbered = true;
+        }
+        return location(leaf);
+    }
+
+    // The child of `node` that rule `rule` delivers as `nonterminal`
+    static int32_t child(const SelectionNode &node, const TileRule &rule, Nonterminal nonterminal)
+    {
+        return rule.left == nonterminal ? node.left : node.right;
+    }
+
+    Register reduceRegister(const vector<SelectionNode> &tree, int32_t node, Register preferred)
+    {
+        const SelectionNode &n = tree[node];
+        const TileRule &rule = InstructionSelector::RULES[n.rule[NT_REG]];
+        switch (rule.action)
+        {
+        case TILE_MOV:
+        {
+            X86Operand source = leafLocation(n.leaf);
+            Register reg = takeRegister(preferred);
+            emit(X86_MOV, X86Operand::reg(reg), source);
+            return reg;
+        }
+        case TILE_LEA:
+        {
+            X86Operand address = reduceAddress(tree, node);
+            releaseRegister(address.base);
+            releaseRegister(address.index);
+            Register reg = takeRegister(preferred);
+            emit(X86_LEA, X86Operand::reg(reg), address);
+            leaCount++;
+            return reg;
+        }
+        case TILE_IMUL_IMMEDIATE:
+        {
+            X86Operand source = leafLocation(tree[child(n, rule, NT_OPERAND)].leaf);
+            Register reg = takeRegister(preferred);
+            emit(X86_IMUL, X86Operand::reg(reg), source, X86Operand::imm(tree[child(n, rule, NT_IMM)].leaf.value));
+            return reg;
+        }
+        case TILE_SHL:
+        case TILE_LEA_SHL:
+        {
+            Register reg = reduceRegister(tree, n.left, preferred);
+            uint32_t factor = static_cast<uint32_t>(tree[n.right].leaf.value);
+            int shift = __builtin_ctz(factor);
+            if (factor >> shift != 1)
+            {
+                emit(X86_LEA, X86Operand::reg(reg),
+                     X86Operand::address(reg, reg, static_cast<uint8_t>((factor >> shift) - 1)));
+                leaCount++;
+            }
+            emit(X86_SHL, X86Operand::reg(reg), X86Operand::imm(shift));
+            return reg;
+        }
+        default:
+        {
+            // add, sub or imul: the NT_REG child is overwritten with the result
+            X86Op op = rule.action == TILE_ADD ? X86_ADD : rule.action == TILE_SUB ? X86_SUB
+                                                                                   : X86_IMUL;
+            int32_t accumulator = rule.left == NT_REG ? n.left : n.right;
+            int32_t other = accumulator == n.left ? n.right : n.left;
+            Register reg = reduceRegister(tree, accumulator, preferred);
+            if ((rule.left == NT_REG) == (rule.right == NT_REG))
+            {
+                Register source = reduceRegister(tree, other, NO_REGISTER);
+                emit(op, X86Operand::reg(reg), X86Operand::reg(source));
+                releaseRegister(source);
+            }
+            else
+            {
+                emit(op, X86Operand::reg(reg), leafLocation(tree[other].leaf));
+            }
+            return reg;
+        }
+        }
+    }
+
+    Register reduceBase(const vector<SelectionNode> &tree, int32_t node)
+    {
+        const SelectionNode &n = tree[node];
+        if (n.rule[NT_BASE] == InstructionSelector::LEAF_RULE)
+        {
+            return static_cast<Register>(leafLocation(n.leaf).value);
+        }
+        return reduceRegister(tree, node, NO_REGISTER);
+    }
+
+    void reduceIndex(const vector<SelectionNode> &tree, int32_t node, Register &index, uint8_t &scale)
+    {
+        const SelectionNode &n = tree[node];
+        const TileRule &rule = InstructionSelector::RULES[n.rule[NT_INDEX]];
+        if (rule.action == TILE_FREE)
+        {
+            index = reduceBase(tree, node);
+            scale = 1;
+            return;
+        }
+        index = reduceBase(tree, child(n, rule, NT_BASE));
+        scale = static_cast<uint8_t>(tree[child(n, rule, NT_IMM)].leaf.value);
+    }
+
+    X86Operand reduceAddress(const vector<SelectionNode> &tree, int32_t node)
+    {
+        const SelectionNode &n = tree[node];
+        const TileRule &rule = InstructionSelector::RULES[n.rule[NT_ADDRESS]];
+        Register index;
+        uint8_t scale;
+        switch (rule.action)
+        {
+        case TILE_BASE_INDEX:
+        {
+            Register base = reduceBase(tree, child(n, rule, NT_BASE));
+            reduceIndex(tree, child(n, rule, NT_INDEX), index, scale);
+            return X86Operand::address(base, index, scale);
+        }
+        case TILE_SCALE_PLUS_ONE:
+        {
+            Register base = reduceBase(tree, child(n, rule, NT_BASE));
+            scale = static_cast<uint8_t>(tree[child(n, rule, NT_IMM)].leaf.value - 1);
+            return X86Operand::address(base, base, scale);
+        }
+        case TILE_DISPLACEMENT:
+        {
+            X86Operand address = reduceAddress(tree, child(n, rule, NT_ADDRESS));
+            uint32_t offset = static_cast<uint32_t>(tree[child(n, rule, NT_IMM)].leaf.value);
+            address.displacement = static_cast<int32_t>(n.op == OP_SUB ? static_cast<uint32_t>(address.displacement) - offset
+                                                                       : static_cast<uint32_t>(address.displacement) + offset);
+            return address;
+        }
+        default:
+            if (rule.left == NT_BASE)
+            {
+                return X86Operand::address(reduceBase(tree, node), NO_REGISTER, 1);
+            }
+            reduceIndex(tree, node, index, scale);
+            return X86Operand::address(NO_REGISTER, index, scale);
+        }
+    }
+
+    // Index of the node for `operand` of instruction i, adding the tree of
+    // the instruction that computes it when that directly precedes the
+    // instructions already in the tree (from `start` on) and nothing else
+    // reads its result. Such operands are folded into the tree: computed at
+    // the root instead of being written to their temporary.
+    int32_t buildTree(const vector<TACInstruction> &code, const Operand &operand, size_t &start,
+                      const unordered_map<int32_t, size_t> &tempUses, const unordered_map<int32_t, size_t> &tempDefs,
+                      vector<SelectionNode> &tree)
+    {
+        if (operand.kind == OPERAND_TEMP && start > 0 && tree.size() < MAX_TREE_NODES && isTileable(code[start - 1]) &&
+            code[start - 1].result == operand && tempUses.at(operand.value) == 1 && tempDefs.at(operand.value) == 1)
+        {
+            start--;
+            return buildTree(code, start, start, tempUses, tempDefs, tree);
+        }
+        SelectionNode leaf = {};
+        leaf.op = OP_COPY;
+        leaf.leaf = operand;
+        leaf.registerLeaf = inRegister(operand);
+        leaf.left = leaf.right = -1;
+        tree.push_back(leaf);
+        return static_cast<int32_t>(tree.size() - 1);
+    }
+
+    int32_t buildTree(const vector<TACInstruction> &code, size_t root, size_t &start,
+                      const unordered_map<int32_t, size_t> &tempUses, const unordered_map<int32_t, size_t> &tempDefs,
+                      vector<SelectionNode> &tree)
+    {
+        // The right operand was computed last, so it is folded first
+        int32_t right = buildTree(code, code[root].arg2, start, tempUses, tempDefs, tree);
+        int32_t left = buildTree(code, code[root].arg1, start, tempUses, tempDefs, tree);
+        SelectionNode node = {};
+        node.op = code[root].op;
+        node.left = left;
+        node.right = right;
+        tree.push_back(node);
+        return static_cast<int32_t>(tree.size() - 1);
+    }
+
+    static bool isTileable(const TACInstruction &instr)
+    {
+        return (instr.op == OP_ADD || instr.op == OP_SUB || instr.op == OP_MUL) &&
+               (instr.result.kind == OPERAND_TEMP || instr.result.kind == OPERAND_VAR) &&
+               instr.arg1.kind != OPERAND_VTEMP && instr.arg2.kind != OPERAND_VTEMP;
+    }
+
+    // Selects instructions for the tree rooted at `root` and stores its value
+    // in root's result. False, with nothing emitted, if it needs more
+    // registers than there are.
+    bool translateTree(const TACInstruction &root, vector<SelectionNode> &tree)
+    {
+        InstructionSelector::label(tree);
+        size_t mark = program.size();
+        size_t leaMark = leaCount;
+        Register resultRegister = inRegister(root.result) ? registers.registerOf(root.result.value) : NO_REGISTER;
+
+        // Computing in the result's register saves a move unless a leaf in
+        // it is needed after that; then go again through scratch registers
+        for (Register preferred : {resultRegister, NO_REGISTER})
+        {
+            fill(scratchFree, scratchFree + REG_EDX + 1, true);
+            scratchExhausted = false;
+            target = preferred;
+            targetWritten = false;
+            targetClobbered = false;
+            Register reg = reduceRegister(tree, static_cast<int32_t>(tree.size() - 1), preferred);
+            if (scratchExhausted || targetClobbered)
+            {
+                program.resize(mark);
+                leaCount = leaMark;
+                if (scratchExhausted)
+                    return false;
+                continue;
+            }
+            if (reg != resultRegister)
+            {
+                emit(X86_MOV, root.result, reg);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Multiplier and shift that turn signed division by d (|d| >= 2, not a
+    // power of two) into a multiply: Hacker's Delight, figure 10-1
+    static void divisionMagic(int32_t d, int32_t &multiplier, int &shift)
+    {
+        const uint32_t two31 = 0x80000000u;
+        uint32_t ad = d < 0 ? 0u - static_cast<uint32_t>(d) : static_cast<uint32_t>(d);
+        uint32_t t = two31 + (static_cast<uint32_t>(d) >> 31);
+        uint32_t anc = t - 1 - t % ad;
+        int p = 31;
+        uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+        uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+        uint32_t delta;
+        do
+        {
+            p++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= anc)
+            {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= ad)
+            {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        multiplier = static_cast<int32_t>(q2 + 1);
+        if (d < 0)
+        {
+            multiplier = static_cast<int32_t>(0u - static_cast<uint32_t>(multiplier));
+        }
+        shift = p - 32;
+    }
+
+    // x / d without idiv. Powers of two round toward zero by adding d - 1 to
+    // negative dividends before an arithmetic shift; other divisors multiply
+    // by a magic number and take the high half. False for d in {0, INT32_MIN}.
+    bool translateDivisionByConstant(const TACInstruction &instr, int32_t d)
+    {
+        if (d == 0 || d == INT32_MIN)
+        {
+            return false;
+        }
+        const Operand &x = instr.arg1;
+        uint32_t magnitude = static_cast<uint32_t>(d < 0 ? -d : d);
+        if ((magnitude & (magnitude - 1)) == 0)
+        {
+            int shift = __builtin_ctz(magnitude);
+            emit(X86_MOV, REG_EAX, x);
+            if (shift != 0)
+            {
+                emit(X86_CDQ);
+                emit(X86_AND, X86Operand::reg(REG_EDX), X86Operand::imm(static_cast<int32_t>(magnitude - 1)));
+                emit(X86_ADD, X86Operand::reg(REG_EAX), X86Operand::reg(REG_EDX));
+                emit(X86_SAR, X86Operand::reg(REG_EAX), X86Operand::imm(shift));
+            }
+            if (d < 0)
+            {
+                emit(X86_NEG, X86Operand::reg(REG_EAX));
+            }
+            emit(X86_MOV, instr.result, REG_EAX);
+            return true;
+        }
+
+        int32_t multiplier;
+        int shift;
+        divisionMagic(d, multiplier, shift);
+        X86Operand dividend = location(x);
+        if (x.kind == OPERAND_IMM)
+        {
+            emit(X86_MOV, REG_ECX, x);
+            dividend = X86Operand::reg(REG_ECX);
+        }
+        emit(X86_MOV, X86Operand::reg(REG_EAX), X86Operand::imm(multiplier));
+        emit(X86_IMUL_WIDE, dividend);
+        if (d > 0 && multiplier < 0)
+        {
+            emit(X86_ADD, X86Operand::reg(REG_EDX), dividend);
+        }
+        else if (d < 0 && multiplier > 0)
+        {
+            emit(X86_SUB, X86Operand::reg(REG_EDX), dividend);
+        }
+        if (shift != 0)
+        {
+            emit(X86_SAR, X86Operand::reg(REG_EDX), X86Operand::imm(shift));
+        }
+        // Add one to negative quotients to round toward zero
+        emit(X86_MOV, X86Operand::reg(REG_EAX), X86Operand::reg(REG_EDX));
+        emit(X86_SHR, X86Operand::reg(REG_EAX), X86Operand::imm(31));
+        emit(X86_ADD, X86Operand::reg(REG_EDX), X86Operand::reg(REG_EAX));
+        emit(X86_MOV, instr.result, REG_EDX);
+        return true;
+    }
+
+    void translateDivision(const TACInstruction &instr)
+    {
+        if (optimize && instr.arg2.kind == OPERAND_IMM && translateDivisionByConstant(instr, instr.arg2.value))
+        {
+            return;
+        }
+        emit(X86_MOV, REG_EAX, instr.arg1);
+        emit(X86_CDQ); // Sign-extend eax into edx for the signed divide
+        if (instr.arg2.kind == OPERAND_IMM)
+        {
+            emit(X86_MOV, REG_ECX, instr.arg2);
+            emit(X86_IDIV, X86Operand::reg(REG_ECX));
+        }
+        else
+        {
+            emit(X86_IDIV, location(instr.arg2));
+        }
+        emit(X86_MOV, instr.result, REG_EAX);
+    }
+
+    static X86Op setccOp(TACOp op)
+    {
+        switch (op)
+        {
+        case OP_GT:
+            return X86_SETG;
+        case OP_LT:
+            return X86_SETL;
+        case OP_EQ:
+            return X86_SETE;
+        default:
+            return X86_SETNE;
+        }
+    }
+
+    // Leaves the 0/1 value in al in the result, via movzx
+    void storeFlag(const Operand &result)
+    {
+        if (inRegister(result))
+        {
+            emit(X86_MOVZX, X86Operand::reg(registers.registerOf(result.value)), X86Operand::reg(REG_AL));
+        }
+        else
+        {
+            emit(X86_MOVZX, X86Operand::reg(REG_EAX), X86Operand::reg(REG_AL));
+            emit(X86_MOV, result, REG_EAX);
+        }
+    }
+
+    // Conditional jump taken when `op` holds, or when it does not
+    static X86Op jccOp(TACOp op, bool whenTrue)
+    {
+        X86Op taken;
+        switch (op)
+        {
+        case OP_GT:
+            taken = X86_JG;
+            break;
+        case OP_LT:
+            taken = X86_JL;
+            break;
+        case OP_EQ:
+            taken = X86_JE;
+            break;
+        default:
+            taken = X86_JNE;
+            break;
+        }
+        return whenTrue ? taken : invertJump(taken);
+    }
+
+    // Emits cmp for a comparison, reading memory and immediates in place
+    // where x86 allows it. Returns the comparison the flags now answer, which
+    // is mirrored when the operands had to be swapped.
+    TACOp emitCompare(const TACInstruction &instr)
+    {
+        Operand lhs = instr.arg1;
+        Operand rhs = instr.arg2;
+        TACOp op = instr.op;
+        if (lhs.kind == OPERAND_IMM && rhs.kind != OPERAND_IMM)
+        {
+            swap(lhs, rhs);
+            op = op == OP_GT ? OP_LT : op == OP_LT ? OP_GT
+                                                   : op;
+        }
+        bool lhsInMemory = lhs.kind != OPERAND_IMM && !inRegister(lhs);
+        if (lhsInMemory && rhs.kind != OPERAND_IMM && !inRegister(rhs))
+        {
+            emit(X86_MOV, REG_EAX, lhs);
+            emit(X86_CMP, REG_EAX, rhs);
+        }
+        else if (lhs.kind == OPERAND_IMM)
+        {
+            emit(X86_MOV, REG_EAX, lhs);
+            emit(X86_CMP, REG_EAX, rhs);
+        }
+        else
+        {
+            emit(X86_CMP, location(lhs), location(rhs));
+        }
+        return op;
+    }
+
+    void translateComparison(const TACInstruction &instr)
+    {
+        emit(setccOp(emitCompare(instr)), X86Operand::reg(REG_AL));
+        storeFlag(instr.result);
+    }
+
+    // A comparison whose only use is the conditional jump right after it
+    // becomes cmp + jcc; the 0/1 value is never materialized
+    void translateCompareAndBranch(const TACInstruction &compare, const TACInstruction &jump)
+    {
+        TACOp op = emitCompare(compare);
+        emit(jccOp(op, jump.op == OP_JUMP_IF_TRUE), location(jump.result));
+    }
+
+    void translateLogical(const TACInstruction &instr)
+    {
+        emit(X86_MOV, REG_EAX, instr.arg1);
+        emit(X86_CMP, X86Operand::reg(REG_EAX), X86Operand::imm(0));
+        emit(X86_SETNE, X86Operand::reg(REG_AL));
+        emit(X86_MOV, REG_ECX, instr.arg2);
+        emit(X86_CMP, X86Operand::reg(REG_ECX), X86Operand::imm(0));
+        emit(X86_SETNE, X86Operand::reg(REG_CL));
+        emit(instr.op == OP_AND ? X86_AND : X86_OR, X86Operand::reg(REG_AL), X86Operand::reg(REG_CL));
+        storeFlag(instr.result);
+    }
+
+    void translateConditionalJump(const TACInstruction &instr)
+    {
+        const Operand &condition = instr.arg1;
+        bool jumpIfTrue = instr.op == OP_JUMP_IF_TRUE;
+        if (condition.kind == OPERAND_IMM)
+        {
+            if ((condition.value != 0) == jumpIfTrue)
+            {
+                emit(X86_JMP, location(instr.result));
+            }
+            return;
+        }
+        emit(X86_CMP, location(condition), X86Operand::imm(0));
+        emit(jumpIfTrue ? X86_JNE : X86_JE, location(instr.result));
+    }
+
+public:
+    // With `optimize`, the peephole optimizer rewrites each translated block
+    // before it is written out
+    CodeGenerator(const StringInterner &names, bool optimize, VectorISA isa = VECTOR_SSE)
+        : names(names), optimize(optimize), isa(isa), treeCount(0), foldedCount(0), leaCount(0),
+          scratchExhausted(false), target(NO_REGISTER), targetWritten(false), targetClobbered(false) {}
+
+    void generateAssembly(const vector<TACInstruction> &intermediateCode, ostream &out)
+    {
+        AsmBuffer assemblyCode;
+        translate(intermediateCode, assemblyCode);
+
+        // Output the assembly code
+        string_view text = assemblyCode.text();
+        out.write(text.data(), text.size());
+    }
+
+    // Appends the assembly for intermediateCode to out. Temporaries are first
+    // assigned registers over the whole block, then each instruction is
+    // lowered in one pass, dispatching on opcode and operand kinds, into a
+    // list of X86Instr that is peephole-optimized and then written as text.
+    // With `optimize`, runs of add, sub and mul whose temporaries feed only
+    // the next of them are first regrouped into expression trees, and each
+    // tree is lowered as a whole by the instruction selector.
+    void translate(const vector<TACInstruction> &intermediateCode, AsmBuffer &out)
+    {
+        registers.allocate(intermediateCode);
+        unordered_map<int32_t, size_t> tempUses;
+        unordered_map<int32_t, size_t> tempDefs;
+        for (const TACInstruction &instr : intermediateCode)
+        {
+            if (instr.arg1.kind == OPERAND_TEMP)
+                tempUses[instr.arg1.value]++;
+            if (instr.arg2.kind == OPERAND_TEMP)
+                tempUses[instr.arg2.value]++;
+            if (instr.result.kind == OPERAND_TEMP)
+                tempDefs[instr.result.value]++;
+        }
+
+        // Tree roots and the first instruction of each tree, found from
+        // the end so every root takes all it can
+        const size_t NOT_ROOT = SIZE_MAX;
+        vector<size_t> treeStart(intermediateCode.size(), NOT_ROOT);
+        vector<bool> folded(intermediateCode.size(), false);
+        vector<SelectionNode> tree;
+        for (size_t i = intermediateCode.size(); optimize && i-- > 0;)
+        {
+            if (isTileable(intermediateCode[i]))
+            {
+                size_t start = i;
+                tree.clear();
+                buildTree(intermediateCode, i, start, tempUses, tempDefs, tree);
+                treeStart[i] = start;
+                fill(folded.begin() + start, folded.begin() + i, true);
+                i = start;
+            }
+        }
+
+        program.clear();
+        for (size_t i = 0; i < intermediateCode.size(); i++)
+        {
+            const TACInstruction &instr = intermediateCode[i];
+            if (treeStart[i] != NOT_ROOT)
+            {
+                size_t start = i;
+                tree.clear();
+                buildTree(intermediateCode, i, start, tempUses, tempDefs, tree);
+                if (translateTree(instr, tree))
+                {
+                    treeCount++;
+                    foldedCount += i - start;
+                    continue;
+                }
+                for (size_t j = start; j < i; j++)
+                {
+                    translateArithmetic(intermediateCode[j]);
+                }
+            }
+            if (folded[i])
+            {
+                continue; // Lowered with the tree it belongs to
+            }
+            if (isComparison(instr.op) && i + 1 < intermediateCode.size())
+            {
+                const TACInstruction &next = intermediateCode[i + 1];
+                if ((next.op == OP_JUMP_IF_FALSE || next.op == OP_JUMP_IF_TRUE) && next.arg1 == instr.result &&
+                    instr.result.kind == OPERAND_TEMP && tempUses[instr.result.value] == 1)
+                {
+                    translateCompareAndBranch(instr, next);
+                    i++;
+                    continue;
+                }
+            }
+            if (instr.result.kind == OPERAND_VTEMP || instr.arg2.kind == OPERAND_VTEMP)
+            {
+                translateVector(instr);
+                continue;
+            }
+            switch (instr.op)
+            {
+            case OP_COPY:
+                translateCopy(instr);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+                translateArithmetic(instr);
+                break;
+            case OP_DIV:
+                translateDivision(instr);
+                break;
+            case OP_GT:
+            case OP_LT:
+            case OP_EQ:
+            case OP_NEQ:
+                translateComparison(instr);
+                break;
+            case OP_AND:
+            case OP_OR:
+                translateLogical(instr);
+                break;
+            case OP_LABEL:
+                emit(X86_LABEL, location(instr.result));
+                break;
+            case OP_JUMP:
+                emit(X86_JMP, location(instr.result));
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                translateConditionalJump(instr);
+                break;
+            case OP_LOAD:
+                translateLoad(instr);
+                break;
+            case OP_STORE:
+                translateStore(instr);
+                break;
+            }
+        }
+
+        if (optimize)
+        {
+            peephole.run(program);
+        }
+        for (const X86Instr &instr : program)
+        {
+            write(out, instr);
+        }
+    }
+
+    void printStats(ostream &out) const
+    {
+        if (optimize)
+        {
+            out << "instruction selection: " << treeCount << " expression trees, " << foldedCount
+                << " TAC instructions folded into them, " << leaCount << " lea" << endl;
+            peephole.printStats(out);
+        }
+    }
+
+    // The x86 translate() last produced, after peephole optimization
+    const vector<X86Instr> &instructions() const
+    {
+        return program;
+    }
+};
+
+// Runs generated x86 for --bench-vectorize, counting the instructions it
+// executes. The compiler has no assembler, so comparing scalar and vector
+// output this way, by instruction count rather than time, is what can be
+// done in-process; it also checks that both leave memory the same.
+// Flags are modelled only as far as the code generator uses them: a
+// cmp or test followed by jcc or setcc.
+class X86Simulator
+{
+private:
+    const vector<X86Instr> &code;
+    const SymbolTable &symbols;
+    uint32_t gpr[REG_EBP + 1];
+    int32_t lanes[16][8];
+    map<int32_t, vector<int32_t>> memory; // Variables and arrays, by SymbolId
+    unordered_map<int32_t, int32_t> slots;
+    int64_t flagLeft, flagRight;
+    bool flagsValid;
+    bool failed;
+
+    static int width(Register reg)
+    {
+        return reg >= REG_YMM0 ? 8 : 4;
+    }
+
+    static int32_t *vectorLanes(int32_t (&lanes)[16][8], Register reg)
+    {
+        return lanes[(reg - REG_XMM0) % 16];
+    }
+
+    // Storage of element `element` of a variable or array, or null past its end
+    int32_t *cell(int32_t id, int64_t element, int count)
+    {
+        vector<int32_t> &storage = memory[id];
+        if (storage.empty())
+        {
+            storage.assign(symbols.storageSize(static_cast<SymbolId>(id)), 0);
+        }
+        if (element < 0 || element + count > static_cast<int64_t>(storage.size()))
+        {
+            failed = true;
+            return nullptr;
+        }
+        return &storage[element];
+    }
+
+    int32_t *memoryCell(const X86Operand &operand, int count)
+    {
+        switch (operand.kind)
+        {
+        case X86_OPERAND_VAR:
+            return cell(operand.value, 0, count);
+        case X86_OPERAND_SLOT:
+            return &slots[operand.value];
+        case X86_OPERAND_ELEMENT:
+        {
+            int64_t element = operand.displacement / 4;
+            if (operand.index != NO_REGISTER)
+                element += static_cast<int32_t>(gpr[operand.index]);
+            return cell(operand.value, element, count);
+        }
+        default:
+            failed = true;
+            return nullptr;
+        }
+    }
+
+    int32_t read(const X86Operand &operand)
+    {
+        // Operands that are not values; lea computes its address itself
+        if (operand.kind == X86_OPERAND_NONE || operand.kind == X86_OPERAND_LABEL ||
+            operand.kind == X86_OPERAND_ADDRESS)
+        {
+            return 0;
+        }
+        if (operand.kind == X86_OPERAND_IMM)
+        {
+            return operand.value;
+        }
+        if (operand.kind == X86_OPERAND_REG)
+        {
+            Register reg = static_cast<Register>(operand.value);
+            uint32_t value = gpr[fullRegister(reg)];
+            return static_cast<int32_t>(reg != fullRegister(reg) ? value & 0xff : value);
+        }
+        int32_t *memory = memoryCell(operand, 1);
+        return memory != nullptr ? *memory : 0;
+    }
+
+    void write(const X86Operand &operand, int32_t value)
+    {
+        if (operand.kind == X86_OPERAND_REG)
+        {
+            Register reg = static_cast<Register>(operand.value);
+            Register full = fullRegister(reg);
+            gpr[full] = reg != full ? (gpr[full] & ~0xffu) | (static_cast<uint32_t>(value) & 0xff) : static_cast<uint32_t>(value);
+            return;
+        }
+        int32_t *memory = memoryCell(operand, 1);
+        if (memory != nullptr)
+            *memory = value;
+    }
+
+    bool condition(X86Op op)
+    {
+        if (!flagsValid)
+        {
+            failed = true;
+        }
+        switch (op)
+        {
+        case X86_JG:
+        case X86_SETG:
+            return flagLeft > flagRight;
+        case X86_JLE:
+            return flagLeft <= flagRight;
+        case X86_JL:
+        case X86_SETL:
+            return flagLeft < flagRight;
+        case X86_JGE:
+            return flagLeft >= flagRight;
+        case X86_JE:
+        case X86_SETE:
+            return flagLeft == flagRight;
+        default:
+            return flagLeft != flagRight;
+        }
+    }
+
+    // One vector instruction; true if it was one
+    bool executeVector(const X86Instr &instr)
+    {
+        Register dest = instr.dest.isReg() ? static_cast<Register>(instr.dest.value) : NO_REGISTER;
+        Register src = instr.src.isReg() ? static_cast<Register>(instr.src.value) : NO_REGISTER;
+        switch (instr.op)
+        {
+        case X86_MOVD:
+        case X86_VMOVD:
+        {
+            int32_t *to = vectorLanes(lanes, dest);
+            fill(to, to + (instr.op == X86_VMOVD ? 8 : 4), 0);
+            to[0] = read(instr.src);
+            return true;
+        }
+        case X86_PSHUFD:
+        {
+            int32_t from[4];
+            copy(vectorLanes(lanes, src), vectorLanes(lanes, src) + 4, from);
+            for (int lane = 0; lane < 4; lane++)
+                vectorLanes(lanes, dest)[lane] = from[(instr.src2.value >> (2 * lane)) & 3];
+            return true;
+        }
+        case X86_VPBROADCASTD:
+            fill(vectorLanes(lanes, dest), vectorLanes(lanes, dest) + 8, vectorLanes(lanes, src)[0]);
+            return true;
+        case X86_MOVDQU:
+        case X86_MOVDQA:
+        case X86_VMOVDQU:
+        {
+            int count = width(dest != NO_REGISTER ? dest : src);
+            int32_t *from = src != NO_REGISTER ? vectorLanes(lanes, src) : memoryCell(instr.src, count);
+            int32_t *to = dest != NO_REGISTER ? vectorLanes(lanes, dest) : memoryCell(instr.dest, count);
+            if (from != nullptr && to != nullptr)
+                copy(from, from + count, to);
+            return true;
+        }
+        case X86_PADDD:
+        case X86_PSUBD:
+        case X86_PMULLD:
+        case X86_VPADDD:
+        case X86_VPSUBD:
+        case X86_VPMULLD:
+        {
+            bool avx = instr.op >= X86_VPADDD;
+            X86Op op = avx ? static_cast<X86Op>(instr.op - X86_VPADDD + X86_PADDD) : instr.op;
+            const int32_t *left = vectorLanes(lanes, avx ? src : dest);
+            const int32_t *right = vectorLanes(lanes, avx ? static_cast<Register>(instr.src2.value) : src);
+            int32_t result[8];
+            for (int lane = 0; lane < width(dest); lane++)
+            {
+                uint32_t a = static_cast<uint32_t>(left[lane]), b = static_cast<uint32_t>(right[lane]);
+                result[lane] = static_cast<int32_t>(op == X86_PADDD ? a + b : op == X86_PSUBD ? a - b
+                                                                                              : a * b);
+            }
+            copy(result, result + width(dest), vectorLanes(lanes, dest));
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+public:
+    X86Simulator(const vector<X86Instr> &code, const SymbolTable &symbols)
+        : code(code), symbols(symbols), flagLeft(0), flagRight(0), flagsValid(false), failed(false)
+    {
+        fill(gpr, gpr + REG_EBP + 1, 0);
+        for (auto &vector : lanes)
+            fill(vector, vector + 8, 0);
+    }
+
+    // Executes the program; false if it faulted or ran past `limit`
+    // instructions. `executed` counts instructions other than labels, and
+    // `vectorExecuted` the vector ones among them.
+    bool run(uint64_t limit, uint64_t &executed, uint64_t &vectorExecuted)
+    {
+        unordered_map<int32_t, size_t> labelAt;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            if (code[i].op == X86_LABEL)
+                labelAt[code[i].dest.value] = i;
+        }
+        executed = 0;
+        vectorExecuted = 0;
+        for (size_t pc = 0; pc < code.size() && !failed; pc++)
+        {
+            const X86Instr &instr = code[pc];
+            if (instr.op == X86_LABEL || instr.op == X86_DELETED)
+            {
+                continue;
+            }
+            if (++executed > limit)
+            {
+                return false;
+            }
+            if (executeVector(instr))
+            {
+                vectorExecuted++;
+                continue;
+            }
+            uint32_t a = static_cast<uint32_t>(read(instr.dest));
+            uint32_t b = static_cast<uint32_t>(read(instr.src));
+            switch (instr.op)
+            {
+            case X86_MOV:
+            case X86_MOVZX:
+                write(instr.dest, static_cast<int32_t>(b));
+                break;
+            case X86_LEA:
+            {
+                const X86Operand &address = instr.src;
+                uint32_t base = address.base != NO_REGISTER ? gpr[address.base] : 0;
+                uint32_t index = address.index != NO_REGISTER ? gpr[address.index] : 0;
+                write(instr.dest, static_cast<int32_t>(base + index * address.scale + static_cast<uint32_t>(address.displacement)));
+                break;
+            }
+            case X86_ADD:
+                write(instr.dest, static_cast<int32_t>(a + b));
+                flagsValid = false;
+                break;
+            case X86_SUB:
+                write(instr.dest, static_cast<int32_t>(a - b));
+                flagsValid = false;
+                break;
+            case X86_IMUL:
+                if (instr.src2.kind != X86_OPERAND_NONE)
+                    a = static_cast<uint32_t>(read(instr.src2)); // imul r, r/m, imm
+                write(instr.dest, static_cast<int32_t>(a * b));
+                flagsValid = false;
+                break;
+            case X86_AND:
+                write(instr.dest, static_cast<int32_t>(a & b));
+                flagsValid = false;
+                break;
+            case X86_OR:
+                write(instr.dest, static_cast<int32_t>(a | b));
+                flagsValid = false;
+                break;
+            case X86_XOR:
+                write(instr.dest, static_cast<int32_t>(a ^ b));
+                flagsValid = false;
+                break;
+            case X86_SHL:
+                write(instr.dest, static_cast<int32_t>(a << (b & 31)));
+                flagsValid = false;
+                break;
+            case X86_SAR:
+                write(instr.dest, static_cast<int32_t>(a) >> (b & 31));
+                flagsValid = false;
+                break;
+            case X86_SHR:
+                write(instr.dest, static_cast<int32_t>(a >> (b & 31)));
+                flagsValid = false;
+                break;
+            case X86_NEG:
+                write(instr.dest, static_cast<int32_t>(0u - a));
+                flagsValid = false;
+                break;
+            case X86_CDQ:
+                gpr[REG_EDX] = static_cast<int32_t>(gpr[REG_EAX]) < 0 ? 0xffffffffu : 0;
+                break;
+            case X86_IMUL_WIDE:
+            {
+                int64_t product = static_cast<int64_t>(static_cast<int32_t>(gpr[REG_EAX])) * static_cast<int32_t>(a);
+                gpr[REG_EAX] = static_cast<uint32_t>(product);
+                gpr[REG_EDX] = static_cast<uint32_t>(static_cast<uint64_t>(product) >> 32);
+                flagsValid = false;
+                break;
+            }
+            case X86_IDIV:
+            {
+                int64_t dividend = static_cast<int64_t>((static_cast<uint64_t>(gpr[REG_EDX]) << 32) | gpr[REG_EAX]);
+                int64_t divisor = static_cast<int32_t>(a);
+                if (divisor == 0 || dividend / divisor > INT32_MAX || dividend / divisor < INT32_MIN)
+                {
+                    return false;
+                }
+                gpr[REG_EAX] = static_cast<uint32_t>(dividend / divisor);
+                gpr[REG_EDX] = static_cast<uint32_t>(dividend % divisor);
+                flagsValid = false;
+                break;
+            }
+            case X86_CMP:
+                flagLeft = static_cast<int32_t>(a);
+                flagRight = static_cast<int32_t>(b);
+                flagsValid = true;
+                break;
+            case X86_TEST:
+                flagLeft = static_cast<int32_t>(a & b);
+                flagRight = 0;
+                flagsValid = true;
+                break;
+            case X86_SETG:
+            case X86_SETL:
+            case X86_SETE:
+            case X86_SETNE:
+                write(instr.dest, condition(instr.op) ? 1 : 0);
+                break;
+            case X86_JMP:
+                pc = labelAt.at(instr.dest.value);
+                break;
+            default:
+                if (isConditionalJump(instr.op) && condition(instr.op))
+                    pc = labelAt.at(instr.dest.value);
+                break;
+            }
+        }
+        return !failed;
+    }
+
+    // Final contents of every variable and array the program touched
+    const map<int32_t, vector<int32_t>> &finalMemory() const
+    {
+        return memory;
+    }
+};
+
+// Bounded lock-free queue between exactly one producer thread and one
+// consumer thread. push/pop spin (yielding) while the queue is full/empty,
+// until either end closes the queue because it is giving up.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+private:
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    T slots[Capacity];
+    alignas(64) atomic<size_t> head; // Next slot to pop, written by the consumer
+    alignas(64) atomic<size_t> tail; // Next slot to push, written by the producer
+    atomic<bool> closed;
+
+public:
+    SpscQueue() : head(0), tail(0), closed(false) {}
+
+    bool tryPush(T &value)
+    {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+        slots[t % Capacity] = move(value);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &value)
+    {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire))
+        {
+            return false;
+        }
+        value = move(slots[h % Capacity]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // False, with the value dropped, if the queue is closed
+    bool push(T value)
+    {
+        while (!tryPush(value))
+        {
+            if (closed)
+            {
+                return false;
+            }
+            this_thread::yield();
+        }
+        return true;
+    }
+
+    // False once the queue is closed and empty
+    bool pop(T &value)
+    {
+        while (!tryPop(value))
+        {
+            if (closed)
+            {
+                return tryPop(value);
+            }
+            this_thread::yield();
+        }
+        return true;
+    }
+
+    void close()
+    {
+        closed = true;
+    }
+};
+
+const size_t TOKEN_BATCH_SIZE = 4096;
+const size_t TAC_BATCH_SIZE = 1024;
+
+struct TACBatch
+{
+    vector<TACInstruction> instructions;
+    bool last;
+};
+
+typedef SpscQueue<vector<Token>, 64> TokenQueue;
+typedef SpscQueue<TACBatch, 64> TACQueue;
+
+// Feeds the parser from token batches produced on another thread
+class QueueTokenSource : public TokenSource
+{
+private:
+    TokenQueue &queue;
+    vector<Token> batch;
+    size_t pos;
+
+public:
+    explicit QueueTokenSource(TokenQueue &queue) : queue(queue), pos(0) {}
+
+    size_t fill(Token *out, size_t capacity) override
+    {
+        if (pos == batch.size())
+        {
+            if (!batch.empty() && batch.back().type == T_EOF)
+            {
+                out[0] = batch.back();
+                return 1;
+            }
+            if (!queue.pop(batch))
+            {
+                // The lexer gave up; the compile fails with its exception
+                batch.assign(1, Token{T_EOF, 0, NO_SYMBOL});
+            }
+            pos = 0;
+        }
+        size_t count = min(capacity, batch.size() - pos);
+        copy(batch.begin() + pos, batch.begin() + pos + count, out);
+        pos += count;
+        return count;
+    }
+};
+
+// Binary IR: what the front end produces, so that the backend can run again,
+// with other options or on another machine, without lexing or parsing.
+//
+//   IRHeader
+//   uint32_t nameEnds[nameCount]      where each interned spelling ends
+//   char spellings[spellingsSize]     padded with zeros to 8 bytes
+//   IRSymbol symbols[symbolCount]     the symbol table in id order
+//   TACInstruction code[instructionCount]  before optimization
+//
+// Sections follow each other at offsets that the header's counts give, and
+// everything refers to names by SymbolId, never by address, so a mapped file
+// is used where it lies: spellings are viewed in place and the TAC array has
+// TACInstruction's own layout, padding zeroed. Fields are in the writer's byte
+// order and a reader of the other order rejects the file. Bump IR_VERSION
+// whenever the layout or the meaning of a field changes.
+const char IR_MAGIC[8] = {'T', 'A', 'C', 'I', 'R', '\0', '\r', '\n'};
+const uint32_t IR_VERSION = 1;
+const uint32_t IR_BYTE_ORDER = 0x01020304;
+
+struct IRHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder; // IR_BYTE_ORDER as the writer stores it
+    uint32_t nameCount; // Including NO_SYMBOL
+    uint32_t symbolCount;
+    uint64_t instructionCount;
+    uint64_t spellingsSize;
+    uint64_t checksum; // irChecksum of everything after the header
+};
+
+struct IRSymbol
+{
+    SymbolId name;
+    int32_t scopeLevel;
+    int32_t length;
+    uint8_t type; // A TokenType from T_INT to T_CHAR
+    uint8_t initialized;
+    uint8_t padding[2];
+};
+
+static_assert(sizeof(IRHeader) == IR_HEADER_BYTES && sizeof(IRSymbol) == 16, "IR records must not change size");
+static_assert(offsetof(IRHeader, instructionCount) == IR_INSTRUCTION_COUNT_OFFSET &&
+                  offsetof(IRHeader, checksum) == IR_CHECKSUM_OFFSET,
+              "compiler.h publishes IRHeader's layout");
+static_assert(sizeof(Operand) == 8 && offsetof(Operand, value) == IR_OPERAND_VALUE_OFFSET,
+              "IR stores Operand's layout");
+static_assert(sizeof(TACInstruction) == IR_INSTRUCTION_BYTES &&
+                  offsetof(TACInstruction, result) == IR_OPERAND_OFFSETS[0] &&
+                  offsetof(TACInstruction, arg1) == IR_OPERAND_OFFSETS[1] &&
+                  offsetof(TACInstruction, arg2) == IR_OPERAND_OFFSETS[2],
+              "IR stores TACInstruction's layout");
+static_assert(is_trivially_copyable<TACInstruction>::value, "IR maps TACInstruction in place");
+
+template <typename T>
+void appendRecord(string &out, const T &record)
+{
+    out.append(reinterpret_cast<const char *>(&record), sizeof(record));
+}
+
+uint64_t alignIR(uint64_t offset)
+{
+    return (offset + 7) & ~uint64_t(7);
+}
+
+string encodeIR(const StringInterner &names, const SymbolTable &symbols, const vector<TACInstruction> &code)
+{
+    vector<pair<SymbolId, Symbol>> entries = symbols.entries();
+    IRHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IR_MAGIC, sizeof(IR_MAGIC));
+    header.version = IR_VERSION;
+    header.byteOrder = IR_BYTE_ORDER;
+    header.nameCount = static_cast<uint32_t>(names.size());
+    header.symbolCount = static_cast<uint32_t>(entries.size());
+    header.instructionCount = code.size();
+
+    string ir(sizeof(IRHeader), '\0');
+    uint32_t end = 0;
+    for (SymbolId id = 0; id < header.nameCount; id++)
+    {
+        end += static_cast<uint32_t>(names.text(id).size());
+        appendRecord(ir, end);
+    }
+    for (SymbolId id = 0; id < header.nameCount; id++)
+    {
+        ir += names.text(id);
+    }
+    header.spellingsSize = end;
+    ir.resize(alignIR(ir.size()), '\0');
+
+    for (const auto &entry : entries)
+    {
+        IRSymbol record;
+        memset(&record, 0, sizeof(record));
+        record.name = entry.first;
+        record.scopeLevel = entry.second.scopeLevel;
+        record.length = entry.second.length;
+        record.type = entry.second.type;
+        record.initialized = entry.second.initialized;
+        appendRecord(ir, record);
+    }
+
+    // Copied field by field so that the padding is written as zeros
+    auto setOperand = [](Operand &to, const Operand &from)
+    {
+        to.kind = from.kind;
+        to.value = from.value;
+    };
+    for (const TACInstruction &instr : code)
+    {
+        TACInstruction record;
+        memset(&record, 0, sizeof(record));
+        record.op = instr.op;
+        setOperand(record.result, instr.result);
+        setOperand(record.arg1, instr.arg1);
+        setOperand(record.arg2, instr.arg2);
+        appendRecord(ir, record);
+    }
+
+    header.checksum = irChecksum(string_view(ir).substr(sizeof(IRHeader)));
+    memcpy(&ir[0], &header, sizeof(header));
+    return ir;
+}
+
+// A binary IR file, checked and then used in place. The checks cover the
+// layout and every reference: names, symbols, temporaries and labels are in
+// range, each operand has the kind its opcode takes, every temporary is
+// assigned before it is read and every label jumped to is defined once.
+class IRView
+{
+private:
+    // What an instruction may have as one of its operands
+    enum OperandUse : uint8_t
+    {
+        USE_NONE,
+        USE_VALUE,  // A temporary, scalar variable or immediate it reads
+        USE_COPIED, // A value as above, or none for a string literal
+        USE_TARGET, // A temporary or scalar variable it assigns
+        USE_LABEL,
+        USE_ARRAY,
+    };
+
+    const IRHeader *header;
+    const uint32_t *nameEnds;
+    const char *spellings;
+    const IRSymbol *symbolRecords;
+    const TACInstruction *code;
+
+    static bool fail(string &error, const char *reason)
+    {
+        error = reason;
+        return false;
+    }
+
+    // Result, arg1 and arg2 of each TACOp, as its comments describe them
+    static constexpr OperandUse OPERAND_USES[OP_STORE + 1][3] = {
+        {USE_TARGET, USE_COPIED, USE_NONE}, // OP_COPY
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_ADD
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_SUB
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_MUL
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_DIV
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_GT
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_LT
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_EQ
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_NEQ
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_AND
+        {USE_TARGET, USE_VALUE, USE_VALUE}, // OP_OR
+        {USE_LABEL, USE_NONE, USE_NONE},    // OP_LABEL
+        {USE_LABEL, USE_NONE, USE_NONE},    // OP_JUMP
+        {USE_LABEL, USE_VALUE, USE_NONE},   // OP_JUMP_IF_FALSE
+        {USE_LABEL, USE_VALUE, USE_NONE},   // OP_JUMP_IF_TRUE
+        {USE_TARGET, USE_ARRAY, USE_VALUE}, // OP_LOAD
+        {USE_ARRAY, USE_VALUE, USE_VALUE},  // OP_STORE
+    };
+
+    static bool fits(const Operand &operand, OperandUse use)
+    {
+        switch (use)
+        {
+        case USE_NONE:
+            return operand.kind == OPERAND_NONE;
+        case USE_COPIED:
+            return operand.kind == OPERAND_NONE || fits(operand, USE_VALUE);
+        case USE_VALUE:
+            return operand.kind == OPERAND_TEMP || operand.kind == OPERAND_VAR || operand.kind == OPERAND_IMM;
+        case USE_TARGET:
+            return operand.kind == OPERAND_TEMP || operand.kind == OPERAND_VAR;
+        case USE_LABEL:
+            return operand.kind == OPERAND_LABEL;
+        case USE_ARRAY:
+            return operand.kind == OPERAND_ARRAY;
+        }
+        return false;
+    }
+
+    // Fills in the length of each declared name; the others stay -1
+    bool checkSymbols(vector<int32_t> &lengths, string &error) const
+    {
+        for (uint32_t i = 0; i < header->symbolCount; i++)
+        {
+            const IRSymbol &symbol = symbolRecords[i];
+            if (symbol.name == NO_SYMBOL || symbol.name >= header->nameCount || lengths[symbol.name] >= 0)
+            {
+                return fail(error, "a symbol has no name or is declared twice");
+            }
+            if (symbol.type > T_CHAR || symbol.initialized > 1 || symbol.scopeLevel < 0 || symbol.length < 0 ||
+                (symbol.length > 0 && symbol.type != T_INT))
+            {
+                return fail(error, "a symbol has an invalid type, scope or length");
+            }
+            lengths[symbol.name] = symbol.length;
+        }
+        return true;
+    }
+
+    bool checkCode(const vector<int32_t> &lengths, string &error) const
+    {
+        uint64_t count = header->instructionCount;
+        vector<bool> tempAssigned(count, false);
+        vector<bool> labelDefined(count, false);
+        vector<bool> labelUsed(count, false);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            const TACInstruction &instr = code[i];
+            if (instr.op > OP_STORE)
+            {
+                return fail(error, "an instruction has an unknown opcode");
+            }
+            const OperandUse *uses = OPERAND_USES[instr.op];
+            const Operand *operands[3] = {&instr.result, &instr.arg1, &instr.arg2};
+            for (int k = 0; k < 3; k++)
+            {
+                const Operand &operand = *operands[k];
+                switch (operand.kind)
+                {
+                case OPERAND_NONE:
+                case OPERAND_IMM:
+                    break;
+                case OPERAND_VAR:
+                case OPERAND_ARRAY:
+                    if (operand.value <= 0 || static_cast<uint32_t>(operand.value) >= header->nameCount ||
+                        lengths[operand.value] < 0)
+                    {
+                        return fail(error, "an instruction names an undeclared variable");
+                    }
+                    if ((lengths[operand.value] > 0) != (operand.kind == OPERAND_ARRAY))
+                    {
+                        return fail(error, "an instruction uses an array as a scalar or a scalar as an array");
+                    }
+                    break;
+                case OPERAND_TEMP:
+                case OPERAND_LABEL:
+                    // Each temporary and label is defined by an instruction of its own
+                    if (operand.value < 0 || static_cast<uint64_t>(operand.value) >= count)
+                    {
+                        return fail(error, "an instruction has a temporary or label out of range");
+                    }
+                    if (operand.kind == OPERAND_LABEL && instr.op != OP_LABEL)
+                    {
+                        labelUsed[operand.value] = true;
+                    }
+                    break;
+                default:
+                    return fail(error, "an instruction has an unknown operand kind");
+                }
+                if (!fits(operand, uses[k]))
+                {
+                    return fail(error, "an instruction has an operand of the wrong kind for its opcode");
+                }
+                // Arguments are only ever read, and the front end assigns a
+                // temporary above its first read
+                if (k > 0 && operand.kind == OPERAND_TEMP && !tempAssigned[operand.value])
+                {
+                    return fail(error, "a temporary is read before it is assigned");
+                }
+            }
+            if (instr.op == OP_LABEL)
+            {
+                if (labelDefined[instr.result.value])
+                {
+                    return fail(error, "a label is defined twice");
+                }
+                labelDefined[instr.result.value] = true;
+            }
+            else if (uses[0] == USE_TARGET && instr.result.kind == OPERAND_TEMP)
+            {
+                tempAssigned[instr.result.value] = true;
+            }
+        }
+        for (uint64_t label = 0; label < count; label++)
+        {
+            if (labelUsed[label] && !labelDefined[label])
+            {
+                return fail(error, "an instruction jumps to an undefined label");
+            }
+        }
+        return true;
+    }
+
+public:
+    IRView() : header(nullptr), nameEnds(nullptr), spellings(nullptr), symbolRecords(nullptr), code(nullptr) {}
+
+    // Points into `ir`, which must be 8-byte aligned and outlive the view. On
+    // failure `error` says what is wrong with it.
+    bool open(string_view ir, string &error)
+    {
+        if (ir.size() < sizeof(IRHeader) || memcmp(ir.data(), IR_MAGIC, sizeof(IR_MAGIC)) != 0)
+        {
+            return fail(error, "not an IR file");
+        }
+        header = reinterpret_cast<const IRHeader *>(ir.data());
+        if (header->byteOrder != IR_BYTE_ORDER)
+        {
+            return fail(error, "written on a machine of the other byte order");
+        }
+        if (header->version != IR_VERSION)
+        {
+            return fail(error, "written by a compiler with another IR version");
+        }
+
+        // Counts are at most 2^32 and records small, so no sum below overflows
+        uint64_t namesAt = sizeof(IRHeader);
+        uint64_t spellingsAt = namesAt + uint64_t(header->nameCount) * sizeof(uint32_t);
+        if (header->instructionCount > ir.size() || header->spellingsSize > ir.size())
+        {
+            return fail(error, "truncated or has trailing bytes");
+        }
+        uint64_t symbolsAt = alignIR(spellingsAt + header->spellingsSize);
+        uint64_t codeAt = symbolsAt + uint64_t(header->symbolCount) * sizeof(IRSymbol);
+        if (codeAt + header->instructionCount * sizeof(TACInstruction) != ir.size())
+        {
+            return fail(error, "truncated or has trailing bytes");
+        }
+        if (irChecksum(ir.substr(sizeof(IRHeader))) != header->checksum)
+        {
+            return fail(error, "checksum mismatch; the file is damaged");
+        }
+        nameEnds = reinterpret_cast<const uint32_t *>(ir.data() + namesAt);
+        spellings = ir.data() + spellingsAt;
+        symbolRecords = reinterpret_cast<const IRSymbol *>(ir.data() + symbolsAt);
+        code = reinterpret_cast<const TACInstruction *>(ir.data() + codeAt);
+
+        if (header->nameCount == 0 || nameEnds[0] != 0 || nameEnds[header->nameCount - 1] != header->spellingsSize)
+        {
+            return fail(error, "the name table is malformed");
+        }
+        for (uint32_t id = 1; id < header->nameCount; id++)
+        {
+            if (nameEnds[id] < nameEnds[id - 1])
+            {
+                return fail(error, "the name table is malformed");
+            }
+        }
+        vector<int32_t> lengths(header->nameCount, -1);
+        return checkSymbols(lengths, error) && checkCode(lengths, error);
+    }
+
+    // Gives every name its id in `names`, which must be new, viewing the
+    // spellings in place
+    void loadNames(StringInterner &names) const
+    {
+        for (uint32_t id = 1; id < header->nameCount; id++)
+        {
+            names.reference(string_view(spellings + nameEnds[id - 1], nameEnds[id] - nameEnds[id - 1]));
+        }
+    }
+
+    void loadSymbols(SymbolTable &symbols) const
+    {
+        for (uint32_t i = 0; i < header->symbolCount; i++)
+        {
+            const IRSymbol &symbol = symbolRecords[i];
+            symbols.insert(symbol.name, static_cast<TokenType>(symbol.type), symbol.scopeLevel, symbol.length);
+            if (symbol.initialized)
+            {
+                symbols.markInitialized(symbol.name);
+            }
+        }
+    }
+
+    const TACInstruction *begin() const
+    {
+        return code;
+    }
+    const TACInstruction *end() const
+    {
+        return code + header->instructionCount;
+    }
+};
+
+// Records tokens, in source order, for CompileResult::tokens. Lines are
+// counted on from the previous token, not from the start of the source.
+class TokenRecorder
+{
+private:
+    string_view src;
+    Lexer &lexer;
+    vector<TokenRecord> &records;
+    size_t offset;
+    int line;
+
+public:
+    TokenRecorder(string_view src, Lexer &lexer, vector<TokenRecord> &records)
+        : src(src), lexer(lexer), records(records), offset(0), line(1) {}
+
+    void record(const Token &token)
+    {
+        size_t to = min<size_t>(token.offset, src.size());
+        if (to > offset)
+        {
+            line += static_cast<int>(count(src.begin() + offset, src.begin() + to, '\n'));
+            offset = to;
+        }
+        records.push_back(TokenRecord{lexer.tokenTypeToString(token.type),
+                                      string(tokenValue(token, lexer.getInterner())), line});
+    }
+};
+
+// Optimizes `code`, lists it and lowers it to assembly: every phase after
+// the front end, for compileSequential and compileFromIR. With keepText,
+// result.tac and result.assembly get copies of what the listing shows;
+// without, the TAC and assembly are written to `out` as they are produced.
+void compileBackend(const StringInterner &interner, vector<TACInstruction> &code, const CompileOptions &options,
+                    CompileResult &result, ostream &out, ostream &log, bool keepText)
+{
+    // Optimization passes rewrite the TAC in place before it is printed
+    PassManager passes(options.optLevel, options.vectorISA);
+    passes.run(code);
+    if (options.printStats)
+    {
+        passes.printStats(log);
+    }
+
+    // TAC is three address code and intermediate code generation
+    TACPrinter printer(interner);
+    out << "Three-Address Code:" << endl;
+    ostringstream tac;
+    for (const auto &instr : code)
+    {
+        printer.print(keepText ? tac : out, instr);
+    }
+    if (keepText)
+    {
+        result.tac = tac.str();
+        out << result.tac;
+    }
+    if (options.dumpCFG)
+    {
+        dumpControlFlow(code, out);
+    }
+    if (options.dumpSSA)
+    {
+        SSAForm(code).print(out, printer);
+    }
+    CodeGenerator codeGen(interner, options.optLevel >= 1, options.vectorISA);
+
+    out << "\nGenerated Assembly Code:" << endl;
+    ostringstream assembly;
+    codeGen.generateAssembly(code, keepText ? assembly : out);
+    if (keepText)
+    {
+        result.assembly = assembly.str();
+        out << result.assembly;
+    }
+    if (options.printStats)
+    {
+        codeGen.printStats(log);
+    }
+}
+
+// Runs every phase to completion before the next, filling in `result` and
+// writing the listing to `out` as it goes. --stats goes to `log`. With
+// emitIR it stops after the symbol table and returns the IR instead.
+void compileSequential(string_view text, const CompileOptions &options, CompileResult &result, ostream &out,
+                       ostream &log, bool keepText)
+{
+    // Tokenizing phase of the compiler. In streaming mode the parser pulls
+    // tokens from the lexer on demand instead.
+    StringInterner interner;
+    Lexer lexer(text, interner);
+    TokenStream tokens(interner);
+    TokenStreamReader tokenReader(tokens);
+    TokenSource *tokenSource = &lexer;
+    if (!options.streamTokens)
+    {
+        tokens = lexer.tokenize();
+        if (options.recordTokens)
+        {
+            TokenRecorder recorder(text, lexer, result.tokens);
+            result.tokens.reserve(tokens.size());
+            for (size_t i = 0; i < tokens.size(); i++)
+            {
+                recorder.record(tokens[i]);
+            }
+        }
+        lexer.printTokens(out, tokens);
+        tokenSource = &tokenReader;
+    }
+
+    // Parsing phase of the compiler
+    Parser parser(*tokenSource, lexer);
+    parser.parseProgram();
+    out << "Parsing completed successfully! No Syntax Error" << endl;
+
+    result.symbols = parser.getSymbolTable().records();
+    SymbolTable::printTable(out, result.symbols);
+    if (options.emitIR)
+    {
+        result.ir = encodeIR(interner, parser.getSymbolTable(), parser.getTACGenerator().getInstructions());
+        return;
+    }
+    compileBackend(interner, parser.getTACGenerator().getInstructions(), options, result, out, log, keepText);
+}
+
+// Runs the backend on binary IR from emitIR. The listing starts at the
+// symbol table, as nothing is lexed or parsed.
+void compileFromIR(string_view ir, const CompileOptions &options, CompileResult &result, ostream &out, ostream &log,
+                   bool keepText)
+{
+    // The view needs the alignment a mapped file has; a buffer without it is copied
+    vector<uint64_t> aligned;
+    if (reinterpret_cast<uintptr_t>(ir.data()) % alignof(uint64_t) != 0)
+    {
+        aligned.resize(ir.size() / sizeof(uint64_t) + 1);
+        memcpy(aligned.data(), ir.data(), ir.size());
+        ir = string_view(reinterpret_cast<const char *>(aligned.data()), ir.size());
+    }
+    IRView view;
+    string error;
+    if (!view.open(ir, error))
+    {
+        compileError(DIAGNOSTIC_INPUT, 0, "Error: Invalid IR: ", error);
+    }
+
+    StringInterner interner;
+    view.loadNames(interner);
+    SymbolTable symbols(interner);
+    view.loadSymbols(symbols);
+    result.symbols = symbols.records();
+    SymbolTable::printTable(out, result.symbols);
+
+    // The passes rewrite this copy; the mapped array stays as it is
+    vector<TACInstruction> code(view.begin(), view.end());
+    compileBackend(interner, code, options, result, out, log, keepText);
+}
+
+// Writes what `buffer` holds to `out` without copying it into a string first
+void writeBuffer(ostream &out, stringstream &buffer)
+{
+    // Inserting an empty streambuf would set failbit on `out`
+    if (buffer.tellp() > 0)
+    {
+        out << buffer.rdbuf();
+    }
+}
+
+// Lexer, parser and code generator each run on their own thread, connected by
+// SPSC queues of token and TAC batches. Output is buffered per phase, and
+// `result` and the listing come out the same, byte for byte, as from
+// compileSequential.
+//
+// Optimization passes and the CFG dump work on whole programs, so with either
+// enabled the code generator thread collects every batch before optimizing and
+// lowering; only the lexer and parser then overlap.
+//
+// A CompileError on the lexer thread ends its token stream early; once every
+// thread has stopped it is rethrown, taking precedence over any syntax error
+// the cut-off stream caused in the parser.
+void compilePipelined(string_view text, const CompileOptions &options, CompileResult &result, ostream &out,
+                      ostream &log, bool keepText)
+{
+    bool streamTokens = options.streamTokens;
+    StringInterner interner;
+    Lexer lexer(text, interner);
+    TokenQueue tokenQueue;
+    TACQueue tacQueue;
+    stringstream tokenListing;
+    stringstream tacListing;
+    ostringstream statistics;
+    AsmBuffer assemblyCode;
+    vector<TokenRecord> tokenRecords;
+    exception_ptr lexerError;
+    atomic<bool> parseFailed(false);
+
+    // Anything but a compile error ends the compile: the thread it happens
+    // on keeps it and closes both queues, so that the others stop waiting
+    // and can be joined before it is rethrown
+    exception_ptr lexerFailure, parserFailure, codegenFailure;
+    auto giveUp = [&](exception_ptr &failure)
+    {
+        failure = current_exception();
+        tokenQueue.close();
+        tacQueue.close();
+    };
+
+    thread lexerThread([&]()
+                       {
+        try
+        {
+            TokenRecorder recorder(text, lexer, tokenRecords);
+            bool done = false;
+            while (!done)
+            {
+                vector<Token> batch(TOKEN_BATCH_SIZE);
+                size_t count = 0;
+                try
+                {
+                    while (count < batch.size() && !done)
+                    {
+                        count += lexer.fill(batch.data() + count, batch.size() - count);
+                        done = batch[count - 1].type == T_EOF;
+                    }
+                }
+                catch (const CompileError &)
+                {
+                    lexerError = current_exception();
+                    batch[count++] = Token{T_EOF, static_cast<uint32_t>(text.size()), NO_SYMBOL};
+                    done = true;
+                }
+                batch.resize(count);
+                if (!streamTokens)
+                {
+                    for (const Token &token : batch)
+                    {
+                        if (options.recordTokens)
+                        {
+                            recorder.record(token);
+                        }
+                        lexer.printToken(tokenListing, token);
+                    }
+                }
+                if (!tokenQueue.push(move(batch)))
+                {
+                    return;
+                }
+            }
+        }
+        catch (...)
+        {
+            giveUp(lexerFailure);
+        } });
+
+    thread codegenThread([&]()
+                         {
+        try
+        {
+            CodeGenerator codeGen(interner, options.optLevel >= 1, options.vectorISA);
+            TACPrinter printer(interner);
+            PassManager passes(options.optLevel, options.vectorISA);
+            bool wholeProgram = !passes.empty() || options.dumpCFG || options.dumpSSA;
+            vector<TACInstruction> program;
+            TACBatch batch;
+            do
+            {
+                if (!tacQueue.pop(batch))
+                {
+                    return;
+                }
+                if (batch.last && parseFailed)
+                {
+                    return; // Nothing will be printed, and the program is incomplete
+                }
+                vector<TACInstruction> *ready = &batch.instructions;
+                if (wholeProgram)
+                {
+                    program.insert(program.end(), batch.instructions.begin(), batch.instructions.end());
+                    if (!batch.last)
+                    {
+                        continue;
+                    }
+                    passes.run(program);
+                    ready = &program;
+                }
+                for (const auto &instr : *ready)
+                {
+                    printer.print(tacListing, instr);
+                }
+                if (options.dumpCFG)
+                {
+                    dumpControlFlow(*ready, tacListing);
+                }
+                if (options.dumpSSA)
+                {
+                    SSAForm(*ready).print(tacListing, printer);
+                }
+                codeGen.translate(*ready, assemblyCode);
+            } while (!batch.last);
+            if (options.printStats)
+            {
+                passes.printStats(statistics);
+                codeGen.printStats(statistics);
+            }
+        }
+        catch (...)
+        {
+            giveUp(codegenFailure);
+        } });
+
+    QueueTokenSource tokenSource(tokenQueue);
+    Parser parser(tokenSource, lexer);
+    parser.setTACBatchHandler([&](vector<TACInstruction> &&instructions)
+                              { tacQueue.push(TACBatch{move(instructions), false}); },
+                              TAC_BATCH_SIZE);
+    exception_ptr parserError;
+    try
+    {
+        parser.parseProgram();
+        tacQueue.push(TACBatch{parser.getTACGenerator().takeInstructions(), true});
+    }
+    catch (const CompileError &)
+    {
+        // Let the other threads run out: the lexer to the end of its
+        // input, the code generator on what it has been given
+        parserError = current_exception();
+        parseFailed = true;
+        Token token;
+        while (tokenSource.fill(&token, 1) == 1 && token.type != T_EOF)
+        {
+        }
+        tacQueue.push(TACBatch{vector<TACInstruction>(), true});
+    }
+    catch (...)
+    {
+        giveUp(parserFailure);
+    }
+
+    lexerThread.join();
+    codegenThread.join();
+    for (const exception_ptr &failure : {lexerFailure, parserFailure, codegenFailure})
+    {
+        if (failure)
+        {
+            rethrow_exception(failure);
+        }
+    }
+    if (lexerError)
+    {
+        rethrow_exception(lexerError);
+    }
+    // Every token was read before the syntax error is reported, so the
+    // listing has them all, as compileSequential's does
+    if (!streamTokens)
+    {
+        result.tokens = move(tokenRecords);
+        out << "Tokens:" << endl;
+        writeBuffer(out, tokenListing);
+    }
+    if (parserError)
+    {
+        rethrow_exception(parserError);
+    }
+    out << "Parsing completed successfully! No Syntax Error" << endl;
+    result.symbols = parser.getSymbolTable().records();
+    SymbolTable::printTable(out, result.symbols);
+
+    out << "Three-Address Code:" << endl;
+    if (keepText)
+    {
+        result.tac = tacListing.str();
+        result.assembly = string(assemblyCode.text());
+        out << result.tac << "\nGenerated Assembly Code:" << endl
+            << result.assembly;
+    }
+    else
+    {
+        string_view assembly = assemblyCode.text();
+        writeBuffer(out, tacListing);
+        out << "\nGenerated Assembly Code:" << endl;
+        out.write(assembly.data(), assembly.size());
+    }
+    log << statistics.str();
+}
+
+// Runs `phases`, which fill in a result and write the listing and --stats
+// output to the two streams, and turns a CompileError into a diagnostic.
+// The listing goes to `out`, or into the result if that is null.
+template <typename Phases>
+CompileResult collectResult(Phases phases, ostream *out)
+{
+    CompileResult result;
+    ostringstream listing, statistics;
+    try
+    {
+        phases(result, out ? *out : listing, statistics);
+        result.success = true;
+    }
+    catch (const CompileError &error)
+    {
+        result.diagnostics.push_back(Diagnostic{error.kind(), error.line(), error.what()});
+    }
+    if (!out)
+    {
+        result.listing = listing.str();
+    }
+    result.statistics = statistics.str();
+    return result;
+}
+
+CompileResult compileSource(string_view source, const CompileOptions &options, ostream *out)
+{
+    return collectResult([&](CompileResult &result, ostream &listing, ostream &statistics)
+                         {
+        if (options.fromIR)
+        {
+            compileFromIR(source, options, result, listing, statistics, out == nullptr);
+        }
+        else if (options.pipelined && !options.emitIR)
+        {
+            compilePipelined(source, options, result, listing, statistics, out == nullptr);
+        }
+        else
+        {
+            compileSequential(source, options, result, listing, statistics, out == nullptr);
+        } },
+                         out);
+}
+
+CompileResult compileSourceFile(const string &path, const CompileOptions &options, ostream *out)
+{
+    SourceFile source;
+    if (!source.open(path.c_str()))
+    {
+        CompileResult result;
+        result.diagnostics.push_back(Diagnostic{DIAGNOSTIC_INPUT, 0, "Error: Cannot open file " + path});
+        return result;
+    }
+    return compileSource(source.text(), options, out);
+}
+
+} // namespace
+
+CompileResult compile(string_view source, const CompileOptions &options)
+{
+    return compileSource(source, options, nullptr);
+}
+
+CompileResult compileFile(const string &path, const CompileOptions &options)
+{
+    return compileSourceFile(path, options, nullptr);
+}
+
+CompileResult compile(string_view source, const CompileOptions &options, ostream &listing)
+{
+    return compileSource(source, options, &listing);
+}
+
+CompileResult compileFile(const string &path, const CompileOptions &options, ostream &listing)
+{
+    return compileSourceFile(path, options, &listing);
+}
+
+// FNV-1a over 64-bit words, then the bytes left over. Catches a file
+// damaged in transit; it is not meant to stand up to tampering.
+uint64_t irChecksum(string_view bytes)
+{
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= bytes.size(); i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes.data() + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < bytes.size(); i++)
+    {
+        hash = (hash ^ static_cast<unsigned char>(bytes[i])) * prime;
+    }
+    return hash;
+}
+
+string report(const CompileResult &result)
+{
+    string text = result.listing;
+    for (const Diagnostic &diagnostic : result.diagnostics)
+    {
+        text += diagnostic.message + "\n";
+    }
+    return text;
+}
+
+namespace
+{
+
+struct ParsedStatement;
+
+// Statements one after another: the program's, or those of a block
+struct StatementList
+{
+    vector<unique_ptr<ParsedStatement>> statements;
+    vector<uint32_t> begins; // Offset of each statement from the list's start
+    vector<int> lines;       // The lexer's line at each statement, from the list's
+};
+
+// A block directly in a statement, not inside another block of it. Its
+// statements have a list of their own, so that an edit inside the block
+// re-parses only some of them.
+struct NestedBlock
+{
+    uint32_t open;  // Offsets of the braces from the statement's start
+    uint32_t close;
+    int line;       // The lexer's line at the open brace, from the statement's
+    int closeLine;  // and at the close brace, from the open brace's
+    size_t tokens;  // How many of the statement's own tokens, instructions,
+    size_t code;    // temporaries and labels come before the block's
+    int32_t temps;
+    int32_t labels;
+    StatementList list;
+};
+
+// Front end output for one statement. Token offsets are relative to the
+// statement's first token and its temporaries and labels are numbered from
+// 0, so an edit elsewhere in the source leaves it as it is. The tokens, code
+// and declarations are its own, without its blocks'; temps and labels count
+// those of its blocks too.
+struct ParsedStatement
+{
+    vector<Token> tokens;
+    vector<TACInstruction> code;
+    int32_t temps;
+    int32_t labels;
+    vector<SymbolId> declares;
+    vector<NestedBlock> blocks;
+};
+
+// Moves the temporaries and labels `instr` names by the given amounts and,
+// with `ids`, maps the variables it names through it
+void relocate(TACInstruction &instr, int32_t temps, int32_t labels, const vector<SymbolId> *ids)
+{
+    for (Operand *operand : {&instr.result, &instr.arg1, &instr.arg2})
+    {
+        if (operand->kind == OPERAND_TEMP)
+        {
+            operand->value += temps;
+        }
+        else if (operand->kind == OPERAND_LABEL)
+        {
+            operand->value += labels;
+        }
+        else if (ids && (operand->kind == OPERAND_VAR || operand->kind == OPERAND_ARRAY))
+        {
+            operand->value = static_cast<int32_t>((*ids)[operand->value]);
+        }
+    }
+}
+
+// Replaces items [from, to) with `with`, moving the items after them only if
+// the count changes
+template <typename T>
+void splice(vector<T> &items, size_t from, size_t to, vector<T> &&with)
+{
+    size_t common = min(to - from, with.size());
+    move(with.begin(), with.begin() + common, items.begin() + from);
+    if (with.size() > common)
+    {
+        items.insert(items.begin() + to, make_move_iterator(with.begin() + common), make_move_iterator(with.end()));
+    }
+    else
+    {
+        items.erase(items.begin() + from + common, items.begin() + to);
+    }
+}
+
+// Adds the variables `statement` and the statements in its blocks declare
+void collectDeclarations(const ParsedStatement &statement, vector<SymbolId> &names)
+{
+    names.insert(names.end(), statement.declares.begin(), statement.declares.end());
+    for (const NestedBlock &block : statement.blocks)
+    {
+        for (const auto &inner : block.list.statements)
+        {
+            collectDeclarations(*inner, names);
+        }
+    }
+}
+
+// Where the parser was at a block event: the token it was at, and how much
+// code and how many temporaries, labels and declarations it had made
+struct ParseMark
+{
+    BlockEvent event;
+    uint32_t offset;
+    size_t code;
+    int32_t temps;
+    int32_t labels;
+    size_t declarations;
+};
+
+// Cuts what the parser made of one statement of a list into a
+// ParsedStatement, and what it made of the statements in its blocks into
+// theirs, by marks taken before the statement, at each of its blocks' events
+// and after it
+class StatementCutter
+{
+private:
+    const vector<Token> &tokens; // As lexed, with the lexer's line after each
+    const vector<int> &lines;
+    const vector<ParseMark> &marks;
+    const vector<TACInstruction> &code;
+    const vector<SymbolId> &declarations;
+    size_t first; // The first token of the statement being cut, or of its last child so far
+    size_t next;  // The mark the next statement starts at
+
+    // The lexer's line at the token starting at `offset`
+    int lineAt(uint32_t offset) const
+    {
+        return lines[tokenAt(offset)];
+    }
+
+public:
+    StatementCutter(const vector<Token> &tokens, const vector<int> &lines, const vector<ParseMark> &marks,
+                    const vector<TACInstruction> &code, const vector<SymbolId> &declarations, size_t first)
+        : tokens(tokens), lines(lines), marks(marks), code(code), declarations(declarations), first(first), next(0)
+    {
+    }
+
+    // The token starting at `offset`, which is not before `first`. It is
+    // found in steps doubling from there, as most lookups are for a token
+    // close by.
+    size_t tokenAt(uint32_t offset) const
+    {
+        size_t low = first;
+        size_t step = 1;
+        while (low + step < tokens.size() && tokens[low + step].offset < offset)
+        {
+            low += step;
+            step *= 2;
+        }
+        return lower_bound(tokens.begin() + low, tokens.begin() + min(low + step, tokens.size()), offset,
+                           [](const Token &token, uint32_t offset) { return token.offset < offset; }) -
+               tokens.begin();
+    }
+
+    // The statement whose first mark is the next one. Leaves the mark after
+    // it, which it ends at, as the next.
+    unique_ptr<ParsedStatement> cut()
+    {
+        const ParseMark &begin = marks[next++];
+        first = tokenAt(begin.offset);
+        size_t firstToken = first;
+        int line = lines[first];
+        unique_ptr<ParsedStatement> statement(new ParsedStatement());
+        vector<pair<const ParseMark *, const ParseMark *>> braces;
+        while (marks[next].event == BLOCK_OPENS)
+        {
+            const ParseMark &open = marks[next++];
+            NestedBlock block;
+            int blockLine = lineAt(open.offset);
+            while (marks[next].event == BLOCK_STATEMENT)
+            {
+                block.list.begins.push_back(marks[next].offset - open.offset);
+                block.list.lines.push_back(lineAt(marks[next].offset) - blockLine);
+                block.list.statements.push_back(cut());
+            }
+            const ParseMark &close = marks[next++];
+            block.open = open.offset - begin.offset;
+            block.close = close.offset - begin.offset;
+            block.line = blockLine - line;
+            block.closeLine = lineAt(close.offset) - blockLine;
+            statement->blocks.push_back(move(block));
+            braces.emplace_back(&open, &close);
+        }
+        const ParseMark &end = marks[next];
+
+        // The statement's own parts are those around its blocks, braces
+        // included, and its own temporaries and labels skip the blocks' runs
+        first = firstToken;
+        size_t token = first;
+        const ParseMark *from = &begin;
+        auto takeOwn = [&](const ParseMark &until, size_t tokenEnd)
+        {
+            for (; token < tokenEnd; token++)
+            {
+                Token relative = tokens[token];
+                relative.offset -= begin.offset;
+                statement->tokens.push_back(relative);
+            }
+            statement->code.insert(statement->code.end(), code.begin() + from->code, code.begin() + until.code);
+            statement->declares.insert(statement->declares.end(), declarations.begin() + from->declarations,
+                                       declarations.begin() + until.declarations);
+        };
+        // Runs of numbers the blocks took, as (first after, length)
+        vector<pair<int32_t, int32_t>> blockTemps, blockLabels;
+        int32_t skippedTemps = 0;
+        int32_t skippedLabels = 0;
+        for (size_t i = 0; i < braces.size(); i++)
+        {
+            const ParseMark &open = *braces[i].first;
+            const ParseMark &close = *braces[i].second;
+            takeOwn(open, tokenAt(open.offset) + 1);
+            NestedBlock &block = statement->blocks[i];
+            block.tokens = statement->tokens.size();
+            block.code = statement->code.size();
+            block.temps = open.temps - begin.temps - skippedTemps;
+            block.labels = open.labels - begin.labels - skippedLabels;
+            blockTemps.emplace_back(close.temps, close.temps - open.temps);
+            blockLabels.emplace_back(close.labels, close.labels - open.labels);
+            skippedTemps += close.temps - open.temps;
+            skippedLabels += close.labels - open.labels;
+            token = tokenAt(close.offset);
+            from = &close;
+        }
+        takeOwn(end, tokenAt(end.offset));
+        auto own = [](int32_t number, int32_t first, const vector<pair<int32_t, int32_t>> &blocks)
+        {
+            int32_t own = number - first;
+            for (const auto &block : blocks)
+            {
+                own -= number >= block.first ? block.second : 0;
+            }
+            return own;
+        };
+        for (TACInstruction &instr : statement->code)
+        {
+            for (Operand *operand : {&instr.result, &instr.arg1, &instr.arg2})
+            {
+                if (operand->kind == OPERAND_TEMP)
+                {
+                    operand->value = own(operand->value, begin.temps, blockTemps);
+                }
+                else if (operand->kind == OPERAND_LABEL)
+                {
+                    operand->value = own(operand->value, begin.labels, blockLabels);
+                }
+            }
+        }
+        statement->temps = end.temps - begin.temps;
+        statement->labels = end.labels - begin.labels;
+        return statement;
+    }
+};
+
+// Appends the tokens and code of the statements in `list`, whose offsets
+// count from `base`, numbering temporaries and labels on from `temps` and
+// `labels` and advancing those past them
+void flatten(const StatementList &list, uint32_t base, int32_t &temps, int32_t &labels, vector<Token> &tokens,
+             vector<TACInstruction> &code)
+{
+    for (size_t i = 0; i < list.statements.size(); i++)
+    {
+        const ParsedStatement &statement = *list.statements[i];
+        uint32_t begin = base + list.begins[i];
+        // The statement's own numbers go around those of its blocks, each
+        // block's after the own numbers made before it opened
+        vector<pair<int32_t, int32_t>> blockTemps, blockLabels;
+        for (const NestedBlock &block : statement.blocks)
+        {
+            int32_t innerTemps = 0;
+            int32_t innerLabels = 0;
+            for (const auto &inner : block.list.statements)
+            {
+                innerTemps += inner->temps;
+                innerLabels += inner->labels;
+            }
+            blockTemps.emplace_back(block.temps, innerTemps);
+            blockLabels.emplace_back(block.labels, innerLabels);
+        }
+        auto number = [](int32_t own, const vector<pair<int32_t, int32_t>> &blocks)
+        {
+            int32_t number = own;
+            for (const auto &block : blocks)
+            {
+                number += block.first <= own ? block.second : 0;
+            }
+            return number;
+        };
+        size_t token = 0;
+        size_t instruction = 0;
+        auto takeOwn = [&](size_t tokenEnd, size_t codeEnd)
+        {
+            for (; token < tokenEnd; token++)
+            {
+                Token absolute = statement.tokens[token];
+                absolute.offset += begin;
+                tokens.push_back(absolute);
+            }
+            for (; instruction < codeEnd; instruction++)
+            {
+                TACInstruction instr = statement.code[instruction];
+                for (Operand *operand : {&instr.result, &instr.arg1, &instr.arg2})
+                {
+                    if (operand->kind == OPERAND_TEMP)
+                    {
+                        operand->value = temps + number(operand->value, blockTemps);
+                    }
+                    else if (operand->kind == OPERAND_LABEL)
+                    {
+                        operand->value = labels + number(operand->value, blockLabels);
+                    }
+                }
+                code.push_back(instr);
+            }
+        };
+        int32_t earlierTemps = 0;
+        int32_t earlierLabels = 0;
+        for (size_t b = 0; b < statement.blocks.size(); b++)
+        {
+            const NestedBlock &block = statement.blocks[b];
+            takeOwn(block.tokens, block.code);
+            int32_t innerTemps = temps + block.temps + earlierTemps;
+            int32_t innerLabels = labels + block.labels + earlierLabels;
+            flatten(block.list, begin + block.open, innerTemps, innerLabels, tokens, code);
+            earlierTemps += blockTemps[b].second;
+            earlierLabels += blockLabels[b].second;
+        }
+        takeOwn(statement.tokens.size(), statement.code.size());
+        temps += statement.temps;
+        labels += statement.labels;
+    }
+}
+
+// A statement list on the way in to the innermost block an edit lies in:
+// where it is in the base and, for a block's, the statement the block is in
+struct EnclosingList
+{
+    StatementList *list;
+    uint32_t base;          // Offset its begins count from
+    int line;               // Line its lines count from
+    uint32_t start;         // Where a region before its first statement is lexed from
+    NestedBlock *block;     // Null for the program
+    ParsedStatement *owner; // The statement the block is in
+    size_t index;           // of the list above
+};
+
+enum ReparseOutcome
+{
+    REPARSED,
+    REPARSE_FAILED,
+    DECLARATIONS_CHANGED,
+    ENCLOSING_LIST // The edit changed the block itself; re-parse the list around it
+};
+
+} // namespace
+
+// The base is the last source that got through the front end; the
+// statements describe it. Edits since then that have not been parsed yet
+// turned [dirtyBegin, dirtyEnd) of the base into [dirtyBegin, dirtyEnd + delta)
+// of text.
+struct IncrementalCompiler::State
+{
+    string text;
+    CompileOptions options;
+    unique_ptr<StringInterner> interner; // Only grows; result() interns again in source order
+    unique_ptr<SymbolTable> symbols;     // Declared in the base, with offsets into it
+    StatementList program;               // Its lines count from 1
+    bool parsed;                         // There is a base
+    bool dirty;
+    size_t dirtyBegin;
+    size_t dirtyEnd;
+    int64_t delta;
+
+    bool update(bool whole);
+    ReparseOutcome reparse(const vector<EnclosingList> &path, bool whole);
+};
+
+// Re-lexes and re-parses the statements the dirty range touches, in the
+// innermost block that holds it, and splices them in. With `whole`, the base
+// is dropped and all of text is parsed.
+bool IncrementalCompiler::State::update(bool whole)
+{
+    if (whole)
+    {
+        symbols.reset();
+        interner.reset(new StringInterner());
+        symbols.reset(new SymbolTable(*interner));
+        program = StatementList();
+        parsed = false;
+        dirtyBegin = 0;
+        dirtyEnd = 0;
+        delta = 0;
+    }
+
+    vector<EnclosingList> path{EnclosingList{&program, 0, 1, 0, nullptr, nullptr, 0}};
+    for (;;)
+    {
+        const EnclosingList &enclosing = path.back();
+        StatementList &list = *enclosing.list;
+        size_t i = upper_bound(list.begins.begin(), list.begins.end(), dirtyBegin - enclosing.base) - list.begins.begin();
+        if (i == 0)
+        {
+            break;
+        }
+        ParsedStatement &statement = *list.statements[--i];
+        uint32_t begin = enclosing.base + list.begins[i];
+        auto block = find_if(statement.blocks.begin(), statement.blocks.end(), [&](const NestedBlock &block)
+                             { return begin + block.open < dirtyBegin && dirtyEnd <= begin + block.close; });
+        if (block == statement.blocks.end())
+        {
+            break;
+        }
+        path.push_back(EnclosingList{&block->list, begin + block->open, enclosing.line + list.lines[i] + block->line,
+                                     begin + block->open + 1, &*block, &statement, i});
+    }
+
+    for (;;)
+    {
+        switch (reparse(path, whole))
+        {
+        case REPARSED:
+            parsed = true;
+            dirty = false;
+            delta = 0;
+            return true;
+        case REPARSE_FAILED:
+            return false;
+        case DECLARATIONS_CHANGED:
+            return update(true);
+        case ENCLOSING_LIST:
+            path.pop_back();
+            break;
+        }
+    }
+}
+
+// Re-parses the run of statements the dirty range touches in the innermost
+// list of `path` and splices it in, moving everything after it
+ReparseOutcome IncrementalCompiler::State::reparse(const vector<EnclosingList> &path, bool whole)
+{
+    const EnclosingList &enclosing = path.back();
+    StatementList &list = *enclosing.list;
+    size_t n = list.begins.size();
+    auto at = [&](size_t statement) -> int64_t { return enclosing.base + list.begins[statement]; };
+    // A region in a block ends at the latest at the block's close brace
+    int64_t close = enclosing.block ? enclosing.base - enclosing.block->open + enclosing.block->close : 0;
+
+    // The region starts at the statement the dirty range starts in, or at
+    // the beginning of the list if that is before its first statement
+    size_t first = upper_bound(list.begins.begin(), list.begins.end(), dirtyBegin - enclosing.base) - list.begins.begin();
+    first = first > 0 ? first - 1 : 0;
+    // and ends where the lexer lands on the start of old statement `last`,
+    // one that begins after the dirty range, or on the close brace
+    size_t unchanged = lower_bound(list.begins.begin(), list.begins.end(), dirtyEnd - enclosing.base) - list.begins.begin();
+    size_t last = unchanged;
+
+    vector<Token> lexed;
+    vector<int> lexedLines;
+    vector<unique_ptr<ParsedStatement>> parsedStatements;
+    vector<uint32_t> parsedBegins;
+    vector<int> parsedLines;
+    vector<pair<SymbolId, Symbol>> parsedDeclarations;
+    try
+    {
+        Lexer lexer(text, *interner);
+        // Lexes on until a token starts where an old statement from `until`
+        // on starts, or at the close brace, or to the end. The token found is
+        // left last in `lexed`. False if a token runs over the close brace.
+        auto lexTo = [&](size_t until)
+        {
+            for (;;)
+            {
+                if (!lexed.empty())
+                {
+                    const Token &token = lexed.back();
+                    if (enclosing.block && token.offset >= close + delta)
+                    {
+                        last = n;
+                        return token.offset == close + delta;
+                    }
+                    if (token.type == T_EOF)
+                    {
+                        last = n;
+                        return true;
+                    }
+                    while (last < n && (last < until || at(last) + delta < token.offset))
+                    {
+                        last++;
+                    }
+                    if (last < n && at(last) + delta == token.offset)
+                    {
+                        return true;
+                    }
+                }
+                lexed.push_back(lexer.next());
+                lexedLines.push_back(lexer.getLineNumber());
+            }
+        };
+        uint32_t start = 0;
+        auto lexFrom = [&](size_t statement)
+        {
+            bool atStatement = statement < n && at(statement) <= static_cast<int64_t>(dirtyBegin);
+            start = atStatement ? static_cast<uint32_t>(at(statement)) : enclosing.start;
+            lexer.seek(start, enclosing.line + (atStatement ? list.lines[statement] : 0));
+            lexed.clear();
+            lexedLines.clear();
+            last = unchanged;
+            return lexTo(unchanged);
+        };
+        if (!lexFrom(first))
+        {
+            return ENCLOSING_LIST;
+        }
+        // An else the edit exposed belongs to the if before it
+        if (first > 0 && lexed[0].type == T_ELSE && !lexFrom(--first))
+        {
+            return ENCLOSING_LIST;
+        }
+
+        for (;;)
+        {
+            // Everything lexed but the token the region ends at, which the
+            // parser sees as the end of the source
+            uint32_t end = lexed.back().offset;
+            TokenStream tokens(*interner);
+            for (size_t i = 0; i + 1 < lexed.size(); i++)
+            {
+                tokens.push(lexed[i]);
+            }
+            tokens.push(T_EOF, end, NO_SYMBOL);
+            TokenStreamReader reader(tokens);
+            Parser parser(reader, lexer);
+            SymbolTable &declared = parser.getSymbolTable();
+            TACGenerator &generator = parser.getTACGenerator();
+            if (!whole)
+            {
+                declared.inherit(*symbols, start);
+            }
+            vector<ParseMark> marks;
+            auto mark = [&](BlockEvent event)
+            {
+                marks.push_back(ParseMark{event, parser.peekToken().offset, generator.size(), generator.getTempCount(),
+                                          generator.getLabelCount(), declared.declarations().size()});
+            };
+            parser.setBlockHandler(mark);
+            parsedStatements.clear();
+            parsedBegins.clear();
+            parsedLines.clear();
+            size_t firstToken = 0;
+            try
+            {
+                // A block's statements end at a close brace, as in parseBlock
+                while (parser.peekToken().type != T_EOF && (!enclosing.block || parser.peekToken().type != T_RBRACE))
+                {
+                    marks.clear();
+                    mark(BLOCK_STATEMENT);
+                    parser.parseStatement();
+                    mark(BLOCK_STATEMENT);
+                    vector<TACInstruction> code = generator.takeInstructions();
+                    StatementCutter cutter(lexed, lexedLines, marks, code, declared.declarations(), firstToken);
+                    parsedBegins.push_back(static_cast<uint32_t>(marks[0].offset - enclosing.base));
+                    parsedLines.push_back(lexedLines[firstToken] - enclosing.line);
+                    parsedStatements.push_back(cutter.cut());
+                    firstToken = cutter.tokenAt(marks.back().offset);
+                }
+            }
+            catch (const CompileError &)
+            {
+                // Ran off the end of the region: take in more statements,
+                // twice as many each time, and past the end of a block
+                // re-parse the statement it is in
+                if (parser.errorOffset() == end && last < n)
+                {
+                    if (!lexTo(min(n, last + max<size_t>(last - first, 1))))
+                    {
+                        return ENCLOSING_LIST;
+                    }
+                    continue;
+                }
+                if (parser.errorOffset() == end && enclosing.block)
+                {
+                    return ENCLOSING_LIST;
+                }
+                throw;
+            }
+            // A close brace the edit put in ends the block early
+            if (parser.peekToken().type != T_EOF)
+            {
+                return ENCLOSING_LIST;
+            }
+            for (SymbolId name : declared.declarations())
+            {
+                parsedDeclarations.emplace_back(name, declared.get(name));
+            }
+            break;
+        }
+    }
+    catch (const CompileError &)
+    {
+        return REPARSE_FAILED;
+    }
+
+    if (!whole)
+    {
+        // Statements outside the region only see the region's declarations
+        // as a set; if that changed, they have to be checked again
+        auto key = [](SymbolId name, const Symbol &symbol)
+        { return make_tuple(name, symbol.type, symbol.length); };
+        vector<SymbolId> declaredBefore;
+        for (size_t i = first; i < last; i++)
+        {
+            collectDeclarations(*list.statements[i], declaredBefore);
+        }
+        vector<tuple<SymbolId, TokenType, int32_t>> before, after;
+        for (SymbolId name : declaredBefore)
+        {
+            before.push_back(key(name, symbols->get(name)));
+        }
+        for (const auto &declaration : parsedDeclarations)
+        {
+            after.push_back(key(declaration.first, declaration.second));
+        }
+        sort(before.begin(), before.end());
+        sort(after.begin(), after.end());
+        if (before != after)
+        {
+            return DECLARATIONS_CHANGED;
+        }
+    }
+
+    // Statements after the region, in its list and in those around it, only
+    // move; the statements holding its blocks number more or fewer
+    // temporaries and labels
+    if (last < n || enclosing.block)
+    {
+        int64_t oldEnd = last < n ? at(last) : close;
+        int lineDelta = lexedLines.back() - enclosing.line -
+                        (last < n ? list.lines[last] : enclosing.block->closeLine);
+        symbols->shiftDeclarations(static_cast<uint32_t>(oldEnd), delta);
+        for (size_t i = last; i < n; i++)
+        {
+            list.begins[i] = static_cast<uint32_t>(list.begins[i] + delta);
+            list.lines[i] += lineDelta;
+        }
+        int32_t tempDelta = 0;
+        int32_t labelDelta = 0;
+        for (size_t i = first; i < last; i++)
+        {
+            tempDelta -= list.statements[i]->temps;
+            labelDelta -= list.statements[i]->labels;
+        }
+        for (const auto &statement : parsedStatements)
+        {
+            tempDelta += statement->temps;
+            labelDelta += statement->labels;
+        }
+        for (size_t k = path.size() - 1; k > 0; k--)
+        {
+            ParsedStatement &owner = *path[k].owner;
+            size_t b = path[k].block - owner.blocks.data();
+            owner.blocks[b].close = static_cast<uint32_t>(owner.blocks[b].close + delta);
+            owner.blocks[b].closeLine += lineDelta;
+            for (size_t i = b + 1; i < owner.blocks.size(); i++)
+            {
+                owner.blocks[i].open = static_cast<uint32_t>(owner.blocks[i].open + delta);
+                owner.blocks[i].close = static_cast<uint32_t>(owner.blocks[i].close + delta);
+                owner.blocks[i].line += lineDelta;
+            }
+            for (size_t i = owner.blocks[b].tokens; i < owner.tokens.size(); i++)
+            {
+                owner.tokens[i].offset = static_cast<uint32_t>(owner.tokens[i].offset + delta);
+            }
+            owner.temps += tempDelta;
+            owner.labels += labelDelta;
+            StatementList &outer = *path[k - 1].list;
+            for (size_t i = path[k].index + 1; i < outer.begins.size(); i++)
+            {
+                outer.begins[i] = static_cast<uint32_t>(outer.begins[i] + delta);
+                outer.lines[i] += lineDelta;
+            }
+        }
+    }
+    for (const auto &declaration : parsedDeclarations)
+    {
+        const Symbol &symbol = declaration.second;
+        if (whole)
+        {
+            symbols->insert(declaration.first, symbol.type, symbol.scopeLevel, symbol.length, symbol.offset);
+        }
+        else
+        {
+            symbols->moveDeclaration(declaration.first, symbol.offset);
+        }
+    }
+    splice(list.statements, first, last, move(parsedStatements));
+    splice(list.begins, first, last, move(parsedBegins));
+    splice(list.lines, first, last, move(parsedLines));
+    return REPARSED;
+}
+
+IncrementalCompiler::IncrementalCompiler(string source, const CompileOptions &options) : state(new State())
+{
+    state->text = move(source);
+    state->options = options;
+    state->options.fromIR = false;
+    state->dirty = true;
+    state->update(true);
+}
+
+IncrementalCompiler::~IncrementalCompiler() {}
+
+bool IncrementalCompiler::edit(size_t offset, size_t length, string_view text)
+{
+    State &s = *state;
+    if (offset > s.text.size())
+    {
+        throw out_of_range("IncrementalCompiler::edit: offset past the end of the source");
+    }
+    length = min(length, s.text.size() - offset);
+    if (!s.dirty)
+    {
+        s.dirtyBegin = offset;
+        s.dirtyEnd = offset + length;
+    }
+    else
+    {
+        // Grow the dirty range to cover the edit, in base offsets
+        int64_t end = max<int64_t>(s.dirtyEnd + s.delta, offset + length);
+        s.dirtyBegin = min(s.dirtyBegin, offset);
+        s.dirtyEnd = static_cast<size_t>(end - s.delta);
+    }
+    s.dirty = true;
+    s.delta += static_cast<int64_t>(text.size()) - static_cast<int64_t>(length);
+    s.text.replace(offset, length, text);
+    return s.update(!s.parsed);
+}
+
+const string &IncrementalCompiler::source() const
+{
+    return state->text;
+}
+
+CompileResult IncrementalCompiler::result() const
+{
+    const State &s = *state;
+    if (!s.parsed || s.dirty)
+    {
+        return compile(s.text, s.options);
+    }
+    return collectResult([&](CompileResult &result, ostream &out, ostream &log)
+                         {
+        vector<Token> sourceTokens;
+        vector<TACInstruction> code;
+        int32_t temps = 0;
+        int32_t labels = 0;
+        flatten(s.program, 0, temps, labels, sourceTokens, code);
+
+        // Spellings are interned again in source order so that every name
+        // gets the id compile() would give it
+        StringInterner interner;
+        vector<SymbolId> ids(s.interner->size(), NO_SYMBOL);
+        TokenStream tokens(interner);
+        for (Token token : sourceTokens)
+        {
+            if (token.id != NO_SYMBOL)
+            {
+                if (ids[token.id] == NO_SYMBOL)
+                {
+                    ids[token.id] = interner.intern(s.interner->text(token.id));
+                }
+                token.id = ids[token.id];
+            }
+            tokens.push(token.type, token.offset, token.id);
+        }
+        tokens.push(T_EOF, static_cast<uint32_t>(s.text.size()), NO_SYMBOL);
+
+        Lexer lexer(s.text, interner);
+        if (!s.options.streamTokens)
+        {
+            if (s.options.recordTokens)
+            {
+                TokenRecorder recorder(s.text, lexer, result.tokens);
+                result.tokens.reserve(tokens.size());
+                for (size_t i = 0; i < tokens.size(); i++)
+                {
+                    recorder.record(tokens[i]);
+                }
+            }
+            lexer.printTokens(out, tokens);
+        }
+        out << "Parsing completed successfully! No Syntax Error" << endl;
+
+        SymbolTable symbols(interner);
+        for (SymbolId name : s.symbols->declarations())
+        {
+            const Symbol &symbol = s.symbols->get(name);
+            symbols.insert(ids[name], symbol.type, symbol.scopeLevel, symbol.length, symbol.offset);
+        }
+        for (TACInstruction &instr : code)
+        {
+            relocate(instr, 0, 0, &ids);
+            // Only assignments write variables and arrays
+            if (instr.result.kind == OPERAND_VAR || instr.op == OP_STORE)
+            {
+                symbols.markInitialized(instr.result.value);
+            }
+        }
+
+        result.symbols = symbols.records();
+        SymbolTable::printTable(out, result.symbols);
+        if (s.options.emitIR)
+        {
+            result.ir = encodeIR(interner, symbols, code);
+            return;
+        }
+        compileBackend(interner, code, s.options, result, out, log, true); },
+                         nullptr);
+}
+
+
+bool isKeyword(string_view word)
+{
+    return classifyKeyword(word) != T_ID;
+}
+
+ExecutionResult execute(string_view source, const CompileOptions &options, uint64_t instructionLimit)
+{
+    ExecutionResult execution;
+    try
+    {
+        StringInterner interner;
+        Lexer lexer(source, interner);
+        Parser parser(lexer, lexer);
+        parser.parseProgram();
+
+        vector<TACInstruction> &code = parser.getTACGenerator().getInstructions();
+        PassManager passes(options.optLevel, options.vectorISA);
+        passes.run(code);
+        CodeGenerator codeGen(interner, options.optLevel >= 1, options.vectorISA);
+        AsmBuffer assembly;
+        codeGen.translate(code, assembly);
+
+        const SymbolTable &symbols = parser.getSymbolTable();
+        X86Simulator simulator(codeGen.instructions(), symbols);
+        execution.success = simulator.run(instructionLimit, execution.executed, execution.vectorExecuted);
+
+        // Variables the program never touched read as zero
+        const map<int32_t, vector<int32_t>> &memory = simulator.finalMemory();
+        for (const auto &entry : symbols.entries())
+        {
+            auto cells = memory.find(static_cast<int32_t>(entry.first));
+            execution.memory[string(interner.text(entry.first))] =
+                cells != memory.end() ? cells->second : vector<int32_t>(symbols.storageSize(entry.first), 0);
+        }
+    }
+    catch (const CompileError &error)
+    {
+        execution.diagnostics.push_back(Diagnostic{error.kind(), error.line(), error.what()});
+    }
+    return execution;
 }
@@ -0,0 +1,176 @@
+// The compiler as a library. compile() runs every phase on a source buffer
+// and returns what each produced. It keeps no state between calls, so any
+// number of threads may compile at once.
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum VectorISA : uint8_t
+{
+    VECTOR_SSE,  // xmm, 4 ints per register (pmulld is SSE4.1)
+    VECTOR_AVX2, // ymm, 8 ints per register
+};
+
+struct CompileOptions
+{
+    bool streamTokens; // Parse while lexing; no token listing
+    bool pipelined;    // Run the phases on separate threads
+    int optLevel;      // 0 = no TAC optimization
+    bool printStats;   // Collect optimization statistics
+    bool dumpCFG;      // List the control-flow graph and loops after the TAC
+    bool dumpSSA;      // List the TAC in SSA form after the TAC
+    VectorISA vectorISA; // Vector registers -O2 loop vectorization targets
+    bool emitIR;         // Stop after the front end and return its output as binary IR
+    bool fromIR;         // The input is binary IR from emitIR; only the backend runs
+    bool recordTokens;   // Fill CompileResult::tokens, which costs far more memory than the source
+
+    CompileOptions()
+        : streamTokens(false), pipelined(false), optLevel(0), printStats(false), dumpCFG(false), dumpSSA(false),
+          vectorISA(VECTOR_SSE), emitIR(false), fromIR(false), recordTokens(false) {}
+};
+
+enum DiagnosticKind : uint8_t
+{
+    DIAGNOSTIC_INPUT,    // The source cannot be read
+    DIAGNOSTIC_LEXICAL,  // A character or string the lexer rejects
+    DIAGNOSTIC_SYNTAX,   // A token the grammar does not allow there
+    DIAGNOSTIC_SEMANTIC, // Undeclared or redefined variables, array misuse, literals out of range
+};
+
+struct Diagnostic
+{
+    DiagnosticKind kind;
+    int line;            // 0 if the error is not tied to a line
+    std::string message; // As the command-line compiler prints it
+};
+
+struct TokenRecord
+{
+    std::string type; // As in the token listing, e.g. "T_ID"
+    std::string text;
+    int line;
+};
+
+struct SymbolRecord
+{
+    std::string name;
+    std::string type; // Element type for arrays
+    int32_t length;   // Array length, 0 for scalars
+    int scope;
+    bool initialized;
+};
+
+struct CompileResult
+{
+    bool success;
+    std::vector<TokenRecord> tokens;     // With recordTokens, unless streamTokens
+    std::vector<SymbolRecord> symbols;   // Sorted by name
+    std::string tac;                     // After optimization, one instruction per line
+    std::string assembly;
+    std::vector<Diagnostic> diagnostics; // The error that stopped compilation, if any
+    std::string listing;                 // What the command-line compiler prints, up to any error
+    std::string statistics;              // With printStats
+    std::string ir;                      // With emitIR
+
+    CompileResult() : success(false) {}
+};
+
+CompileResult compile(std::string_view source, const CompileOptions &options);
+
+// compile() on the contents of the file at `path`
+CompileResult compileFile(const std::string &path, const CompileOptions &options);
+
+// As above, but the listing is written to `listing` as the phases produce
+// it. The result's listing, tac and assembly stay empty, so the output is
+// never held in memory whole.
+CompileResult compile(std::string_view source, const CompileOptions &options, std::ostream &listing);
+CompileResult compileFile(const std::string &path, const CompileOptions &options, std::ostream &listing);
+
+// What the command-line compiler prints on stdout for a result: the listing,
+// then the error if there was one
+std::string report(const CompileResult &result);
+
+// Layout of the binary IR that emitIR writes, for tools that inspect or
+// repair it. The header holds the instruction count and a checksum of
+// everything after it; the TAC records come last in the file, each with
+// its result and two arguments at IR_OPERAND_OFFSETS. An operand is a kind
+// byte and then, at IR_OPERAND_VALUE_OFFSET, its int32_t value. See
+// compiler.cpp for the rest of the format.
+const size_t IR_HEADER_BYTES = 48;
+const size_t IR_INSTRUCTION_COUNT_OFFSET = 24; // uint64_t
+const size_t IR_CHECKSUM_OFFSET = 40;          // uint64_t
+const size_t IR_INSTRUCTION_BYTES = 28;
+constexpr size_t IR_OPERAND_OFFSETS[3] = {4, 12, 20};
+const size_t IR_OPERAND_VALUE_OFFSET = 4;
+
+// The checksum a header stores, given the bytes after the header
+uint64_t irChecksum(std::string_view bytes);
+
+// A source kept in memory across edits, for an editor that wants results as
+// the user types. The front end's output is kept per statement: its tokens,
+// its TAC and the variables it declares, with the statements of each block
+// kept apart, inside the statement the block belongs to. An edit is handled
+// in the innermost block that holds all of it, or at top level. It re-lexes
+// from the statement there it starts in until the lexer lands back on the
+// start of an unchanged statement, or on the block's close brace, and
+// re-parses only that run of statements, widening it while the parse runs
+// off its end (an unclosed block or a dangling else). If the run needs more
+// than the rest of the block, or a brace it gained closes the block early,
+// the statement holding the block is re-parsed instead, the same way. The
+// new statements are spliced in and those after them, in the block and
+// around it, keep their results, moved by the change in length. Only when
+// the run declares a different set of variables is the whole source parsed
+// again.
+//
+// The optimizer and code generator work on whole programs, so they run on
+// demand in result(). Sources are always program text; fromIR is ignored.
+class IncrementalCompiler
+{
+public:
+    IncrementalCompiler(std::string source, const CompileOptions &options);
+    ~IncrementalCompiler();
+
+    // Replaces `length` bytes at `offset` with `text`. Returns whether the
+    // edited source gets through the front end; if not, result() has the
+    // error and the next edits re-parse the unfinished region along with
+    // their own. Throws std::out_of_range if offset is past the end.
+    bool edit(size_t offset, size_t length, std::string_view text);
+
+    const std::string &source() const;
+
+    // What compile() returns for source()
+    CompileResult result() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// Whether `word` is one of the language's keywords, as the lexer decides it
+bool isKeyword(std::string_view word);
+
+struct ExecutionResult
+{
+    bool success;                        // False if compilation failed or the program faulted or ran too long
+    std::vector<Diagnostic> diagnostics; // The compile error, if any
+    uint64_t executed;                   // Instructions run, labels excluded
+    uint64_t vectorExecuted;             // The vector ones among them
+    std::map<std::string, std::vector<int32_t>> memory; // Final value of every variable, by name
+
+    ExecutionResult() : success(false), executed(0), vectorExecuted(0) {}
+};
+
+// Compiles program text and runs the generated x86 on the built-in
+// simulator for at most `instructionLimit` instructions. The listing options
+// and fromIR are ignored.
+ExecutionResult execute(std::string_view source, const CompileOptions &options, uint64_t instructionLimit);
+
+#endif
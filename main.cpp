@@ -0,0 +1,711 @@
+// Command-line front end to the compiler library in compiler.cpp
+#include "compiler.h"
+#include "server.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cctype>
+#include <cstring>
+
+using namespace std;
+
+// Appends the paths listed in a response file, one per line, to inputs.
+// Blank lines are skipped. False if the file cannot be read.
+bool readResponseFile(const char *path, vector<string> &inputs)
+{
+    ifstream file(path);
+    if (!file)
+    {
+        return false;
+    }
+    string line;
+    while (getline(file, line))
+    {
+        size_t begin = line.find_first_not_of(" \t\r");
+        size_t end = line.find_last_not_of(" \t\r");
+        if (begin != string::npos)
+        {
+            inputs.push_back(line.substr(begin, end - begin + 1));
+        }
+    }
+    return true;
+}
+
+// Fixed set of worker threads, each with its own deque of tasks. A worker
+// takes from the front of its own deque and, once that is empty, steals
+// from the back of the others', so a few slow tasks do not leave the rest
+// of the workers idle. Tasks are dealt out round-robin, which keeps the
+// earliest ones at the fronts and so finishing roughly in order.
+class WorkStealingPool
+{
+private:
+    struct WorkQueue
+    {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    size_t workerCount;
+    vector<WorkQueue> queues;
+    atomic<size_t> steals;
+
+    bool takeOwn(size_t worker, size_t &task)
+    {
+        lock_guard<mutex> guard(queues[worker].lock);
+        if (queues[worker].tasks.empty())
+        {
+            return false;
+        }
+        task = queues[worker].tasks.front();
+        queues[worker].tasks.pop_front();
+        return true;
+    }
+
+    bool steal(size_t thief, size_t &task)
+    {
+        for (size_t k = 1; k < workerCount; k++)
+        {
+            WorkQueue &victim = queues[(thief + k) % workerCount];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    explicit WorkStealingPool(size_t workers)
+        : workerCount(max<size_t>(workers, 1)), queues(workerCount), steals(0) {}
+
+    // Runs task(i) for every i below taskCount and returns when all are done.
+    // No task is added while they run, so a worker that finds every deque
+    // empty can stop.
+    void run(size_t taskCount, const function<void(size_t)> &task)
+    {
+        for (size_t i = 0; i < taskCount; i++)
+        {
+            queues[i % workerCount].tasks.push_back(i);
+        }
+        vector<thread> workers;
+        for (size_t w = 0; w < workerCount; w++)
+        {
+            workers.emplace_back([this, w, &task]()
+                                 {
+                size_t next;
+                while (takeOwn(w, next) || steal(w, next))
+                {
+                    task(next);
+                } });
+        }
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t stealCount() const
+    {
+        return steals;
+    }
+};
+
+// Compiles every input on a work-stealing pool of `jobs` threads. Each file
+// gets its own interner, lexer, parser, passes and code generator. What it
+// prints is buffered and written to `out` in input order, under a
+// "==> path <==" header, as soon as every file before it is done, so the
+// output does not depend on scheduling. A file that fails is reported and
+// the rest still compile. Returns the number of files that failed.
+size_t compileBatch(const vector<string> &inputs, const CompileOptions &options, size_t jobs, ostream &out,
+                    ostream &log)
+{
+    struct UnitResult
+    {
+        string output;
+        string statistics;
+        bool failed;
+        bool done;
+    };
+    vector<UnitResult> results(inputs.size(), UnitResult{string(), string(), false, false});
+    mutex resultLock;
+    condition_variable resultReady;
+
+    thread writer([&]()
+                  {
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            unique_lock<mutex> guard(resultLock);
+            resultReady.wait(guard, [&]()
+                             { return results[i].done; });
+            guard.unlock();
+            out << "==> " << inputs[i] << " <==" << endl
+                << results[i].output;
+            log << results[i].statistics;
+            string().swap(results[i].output);
+        } });
+
+    WorkStealingPool pool(jobs);
+    pool.run(inputs.size(), [&](size_t i)
+             {
+        CompileResult result = compileFile(inputs[i], options);
+        {
+            lock_guard<mutex> guard(resultLock);
+            results[i] = UnitResult{report(result), move(result.statistics), !result.success, true};
+        }
+        resultReady.notify_all(); });
+    writer.join();
+    out.flush();
+
+    size_t failures = 0;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (results[i].failed)
+        {
+            log << "  failed: " << inputs[i] << endl;
+            failures++;
+        }
+    }
+    log << "batch: " << inputs.size() << " files, " << failures << " failed";
+    if (options.printStats)
+    {
+        log << ", " << max<size_t>(jobs, 1) << " threads, " << pool.stealCount() << " tasks stolen";
+    }
+    log << endl;
+    return failures;
+}
+
+// Times a batch on one thread and on every hardware thread, with output
+// captured, and checks that both produce the same bytes
+void runBatchBenchmark(const vector<string> &inputs)
+{
+    size_t threads = max(thread::hardware_concurrency(), 1u);
+    ostringstream serialOut, parallelOut, log;
+
+    auto begin = chrono::steady_clock::now();
+    compileBatch(inputs, CompileOptions(), 1, serialOut, log);
+    chrono::duration<double> serialTime = chrono::steady_clock::now() - begin;
+
+    begin = chrono::steady_clock::now();
+    compileBatch(inputs, CompileOptions(), threads, parallelOut, log);
+    chrono::duration<double> parallelTime = chrono::steady_clock::now() - begin;
+
+    cout << "Batch benchmark on " << inputs.size() << " files" << endl;
+    cout << "  1 thread:   " << serialTime.count() << " s" << endl;
+    cout << "  " << threads << " threads: " << parallelTime.count() << " s" << endl;
+    cout << "  speedup:    " << serialTime.count() / parallelTime.count() << "x" << endl;
+    cout << "  output:     " << (serialOut.str() == parallelOut.str() ? "identical" : "DIFFERENT") << endl;
+}
+
+// Reads the whole file at `path` into `contents`, printing an error if it
+// cannot be read
+bool readSource(const char *path, string &contents)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        cout << "Error: Cannot open file " << path << endl;
+        return false;
+    }
+    ostringstream buffer;
+    buffer << file.rdbuf();
+    contents = buffer.str();
+    return true;
+}
+
+// Times both modes on one file and checks that they produce the same bytes
+void runPipelineBenchmark(const char *path)
+{
+    string source;
+    if (!readSource(path, source))
+    {
+        return;
+    }
+
+    CompileOptions pipelined;
+    pipelined.pipelined = true;
+    auto begin = chrono::steady_clock::now();
+    CompileResult sequentialResult = compile(source, CompileOptions());
+    chrono::duration<double> sequentialTime = chrono::steady_clock::now() - begin;
+
+    begin = chrono::steady_clock::now();
+    CompileResult pipelinedResult = compile(source, pipelined);
+    chrono::duration<double> pipelinedTime = chrono::steady_clock::now() - begin;
+
+    if (!sequentialResult.success)
+    {
+        cout << sequentialResult.diagnostics[0].message << endl;
+        return;
+    }
+
+    cout << "Pipeline benchmark on " << path << " (" << source.size() << " bytes, "
+         << thread::hardware_concurrency() << " hardware threads)" << endl;
+    cout << "  sequential: " << sequentialTime.count() << " s" << endl;
+    cout << "  pipelined:  " << pipelinedTime.count() << " s" << endl;
+    cout << "  speedup:    " << sequentialTime.count() / pipelinedTime.count() << "x" << endl;
+    cout << "  output:     " << (sequentialResult.listing == pipelinedResult.listing ? "identical" : "DIFFERENT") << endl;
+}
+
+// Compiles a file without vectorization and vectorized for SSE and for
+// AVX2, runs all three on the simulator and compares what they execute
+void runVectorBenchmark(const char *path)
+{
+    string source;
+    if (!readSource(path, source))
+    {
+        return;
+    }
+
+    struct Variant
+    {
+        const char *name;
+        int optLevel;
+        VectorISA isa;
+    };
+    const Variant variants[] = {{"scalar", 1, VECTOR_SSE}, {"sse", 2, VECTOR_SSE}, {"avx2", 2, VECTOR_AVX2}};
+    const uint64_t limit = 1000000000;
+
+    cout << "Vectorization benchmark on " << path << endl;
+    ExecutionResult scalar;
+    bool identical = true;
+    for (const Variant &variant : variants)
+    {
+        CompileOptions options;
+        options.optLevel = variant.optLevel;
+        options.vectorISA = variant.isa;
+        ExecutionResult execution = execute(source, options, limit);
+        if (!execution.diagnostics.empty())
+        {
+            cout << execution.diagnostics[0].message << endl;
+            return;
+        }
+        if (!execution.success)
+        {
+            cout << "  " << variant.name << ": faulted or ran past " << limit << " instructions" << endl;
+            return;
+        }
+        if (variant.optLevel == 1)
+        {
+            scalar = execution;
+        }
+        identical = identical && execution.memory == scalar.memory;
+        cout << "  " << variant.name << ": " << execution.executed << " instructions executed ("
+             << execution.vectorExecuted << " vector), speedup "
+             << static_cast<double>(scalar.executed) / execution.executed << "x" << endl;
+    }
+    cout << "  results: " << (identical ? "identical" : "DIFFERENT") << endl;
+}
+
+// Changes the integer literals of a file one digit at a time through
+// IncrementalCompiler and back again, timing each edit, and checks the
+// results along the way against compiling the edited source from scratch
+void runIncrementalBenchmark(const char *path)
+{
+    string text;
+    if (!readSource(path, text))
+    {
+        return;
+    }
+
+    auto begin = chrono::steady_clock::now();
+    CompileResult full = compile(text, CompileOptions());
+    chrono::duration<double> fullTime = chrono::steady_clock::now() - begin;
+    if (!full.success)
+    {
+        cout << full.diagnostics[0].message << endl;
+        return;
+    }
+
+    // First digit of every literal, sampled evenly down to at most 500
+    vector<size_t> digits;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        if (isdigit(static_cast<unsigned char>(text[i])) && (i == 0 || !isalnum(static_cast<unsigned char>(text[i - 1]))))
+        {
+            digits.push_back(i);
+        }
+    }
+    size_t stride = digits.size() / 500 + 1;
+
+    begin = chrono::steady_clock::now();
+    IncrementalCompiler compiler{text, CompileOptions()};
+    chrono::duration<double> setupTime = chrono::steady_clock::now() - begin;
+
+    size_t edits = 0;
+    size_t rejected = 0;
+    double totalTime = 0;
+    double worstTime = 0;
+    bool identical = true;
+    auto timeEdit = [&](size_t offset, char digit)
+    {
+        auto start = chrono::steady_clock::now();
+        bool accepted = compiler.edit(offset, 1, string_view(&digit, 1));
+        chrono::duration<double> time = chrono::steady_clock::now() - start;
+        edits++;
+        rejected += accepted ? 0 : 1;
+        totalTime += time.count();
+        worstTime = max(worstTime, time.count());
+    };
+    for (size_t i = 0; i < digits.size(); i += stride)
+    {
+        char original = text[digits[i]];
+        timeEdit(digits[i], original == '9' ? '1' : original + 1);
+        if (i % (stride * 50) == 0)
+        {
+            identical = identical && compiler.result().listing == compile(compiler.source(), CompileOptions()).listing;
+        }
+        timeEdit(digits[i], original);
+    }
+    identical = identical && compiler.source() == text && compiler.result().listing == full.listing;
+
+    cout << "Incremental benchmark on " << path << " (" << text.size() << " bytes)" << endl;
+    cout << "  compile():        " << fullTime.count() * 1e3 << " ms" << endl;
+    cout << "  first parse:      " << setupTime.count() * 1e3 << " ms" << endl;
+    cout << "  one-digit edits:  " << edits << " (" << rejected << " left the source with an error)" << endl;
+    cout << "  mean edit:        " << (edits ? totalTime / edits * 1e6 : 0) << " us" << endl;
+    cout << "  slowest edit:     " << worstTime * 1e6 << " us" << endl;
+    cout << "  output:           " << (identical ? "identical" : "DIFFERENT") << endl;
+}
+
+// Starts a server on a socket of its own, sends it the same file a number
+// of times and compares the first, compiled, reply and the cached ones with
+// a local compile
+void runServeBenchmark(const char *path)
+{
+    string source;
+    if (!readSource(path, source))
+    {
+        return;
+    }
+
+    string socketPath =
+        "/tmp/compiler-bench-" + to_string(chrono::steady_clock::now().time_since_epoch().count()) + ".sock";
+    CompileServer server(size_t(64) << 20, 1);
+    if (!server.listen(socketPath))
+    {
+        return;
+    }
+    thread serving([&server]()
+                   { server.serve(); });
+
+    const int rounds = 1000;
+    auto begin = chrono::steady_clock::now();
+    string expected = encodeReply(compile(source, CompileOptions()));
+    chrono::duration<double, micro> localTime = chrono::steady_clock::now() - begin;
+
+    string request = encodeRequest(source, CompileOptions());
+    string firstReply, reply;
+    begin = chrono::steady_clock::now();
+    bool answered = sendRequest(socketPath, request, firstReply);
+    chrono::duration<double, micro> firstTime = chrono::steady_clock::now() - begin;
+
+    bool identical = answered && firstReply == expected;
+    begin = chrono::steady_clock::now();
+    for (int i = 0; i < rounds && answered; i++)
+    {
+        answered = sendRequest(socketPath, request, reply);
+        identical = identical && reply == expected;
+    }
+    chrono::duration<double, micro> cachedTime = (chrono::steady_clock::now() - begin) / rounds;
+    server.stop();
+    serving.join();
+
+    if (!answered)
+    {
+        cout << "Error: No reply from the compile server" << endl;
+        return;
+    }
+    cout << "Compile server benchmark on " << path << " (" << source.size() << " bytes)" << endl;
+    cout << "  local compile:    " << localTime.count() << " us" << endl;
+    cout << "  first request:    " << firstTime.count() << " us (compiled and cached)" << endl;
+    cout << "  repeated request: " << cachedTime.count() << " us (from the cache, average of " << rounds << ")"
+         << endl;
+    cout << "  speedup:          " << localTime.count() / cachedTime.count() << "x over a local compile" << endl;
+    cout << "  output:           " << (identical ? "identical" : "DIFFERENT") << endl;
+    cout << "  ";
+    server.printCacheStats(cout);
+}
+
+// Keyword test as the lexer did it before the hashed table, kept as the
+// baseline for runKeywordBenchmark
+bool isKeywordByCompare(string_view word)
+{
+    return word == "int" || word == "float" || word == "double" || word == "string" || word == "bool" ||
+           word == "char" || word == "if" || word == "else" || word == "return" || word == "while" ||
+           word == "for";
+}
+
+// Both classifiers are called through a pointer so neither is inlined into
+// the loop and the other not
+double timeClassifier(const vector<string_view> &words, int rounds, bool (*classify)(string_view),
+                      size_t &checksum)
+{
+    auto begin = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (string_view word : words)
+        {
+            checksum += classify(word);
+        }
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - begin;
+    return elapsed.count() / (double(words.size()) * rounds);
+}
+
+// Classifies a cache-resident, identifier-heavy word list (about one keyword in eight, many
+// identifiers sharing a prefix or length with a keyword) with both methods
+void runKeywordBenchmark()
+{
+    const char *keywords[] = {"int", "float", "double", "string", "bool", "char",
+                              "if", "else", "return", "while", "for"};
+    const char *identifiers[] = {"x", "y", "i", "sum", "count", "index", "integer", "floaty", "doubles",
+                                 "strings", "boolean", "chars", "iff", "elsewhere", "returned", "whiles",
+                                 "form", "total", "value", "result", "temp", "f", "in", "do"};
+    const size_t identifierCount = sizeof(identifiers) / sizeof(identifiers[0]);
+    const size_t keywordCount = sizeof(keywords) / sizeof(keywords[0]);
+
+    vector<string_view> words;
+    uint32_t seed = 12345;
+    for (int i = 0; i < 4096; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t pick = seed >> 8;
+        if (pick % 8 == 0)
+            words.push_back(keywords[pick / 8 % keywordCount]);
+        else
+            words.push_back(identifiers[pick / 8 % identifierCount]);
+    }
+
+    const int rounds = 5000;
+    size_t checksumCompare = 0, checksumHash = 0;
+    double compareNs = timeClassifier(words, rounds, isKeywordByCompare, checksumCompare);
+    double hashNs = timeClassifier(words, rounds, isKeyword, checksumHash);
+
+    cout << "Keyword classification, " << words.size() << " words x " << rounds << " rounds" << endl;
+    cout << "  string compares: " << compareNs << " ns/word" << endl;
+    cout << "  perfect hash:    " << hashNs << " ns/word" << endl;
+    cout << "  speedup:         " << compareNs / hashNs << "x" << endl;
+    if (checksumCompare != checksumHash)
+    {
+        cout << "Error: classifiers disagree" << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && string(argv[1]) == "--bench-keywords")
+    {
+        runKeywordBenchmark();
+        return 0;
+    }
+    if (argc == 3 && string(argv[1]) == "--bench-pipeline")
+    {
+        runPipelineBenchmark(argv[2]);
+        return 0;
+    }
+    if (argc == 3 && string(argv[1]) == "--bench-vectorize")
+    {
+        runVectorBenchmark(argv[2]);
+        return 0;
+    }
+    if (argc == 3 && string(argv[1]) == "--bench-serve")
+    {
+        runServeBenchmark(argv[2]);
+        return 0;
+    }
+    if (argc == 3 && string(argv[1]) == "--bench-incremental")
+    {
+        runIncrementalBenchmark(argv[2]);
+        return 0;
+    }
+
+    vector<string> inputs;
+    bool batch = false;
+    bool benchBatch = false;
+    size_t jobs = thread::hardware_concurrency();
+    string serveSocket;
+    string connectSocket;
+    string irOutput;
+    size_t cacheMegabytes = 256;
+    bool usage = false;
+    CompileOptions options;
+    for (int i = 1; i < argc && !usage; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--stream")
+        {
+            options.streamTokens = true;
+        }
+        else if (arg == "--pipeline")
+        {
+            options.pipelined = true;
+        }
+        else if (arg == "--stats")
+        {
+            options.printStats = true;
+        }
+        else if (arg == "--dump-cfg")
+        {
+            options.dumpCFG = true;
+        }
+        else if (arg == "--dump-ssa")
+        {
+            options.dumpSSA = true;
+        }
+        else if (arg == "--avx2")
+        {
+            options.vectorISA = VECTOR_AVX2;
+        }
+        else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '2')
+        {
+            options.optLevel = arg[2] - '0';
+        }
+        else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            jobs = atoi(argv[++i]);
+        }
+        else if (arg == "--emit-ir" && i + 1 < argc)
+        {
+            irOutput = argv[++i];
+            options.emitIR = true;
+        }
+        else if (arg == "--from-ir")
+        {
+            options.fromIR = true;
+        }
+        else if (arg == "--serve" && i + 1 < argc)
+        {
+            serveSocket = argv[++i];
+        }
+        else if (arg == "--connect" && i + 1 < argc)
+        {
+            connectSocket = argv[++i];
+        }
+        else if (arg == "--cache-mb" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            cacheMegabytes = atoi(argv[++i]);
+        }
+        else if (arg == "--bench-batch")
+        {
+            benchBatch = true;
+        }
+        else if (arg[0] == '@')
+        {
+            batch = true;
+            if (!readResponseFile(argv[i] + 1, inputs))
+            {
+                cout << "Error: Cannot open response file " << argv[i] + 1 << endl;
+                return 1;
+            }
+        }
+        else if (arg[0] != '-')
+        {
+            inputs.push_back(arg);
+        }
+        else
+        {
+            usage = true;
+        }
+    }
+
+    if (!serveSocket.empty() && (!inputs.empty() || !connectSocket.empty()))
+    {
+        usage = true;
+    }
+    if (!connectSocket.empty() && (batch || benchBatch || inputs.size() != 1 || options.emitIR))
+    {
+        usage = true;
+    }
+    if (options.emitIR && (batch || benchBatch || inputs.size() != 1 || options.fromIR))
+    {
+        usage = true;
+    }
+    if (usage || (inputs.empty() && serveSocket.empty()))
+    {
+        cout << "Usage: " << argv[0] << " [-O0|-O1|-O2] [--stats] [--dump-cfg] [--dump-ssa] [--avx2] [--stream] [--pipeline]" << endl;
+        cout << "           [--from-ir] [-j <n>] <source-file>... | @<response-file>" << endl;
+        cout << "       " << argv[0] << " [--stream] --emit-ir <ir-file> <source-file>" << endl;
+        cout << "       " << argv[0] << " --bench-keywords" << endl;
+        cout << "       " << argv[0] << " --bench-pipeline <source-file>" << endl;
+        cout << "       " << argv[0] << " --bench-vectorize <source-file>" << endl;
+        cout << "       " << argv[0] << " --serve <socket> [--cache-mb <n>] [-j <n>]" << endl;
+        cout << "       " << argv[0] << " [options] --connect <socket> <source-file>" << endl;
+        cout << "       " << argv[0] << " --bench-batch <source-file>... | @<response-file>" << endl;
+        cout << "       " << argv[0] << " --bench-serve <source-file>" << endl;
+        cout << "       " << argv[0] << " --bench-incremental <source-file>" << endl;
+        cout << "  Given more than one source file, or a response file listing one per line," << endl;
+        cout << "  compiles them all in parallel and prints each one's output in order after a" << endl;
+        cout << "  \"==> file <==\" line; failures are listed on stderr." << endl;
+        cout << "  --serve     answer compile requests on a Unix socket until killed, from a cache" << endl;
+        cout << "              of earlier replies when the source and options are the same" << endl;
+        cout << "  --cache-mb  memory for the server's cache; least recently used go first (default 256)" << endl;
+        cout << "  --connect   have the server on <socket> compile the file; prints what a local" << endl;
+        cout << "              compile would" << endl;
+        cout << "  -j <n>      threads for a batch, or workers for --serve (default: one per hardware" << endl;
+        cout << "              thread)" << endl;
+        cout << "  --stream    parse while lexing instead of tokenizing the whole file first" << endl;
+        cout << "              (skips the token listing)" << endl;
+        cout << "  --pipeline  run lexer, parser and code generator on separate threads" << endl;
+        cout << "  --emit-ir   stop after parsing and write the symbol table and unoptimized TAC" << endl;
+        cout << "              to <ir-file> in the binary IR format" << endl;
+        cout << "  --from-ir   the inputs are IR files from --emit-ir: only optimize and generate code" << endl;
+        cout << "  -O<n>       TAC optimization level (default 0)" << endl;
+        cout << "              -O1: constant folding and propagation, sparse conditional constant" << endl;
+        cout << "                   propagation over SSA, branch folding, copy propagation," << endl;
+        cout << "                   loop-invariant code motion, strength reduction, value numbering," << endl;
+        cout << "                   dead code elimination, tree-tiling instruction selection," << endl;
+        cout << "                   assembly peephole" << endl;
+        cout << "              -O2: -O1 plus vectorization of counted loops over int arrays" << endl;
+        cout << "  --avx2      vectorize for 8-lane ymm registers instead of 4-lane xmm (SSE4.1)" << endl;
+        cout << "  --stats     print optimization statistics to stderr" << endl;
+        cout << "  --dump-cfg  print the control-flow graph and its loops after the TAC" << endl;
+        cout << "  --dump-ssa  print the TAC in SSA form, with phi nodes, after the TAC" << endl;
+        return 1;
+    }
+
+    if (!serveSocket.empty())
+    {
+        return runServer(serveSocket, cacheMegabytes << 20, jobs) ? 0 : 1;
+    }
+    if (!connectSocket.empty())
+    {
+        return runClient(connectSocket, inputs[0], options);
+    }
+    if (benchBatch)
+    {
+        runBatchBenchmark(inputs);
+        return 0;
+    }
+    if (batch || inputs.size() > 1)
+    {
+        return compileBatch(inputs, options, jobs, cout, cerr) == 0 ? 0 : 1;
+    }
+    // The listing goes straight to stdout; report() then adds only the error
+    CompileResult result = compileFile(inputs[0], options, cout);
+    cout << report(result);
+    cerr << result.statistics;
+    if (result.success && options.emitIR)
+    {
+        ofstream ir(irOutput, ios::binary);
+        if (!ir.write(result.ir.data(), result.ir.size()) || !ir.flush())
+        {
+            cout << "Error: Cannot write IR file " << irOutput << endl;
+            return 1;
+        }
+    }
+    return result.success ? 0 : 1;
+}
@@ -0,0 +1,587 @@
+#include "server.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <list>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+using namespace std;
+
+namespace
+{
+
+// A request is the options in OPTION_BYTES, then the source. A reply is a
+// success byte, the stdout text's length as a uint64_t, the stdout text and
+// the stderr text. Each travels as a uint64_t length and then its bytes, in
+// host byte order: both ends are on the same machine.
+const size_t OPTION_BYTES = 8;
+const size_t REPLY_HEADER_BYTES = 1 + sizeof(uint64_t);
+// A client that stalls this long while sending its request or taking the
+// reply is dropped, so it cannot keep a worker from the others
+const int SOCKET_TIMEOUT_SECONDS = 10;
+
+CompileOptions decodeOptions(string_view request)
+{
+    CompileOptions options;
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(request.data());
+    options.optLevel = min<int>(bytes[0], 2);
+    options.streamTokens = bytes[1] != 0;
+    options.pipelined = bytes[2] != 0;
+    options.printStats = bytes[3] != 0;
+    options.dumpCFG = bytes[4] != 0;
+    options.dumpSSA = bytes[5] != 0;
+    options.vectorISA = bytes[6] == VECTOR_AVX2 ? VECTOR_AVX2 : VECTOR_SSE;
+    options.fromIR = bytes[7] != 0;
+    return options;
+}
+
+bool decodeReply(const string &reply, bool &success, string_view &output, string_view &statistics)
+{
+    uint64_t outputLength;
+    if (reply.size() < REPLY_HEADER_BYTES)
+    {
+        return false;
+    }
+    memcpy(&outputLength, &reply[1], sizeof(outputLength));
+    if (outputLength > reply.size() - REPLY_HEADER_BYTES)
+    {
+        return false;
+    }
+    success = reply[0] != 0;
+    output = string_view(reply).substr(REPLY_HEADER_BYTES, outputLength);
+    statistics = string_view(reply).substr(REPLY_HEADER_BYTES + outputLength);
+    return true;
+}
+
+// Encoded replies by request, least recently used evicted first once they
+// take more than `budget` bytes. A hit compares the whole request, source
+// bytes and all, so two sources whose hashes collide never share a reply.
+class CompileCache
+{
+private:
+    struct Entry
+    {
+        string request;
+        shared_ptr<const string> reply;
+        size_t bytes;
+    };
+
+    // Roughly what an entry costs beyond its strings: the list and map nodes
+    static const size_t ENTRY_OVERHEAD = sizeof(Entry) + 64;
+
+    size_t budget;
+    size_t used;
+    list<Entry> entries;                                     // Most recently used first
+    unordered_map<string_view, list<Entry>::iterator> index; // Keys view Entry::request
+    mutable mutex lock;
+    size_t hits;
+    size_t misses;
+
+public:
+    explicit CompileCache(size_t budget) : budget(budget), used(0), hits(0), misses(0) {}
+
+    // The reply to `request`, or null if it is not cached
+    shared_ptr<const string> lookup(string_view request)
+    {
+        lock_guard<mutex> guard(lock);
+        auto found = index.find(request);
+        if (found == index.end())
+        {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, found->second);
+        return found->second->reply;
+    }
+
+    // Replies bigger than the whole budget are not kept. A request another
+    // thread has already inserted keeps its first reply.
+    void insert(string request, shared_ptr<const string> reply)
+    {
+        size_t bytes = request.size() + reply->size() + ENTRY_OVERHEAD;
+        lock_guard<mutex> guard(lock);
+        if (bytes > budget || index.count(request) != 0)
+        {
+            return;
+        }
+        entries.push_front(Entry{move(request), move(reply), bytes});
+        index.emplace(entries.front().request, entries.begin());
+        used += bytes;
+        while (used > budget)
+        {
+            used -= entries.back().bytes;
+            index.erase(entries.back().request);
+            entries.pop_back();
+        }
+    }
+
+    void printStats(ostream &out) const
+    {
+        lock_guard<mutex> guard(lock);
+        out << "cache: " << entries.size() << " entries, " << used << " of " << budget << " bytes, " << hits
+            << " hits, " << misses << " misses" << endl;
+    }
+};
+
+} // namespace
+
+// Longer requests are refused unread; each worker may hold one in memory
+const uint64_t MAX_REQUEST_BYTES = OPTION_BYTES + (uint64_t(64) << 20);
+
+string encodeRequest(string_view source, const CompileOptions &options)
+{
+    string request(OPTION_BYTES, '\0');
+    request[0] = static_cast<char>(options.optLevel);
+    request[1] = options.streamTokens;
+    request[2] = options.pipelined;
+    request[3] = options.printStats;
+    request[4] = options.dumpCFG;
+    request[5] = options.dumpSSA;
+    request[6] = static_cast<char>(options.vectorISA);
+    request[7] = options.fromIR;
+    request.append(source.data(), source.size());
+    return request;
+}
+
+string encodeReply(const CompileResult &result)
+{
+    // What report() gives, without building it as a separate copy of the listing
+    string errors;
+    for (const Diagnostic &diagnostic : result.diagnostics)
+    {
+        errors += diagnostic.message + "\n";
+    }
+    uint64_t outputLength = result.listing.size() + errors.size();
+    string reply(REPLY_HEADER_BYTES, '\0');
+    reply.reserve(REPLY_HEADER_BYTES + outputLength + result.statistics.size());
+    reply[0] = result.success;
+    memcpy(&reply[1], &outputLength, sizeof(outputLength));
+    reply += result.listing;
+    reply += errors;
+    reply += result.statistics;
+    return reply;
+}
+
+#ifdef HAVE_UNIX_SOCKETS
+
+namespace
+{
+
+bool readFully(int fd, char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = read(fd, data, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool writeFully(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = write(fd, data, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool readMessage(int fd, string &message, uint64_t maxLength)
+{
+    uint64_t length;
+    if (!readFully(fd, reinterpret_cast<char *>(&length), sizeof(length)) || length > maxLength)
+    {
+        return false;
+    }
+    message.resize(length);
+    return readFully(fd, &message[0], length);
+}
+
+bool writeMessage(int fd, string_view message)
+{
+    uint64_t length = message.size();
+    return writeFully(fd, reinterpret_cast<const char *>(&length), sizeof(length)) &&
+           writeFully(fd, message.data(), message.size());
+}
+
+bool socketAddress(const string &path, sockaddr_un &address)
+{
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// A socket connected to the server at `path`, or -1
+int connectTo(const string &path)
+{
+    sockaddr_un address;
+    if (!socketAddress(path, address))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+} // namespace
+
+bool sendRequest(const string &path, const string &request, string &reply)
+{
+    int fd = connectTo(path);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool answered = writeMessage(fd, request) && readMessage(fd, reply, UINT64_MAX);
+    close(fd);
+    return answered;
+}
+
+// Accepted connections wait in a queue of bounded length; while it is full,
+// serve() stops accepting and later clients wait in the socket's backlog.
+struct CompileServer::State
+{
+    static const size_t PENDING_PER_WORKER = 4;
+
+    string path;
+    int listenFd;
+    atomic<bool> stopping;
+    CompileCache cache;
+    size_t workerCount;
+
+    mutex pendingLock;
+    condition_variable pendingReady; // A connection was queued, or serve() is returning
+    condition_variable pendingSpace; // A connection was taken off the queue
+    deque<int> pending;
+    bool closing;
+
+    State(size_t cacheBudget, size_t workers)
+        : listenFd(-1), stopping(false), cache(cacheBudget), workerCount(max<size_t>(workers, 1)), closing(false) {}
+
+    void answer(int fd)
+    {
+        string request;
+        if (!readMessage(fd, request, MAX_REQUEST_BYTES) || request.size() < OPTION_BYTES)
+        {
+            return;
+        }
+        shared_ptr<const string> reply = cache.lookup(request);
+        if (!reply)
+        {
+            CompileResult result = compile(string_view(request).substr(OPTION_BYTES), decodeOptions(request));
+            reply = make_shared<const string>(encodeReply(result));
+            cache.insert(move(request), reply);
+        }
+        writeMessage(fd, *reply);
+    }
+
+    // Tells the client its request failed with something other than a
+    // compile error; the reply is not cached
+    static void answerFailure(int fd, const string &reason)
+    {
+        CompileResult result;
+        result.diagnostics.push_back(Diagnostic{DIAGNOSTIC_INPUT, 0, "Error: Internal compiler error: " + reason});
+        writeMessage(fd, encodeReply(result));
+    }
+
+    // A worker: answers queued connections until the queue is empty and
+    // serve() is returning
+    void work()
+    {
+        while (true)
+        {
+            int fd;
+            {
+                unique_lock<mutex> guard(pendingLock);
+                pendingReady.wait(guard, [this]()
+                                  { return !pending.empty() || closing; });
+                if (pending.empty())
+                {
+                    return;
+                }
+                fd = pending.front();
+                pending.pop_front();
+            }
+            pendingSpace.notify_one();
+
+            timeval timeout{SOCKET_TIMEOUT_SECONDS, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            // Whatever one request throws ends that request only
+            try
+            {
+                answer(fd);
+            }
+            catch (const exception &failure)
+            {
+                answerFailure(fd, failure.what());
+            }
+            catch (...)
+            {
+                answerFailure(fd, "unknown exception");
+            }
+            close(fd);
+        }
+    }
+
+    void enqueue(int fd)
+    {
+        {
+            unique_lock<mutex> guard(pendingLock);
+            pendingSpace.wait(guard, [this]()
+                              { return pending.size() < workerCount * PENDING_PER_WORKER; });
+            pending.push_back(fd);
+        }
+        pendingReady.notify_one();
+    }
+};
+
+CompileServer::CompileServer(size_t cacheBudget, size_t workers) : state(new State(cacheBudget, workers)) {}
+
+CompileServer::~CompileServer()
+{
+    if (state->listenFd >= 0)
+    {
+        close(state->listenFd);
+        unlink(state->path.c_str());
+    }
+}
+
+bool CompileServer::listen(const string &socketPath)
+{
+    sockaddr_un address;
+    if (!socketAddress(socketPath, address))
+    {
+        cerr << "Error: Socket path too long: " << socketPath << endl;
+        return false;
+    }
+    int running = connectTo(socketPath);
+    if (running >= 0)
+    {
+        close(running);
+        cerr << "Error: A compile server is already listening on " << socketPath << endl;
+        return false;
+    }
+    struct stat existing;
+    if (lstat(socketPath.c_str(), &existing) == 0)
+    {
+        if (!S_ISSOCK(existing.st_mode))
+        {
+            cerr << "Error: " << socketPath << " exists and is not a socket" << endl;
+            return false;
+        }
+        unlink(socketPath.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        ::listen(fd, SOMAXCONN) != 0)
+    {
+        cerr << "Error: Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    state->path = socketPath;
+    state->listenFd = fd;
+    return true;
+}
+
+void CompileServer::serve()
+{
+    state->closing = false;
+    vector<thread> workers;
+    for (size_t i = 0; i < state->workerCount; i++)
+    {
+        workers.emplace_back(&State::work, state.get());
+    }
+
+    while (true)
+    {
+        int fd = accept(state->listenFd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            cerr << "Error: accept failed: " << strerror(errno) << endl;
+            break;
+        }
+        if (state->stopping)
+        {
+            close(fd);
+            break;
+        }
+        state->enqueue(fd);
+    }
+
+    {
+        lock_guard<mutex> guard(state->pendingLock);
+        state->closing = true;
+    }
+    state->pendingReady.notify_all();
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void CompileServer::stop()
+{
+    state->stopping = true;
+    int fd = connectTo(state->path);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+void CompileServer::printCacheStats(ostream &out) const
+{
+    state->cache.printStats(out);
+}
+
+bool runServer(const string &path, size_t cacheBudget, size_t workers)
+{
+    signal(SIGPIPE, SIG_IGN); // A client that hangs up fails its write instead
+    CompileServer server(cacheBudget, workers);
+    if (!server.listen(path))
+    {
+        return false;
+    }
+    cerr << "Compile server listening on " << path << endl;
+    server.serve();
+    return true;
+}
+
+int runClient(const string &socketPath, const string &sourcePath, const CompileOptions &options)
+{
+    ifstream file(sourcePath, ios::binary);
+    if (!file)
+    {
+        cout << "Error: Cannot open file " << sourcePath << endl;
+        return 1;
+    }
+    ostringstream source;
+    source << file.rdbuf();
+
+    string request = encodeRequest(source.str(), options);
+    if (request.size() > MAX_REQUEST_BYTES)
+    {
+        cout << "Error: " << sourcePath << " is larger than the compile server accepts ("
+             << MAX_REQUEST_BYTES - OPTION_BYTES << " bytes)" << endl;
+        return 1;
+    }
+
+    string reply;
+    bool success;
+    string_view output, statistics;
+    if (!sendRequest(socketPath, request, reply) ||
+        !decodeReply(reply, success, output, statistics))
+    {
+        cout << "Error: No reply from a compile server on " << socketPath << endl;
+        return 1;
+    }
+    cout.write(output.data(), output.size());
+    cerr.write(statistics.data(), statistics.size());
+    return success ? 0 : 1;
+}
+
+#else
+
+bool sendRequest(const string &, const string &, string &)
+{
+    return false;
+}
+
+struct CompileServer::State
+{
+};
+
+CompileServer::CompileServer(size_t, size_t) {}
+
+CompileServer::~CompileServer() {}
+
+bool CompileServer::listen(const string &)
+{
+    cerr << "Error: The compile server needs Unix domain sockets" << endl;
+    return false;
+}
+
+void CompileServer::serve() {}
+
+void CompileServer::stop() {}
+
+void CompileServer::printCacheStats(ostream &) const {}
+
+bool runServer(const string &, size_t, size_t)
+{
+    cerr << "Error: The compile server needs Unix domain sockets" << endl;
+    return false;
+}
+
+int runClient(const string &, const string &, const CompileOptions &)
+{
+    cout << "Error: The compile server needs Unix domain sockets" << endl;
+    return 1;
+}
+
+#endif
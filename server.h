@@ -0,0 +1,65 @@
+// Compile server: a long-running process that answers compile requests on a
+// Unix domain socket, from memory when it has seen the request before
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "compiler.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// A request is the options in eight bytes, then the source; the server
+// refuses longer ones unread
+extern const uint64_t MAX_REQUEST_BYTES;
+
+// The request asking for `source` to be compiled with `options`
+std::string encodeRequest(std::string_view source, const CompileOptions &options);
+
+// The reply the server sends for `result`
+std::string encodeReply(const CompileResult &result);
+
+// Sends one request to the server at `path` and waits for the reply. False
+// if the server cannot be reached or hangs up first.
+bool sendRequest(const std::string &path, const std::string &request, std::string &reply);
+
+// Accepts connections on a listening socket and hands them to a fixed set
+// of worker threads, which answer one request per connection. Replies are
+// cached by request and the least recently used are dropped once the cache
+// holds more than cacheBudget bytes.
+class CompileServer
+{
+private:
+    struct State;
+    std::unique_ptr<State> state;
+
+public:
+    CompileServer(size_t cacheBudget, size_t workers);
+    ~CompileServer();
+
+    // Binds the socket, replacing one a server that is no longer running
+    // left behind. False, with the reason on stderr, if that fails.
+    bool listen(const std::string &socketPath);
+
+    // Returns once stop() is called and the connections accepted before it
+    // have been answered
+    void serve();
+
+    // Wakes serve() with a connection of its own
+    void stop();
+
+    void printCacheStats(std::ostream &out) const;
+};
+
+// Serves compile requests on the socket at `path` until the process is
+// killed, on `workers` threads. Returns only if the socket cannot be set up.
+bool runServer(const std::string &path, size_t cacheBudget, size_t workers);
+
+// Has the server at socketPath compile the file at sourcePath and prints its
+// reply as a local compile would. Returns the exit status for main.
+int runClient(const std::string &socketPath, const std::string &sourcePath, const CompileOptions &options);
+
+#endif
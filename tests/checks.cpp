@@ -0,0 +1,742 @@
+// Self-tests of the compiler library that need more than a source file and
+// its expected output: randomly generated programs checked across the
+// optimization levels, the IR format and incremental compiles, and the
+// compile server. `checks <name>` runs one of them and `checks` runs all;
+// each prints a line per check and exits nonzero if any failed.
+#include "compiler.h"
+#include "server.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+using namespace std;
+
+// Allocations of at least this many bytes throw bad_alloc, so that a check
+// can make the compiler fail partway through
+atomic<size_t> failAllocationsFrom(SIZE_MAX);
+
+void *operator new(size_t size)
+{
+    if (size >= failAllocationsFrom)
+    {
+        throw bad_alloc();
+    }
+    void *memory = malloc(size != 0 ? size : 1);
+    if (memory == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+// Memory from here, like from the plain form, goes to the deletes below
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    return size < failAllocationsFrom ? malloc(size != 0 ? size : 1) : nullptr;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+// Random programs for the checks below: int scalars and arrays,
+// arithmetic, comparisons and logic, if/else, and while and for loops whose
+// counters keep every array index in bounds. A seed gives the same program
+// everywhere. Every program compiles and runs to its end, and divides only
+// by nonzero constants.
+class ProgramGenerator
+{
+private:
+    uint32_t state;
+    uint32_t arrayLength;
+    int counters;          // Loop counters declared so far
+    vector<string> active; // Counters of the loops around the current statement
+    vector<string> lines;
+
+    uint32_t below(uint32_t n)
+    {
+        state = state * 1103515245 + 12345;
+        return (state >> 8) % n;
+    }
+
+    bool chance(uint32_t percent)
+    {
+        return below(100) < percent;
+    }
+
+    string scalar()
+    {
+        return string(1, static_cast<char>('a' + below(6)));
+    }
+
+    string element(const string &index)
+    {
+        return string(1, static_cast<char>('p' + below(3))) + "[" + index + "]";
+    }
+
+    string atom()
+    {
+        uint32_t pick = below(100);
+        if (!active.empty() && pick < 15)
+            return element(active[below(active.size())]);
+        if (!active.empty() && pick < 30)
+            return active[below(active.size())];
+        if (pick < 65)
+            return scalar();
+        return to_string(below(13));
+    }
+
+    string expression(int depth)
+    {
+        if (depth > 2 || chance(30))
+        {
+            return atom();
+        }
+        static const char *const operators[] = {"+", "-", "*", "/", "+", "*", ">", "<", "==", "!=", "&&", "||"};
+        string op = operators[below(12)];
+        string left = expression(depth + 1);
+        string text = left + " " + op + " " + (op == "/" ? to_string(1 + below(9)) : expression(depth + 1));
+        return chance(30) ? "(" + text + ")" : text;
+    }
+
+    // What the vectorizer takes: + - * over elements at `index`, scalars and constants
+    string laneExpression(const string &index, int depth)
+    {
+        if (depth > 2 || chance(35))
+        {
+            uint32_t pick = below(100);
+            return pick < 45 ? element(index) : pick < 70 ? scalar() : to_string(below(10));
+        }
+        static const char *const operators[] = {"+", "-", "*"};
+        string text = laneExpression(index, depth + 1) + " " + operators[below(3)] + " " + laneExpression(index, depth + 1);
+        return chance(30) ? "(" + text + ")" : text;
+    }
+
+    void block(int depth, const string &indent, const string &last = "")
+    {
+        lines.push_back(indent + "{");
+        for (uint32_t i = 1 + below(4); i > 0; i--)
+        {
+            statement(depth + 1, indent + "    ");
+        }
+        if (!last.empty())
+        {
+            lines.push_back(indent + "    " + last);
+        }
+        lines.push_back(indent + "}");
+    }
+
+    void statement(int depth, const string &indent)
+    {
+        uint32_t pick = below(100);
+        if (depth < 3 && pick < 12)
+        {
+            lines.push_back(indent + "if (" + expression(0) + ")");
+            block(depth, indent);
+            if (chance(50))
+            {
+                lines.push_back(indent + "else");
+                block(depth, indent);
+            }
+        }
+        else if (depth < 3 && pick < 24)
+        {
+            string counter = "k" + to_string(counters++);
+            string bound = to_string(below(arrayLength + 1));
+            active.push_back(counter);
+            if (chance(50))
+            {
+                lines.push_back(indent + counter + " = 0;");
+                lines.push_back(indent + "while (" + counter + " < " + bound + ")");
+                block(depth, indent, counter + " = " + counter + " + 1;");
+            }
+            else
+            {
+                string step = to_string(chance(60) ? 1 : 1 + below(3));
+                lines.push_back(indent + "for (" + counter + " = 0; " + counter + " < " + bound + "; " + counter +
+                                " = " + counter + " + " + step + ";)");
+                block(depth, indent);
+            }
+            active.pop_back();
+        }
+        else if (depth < 3 && pick < 32)
+        {
+            string counter = "k" + to_string(counters++);
+            uint32_t from = below(arrayLength + 1);
+            lines.push_back(indent + "for (" + counter + " = " + to_string(from) + "; " + counter + " < " +
+                            to_string(from + below(arrayLength - from + 1)) + "; " + counter + " = " + counter +
+                            " + 1;)");
+            lines.push_back(indent + "{");
+            for (uint32_t i = 1 + below(3); i > 0; i--)
+            {
+                lines.push_back(indent + "    " + element(counter) + " = " + laneExpression(counter, 0) + ";");
+            }
+            lines.push_back(indent + "}");
+        }
+        else if (!active.empty() && pick < 50)
+        {
+            lines.push_back(indent + element(active[below(active.size())]) + " = " + expression(0) + ";");
+        }
+        else
+        {
+            lines.push_back(indent + scalar() + " = " + expression(0) + ";");
+        }
+    }
+
+public:
+    explicit ProgramGenerator(uint32_t seed) : state(seed), arrayLength(0), counters(0) {}
+
+    string program()
+    {
+        arrayLength = 1 + below(40);
+        counters = 0;
+        lines.clear();
+        for (uint32_t i = 3 + below(10); i > 0; i--)
+        {
+            statement(0, "");
+        }
+
+        string text;
+        for (char name = 'a'; name <= 'f'; name++)
+        {
+            text += string("int ") + name + ";\n";
+        }
+        for (char name = 'p'; name <= 'r'; name++)
+        {
+            text += string("int ") + name + "[" + to_string(arrayLength) + "];\n";
+        }
+        for (int i = 0; i < counters; i++)
+        {
+            text += "int k" + to_string(i) + ";\n";
+        }
+        for (const string &line : lines)
+        {
+            text += line + "\n";
+        }
+        return text;
+    }
+};
+
+// Runs generated programs unoptimized, at -O1, and vectorized at -O2 for SSE
+// and for AVX2 on the simulator, and checks that each ends with the same
+// memory every time
+int runOptimizerCheck()
+{
+    struct Variant
+    {
+        const char *name;
+        int optLevel;
+        VectorISA isa;
+    };
+    const Variant variants[] = {{"-O0", 0, VECTOR_SSE}, {"-O1", 1, VECTOR_SSE}, {"-O2", 2, VECTOR_SSE},
+                                {"-O2 --avx2", 2, VECTOR_AVX2}};
+    const uint32_t programs = 120;
+    const uint64_t limit = 10000000;
+
+    uint32_t failures = 0;
+    for (uint32_t seed = 1; seed <= programs; seed++)
+    {
+        string source = ProgramGenerator(seed).program();
+        ExecutionResult unoptimized;
+        for (const Variant &variant : variants)
+        {
+            CompileOptions options;
+            options.optLevel = variant.optLevel;
+            options.vectorISA = variant.isa;
+            ExecutionResult execution = execute(source, options, limit);
+            string problem = !execution.diagnostics.empty() ? execution.diagnostics[0].message
+                             : !execution.success          ? "faulted or ran past " + to_string(limit) + " instructions"
+                             : variant.optLevel > 0 && execution.memory != unoptimized.memory ? "memory differs from -O0"
+                                                                                              : "";
+            if (!problem.empty())
+            {
+                cout << "FAIL program " << seed << " at " << variant.name << ": " << problem << endl
+                     << source;
+                failures++;
+                break;
+            }
+            if (variant.optLevel == 0)
+            {
+                unoptimized = move(execution);
+            }
+        }
+    }
+    cout << (failures == 0 ? "PASS " : "FAIL ") << programs - failures << " of " << programs
+         << " generated programs end with the same memory at -O0, -O1, -O2 and -O2 --avx2" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Compiles generated programs through --emit-ir and --from-ir and checks
+// that each gives what compiling its source does at -O0 to -O2. Then
+// compiles copies of their IR with random damage and the checksum repaired:
+// opcodes, operand kinds and operand values of the TAC records, and bytes
+// anywhere after the header. Each must be rejected or compile; under the
+// sanitizers in tests/run.sh, neither may touch memory it should not.
+int runIRCheck()
+{
+    const uint32_t programs = 30;
+    const uint32_t corruptionsPerProgram = 30;
+
+    uint32_t state = 1;
+    auto below = [&state](uint32_t n)
+    {
+        state = state * 1103515245 + 12345;
+        return (state >> 8) % n;
+    };
+
+    uint32_t roundTripFailures = 0, corruptionFailures = 0, rejected = 0;
+    for (uint32_t seed = 1; seed <= programs; seed++)
+    {
+        string source = ProgramGenerator(seed).program();
+        CompileOptions emit;
+        emit.emitIR = true;
+        string ir = compile(source, emit).ir;
+
+        bool same = !ir.empty();
+        for (int level = 0; level <= 2 && same; level++)
+        {
+            CompileOptions options, fromIR;
+            options.optLevel = fromIR.optLevel = level;
+            fromIR.fromIR = true;
+            string expected = compile(source, options).listing;
+            same = compile(ir, fromIR).listing == expected.substr(expected.find("Symbol Table:"));
+        }
+        if (!same)
+        {
+            cout << "FAIL program " << seed << ": compiling its IR differs from compiling its source" << endl
+                 << source;
+            roundTripFailures++;
+            continue;
+        }
+
+        uint64_t count;
+        memcpy(&count, &ir[IR_INSTRUCTION_COUNT_OFFSET], sizeof(count));
+        size_t codeAt = ir.size() - count * IR_INSTRUCTION_BYTES;
+        for (uint32_t corruption = 0; corruption < corruptionsPerProgram; corruption++)
+        {
+            string damaged = ir;
+            for (uint32_t change = 1 + below(3); change > 0; change--)
+            {
+                size_t record = codeAt + below(static_cast<uint32_t>(count)) * IR_INSTRUCTION_BYTES;
+                uint32_t pick = below(100);
+                if (pick < 25)
+                {
+                    damaged[IR_HEADER_BYTES + below(static_cast<uint32_t>(ir.size() - IR_HEADER_BYTES))] =
+                        static_cast<char>(below(256));
+                }
+                else if (pick < 45)
+                {
+                    damaged[record] = static_cast<char>(below(19));
+                }
+                else if (pick < 70)
+                {
+                    damaged[record + IR_OPERAND_OFFSETS[below(3)]] = static_cast<char>(below(8));
+                }
+                else
+                {
+                    const int32_t values[] = {-1, 0, 1, 2, static_cast<int32_t>(count) - 1, static_cast<int32_t>(count),
+                                              static_cast<int32_t>(below(static_cast<uint32_t>(count) + 2))};
+                    int32_t value = values[below(7)];
+                    size_t at = record + IR_OPERAND_OFFSETS[below(3)] + IR_OPERAND_VALUE_OFFSET;
+                    memcpy(&damaged[at], &value, sizeof(value));
+                }
+            }
+            uint64_t checksum = irChecksum(string_view(damaged).substr(IR_HEADER_BYTES));
+            memcpy(&damaged[IR_CHECKSUM_OFFSET], &checksum, sizeof(checksum));
+
+            CompileOptions fromIR;
+            fromIR.fromIR = true;
+            fromIR.optLevel = static_cast<int>(below(3));
+            try
+            {
+                rejected += compile(damaged, fromIR).success ? 0 : 1;
+            }
+            catch (const exception &failure)
+            {
+                cout << "FAIL program " << seed << ", corruption " << corruption << ": " << failure.what() << endl;
+                corruptionFailures++;
+            }
+        }
+    }
+    uint32_t corruptions = programs * corruptionsPerProgram;
+    cout << (roundTripFailures == 0 ? "PASS " : "FAIL ") << programs - roundTripFailures << " of " << programs
+         << " generated programs compile the same from IR at -O0, -O1 and -O2" << endl;
+    cout << (corruptionFailures == 0 ? "PASS " : "FAIL ") << corruptions - corruptionFailures << " of "
+         << corruptions << " corrupted IR files rejected (" << rejected << ") or compiled" << endl;
+    return roundTripFailures == 0 && corruptionFailures == 0 ? 0 : 1;
+}
+
+// Fastest of three compiles, in seconds
+double compileSeconds(const string &source, const CompileOptions &options)
+{
+    double fastest = 0;
+    for (int round = 0; round < 3; round++)
+    {
+        auto begin = chrono::steady_clock::now();
+        compile(source, options);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+        fastest = round == 0 ? elapsed.count() : min(fastest, elapsed.count());
+    }
+    return fastest;
+}
+
+// Edits generated programs through IncrementalCompiler: random text
+// inserted, deleted or replaced anywhere, mostly undone again soon after, so
+// that the source wanders at most three edits from a program that compiles.
+// After each edit and each undo the result must be what compile() gives for
+// the edited source. Half the programs are wrapped in a while loop, so that
+// every edit is inside a block. Last, edits inside a loop around many
+// statements have to cost a small part of a compile, as they re-parse only
+// the statements near them.
+int runIncrementalCheck()
+{
+    static const char *const snippets[] = {"", "7", "a", "k0", " + 1", " * b", ";", "\n", "{", "}", "(", ")", "[",
+                                           "]", "if (a)\n{\n", "}\nelse\n{\n", "while (c < 3)\n{\n", "int z;\n",
+                                           "z = 2;\n", "b = 3;\n", "p[0] = a;\n", "/*", "*/", "// ", "\"text\"",
+                                           "else", "for", "int"};
+    const uint32_t programs = 40;
+    const uint32_t editsPerProgram = 60;
+
+    uint32_t state = 1;
+    auto below = [&state](uint32_t n)
+    {
+        state = state * 1103515245 + 12345;
+        return (state >> 8) % n;
+    };
+    auto sameDiagnostics = [](const CompileResult &a, const CompileResult &b)
+    {
+        if (a.diagnostics.size() != b.diagnostics.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < a.diagnostics.size(); i++)
+        {
+            if (a.diagnostics[i].line != b.diagnostics[i].line || a.diagnostics[i].message != b.diagnostics[i].message)
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    struct Edit
+    {
+        size_t offset;
+        size_t length;  // Of the text the edit put in
+        string removed; // The text it replaced
+    };
+
+    uint32_t failures = 0, rejected = 0;
+    for (uint32_t seed = 1; seed <= programs; seed++)
+    {
+        CompileOptions options;
+        options.optLevel = static_cast<int>(seed % 3);
+        string program = ProgramGenerator(seed).program();
+        if (seed % 2 == 0)
+        {
+            program = "int w;\nwhile (w < 1)\n{\n" + program + "}\n";
+        }
+        IncrementalCompiler compiler(program, options);
+        vector<Edit> undo;
+        for (uint32_t i = 0; i < editsPerProgram; i++)
+        {
+            const string &source = compiler.source();
+            Edit edit;
+            string text;
+            if (!undo.empty() && (undo.size() == 3 || below(4) != 0))
+            {
+                edit = undo.back();
+                undo.pop_back();
+                text = edit.removed;
+                edit.removed = source.substr(edit.offset, edit.length);
+            }
+            else
+            {
+                edit.offset = below(static_cast<uint32_t>(source.size() + 1));
+                edit.removed = source.substr(edit.offset, below(4) == 0 ? below(9) : 0);
+                text = snippets[below(sizeof(snippets) / sizeof(snippets[0]))];
+                edit.length = text.size();
+                undo.push_back(Edit{edit.offset, edit.length, edit.removed});
+            }
+
+            bool accepted = compiler.edit(edit.offset, edit.removed.size(), text);
+            CompileResult expected = compile(compiler.source(), options);
+            CompileResult result = compiler.result();
+            rejected += accepted ? 0 : 1;
+            if (accepted != expected.success || result.success != expected.success ||
+                result.listing != expected.listing || !sameDiagnostics(result, expected))
+            {
+                cout << "FAIL program " << seed << ", edit " << i << ": result differs from compile() for" << endl
+                     << compiler.source();
+                failures++;
+                break;
+            }
+        }
+    }
+    cout << (failures == 0 ? "PASS " : "FAIL ") << programs - failures << " of " << programs
+         << " generated programs give compile()'s result after each of " << editsPerProgram << " random edits ("
+         << rejected << " edits left an error)" << endl;
+
+    const int statements = 20000;
+    string source = "int a;\nint b;\nint w;\nwhile (w < 1)\n{\n";
+    for (int k = 0; k < statements / 2; k++)
+    {
+        source += "    a = a + 1;\n    if (a > 3)\n    {\n        b = b + 2;\n    }\n";
+    }
+    source += "    w = w + 1;\n}\n";
+    double compileTime = compileSeconds(source, CompileOptions());
+    IncrementalCompiler compiler(source, CompileOptions());
+    const int edits = 200;
+    auto begin = chrono::steady_clock::now();
+    for (int i = 0; i < edits; i++)
+    {
+        size_t offset = source.find("+ 1", source.size() / edits * i) + 2;
+        compiler.edit(offset, 1, i % 2 == 0 ? "7" : "1");
+    }
+    chrono::duration<double> editTime = chrono::steady_clock::now() - begin;
+    double share = editTime.count() / edits / compileTime;
+    bool fast = share < 0.01;
+    bool same = compiler.result().listing == compile(compiler.source(), CompileOptions()).listing;
+    cout << (fast && same ? "PASS " : "FAIL ") << "an edit inside a while loop around " << statements
+         << " statements takes " << share * 100 << "% of compile()'s time, at most 1%"
+         << (same ? "" : ", but the result differs from compile()'s") << endl;
+    return failures == 0 && fast && same ? 0 : 1;
+}
+
+// `count` loops one after another, each around an if/else and a loop with
+// an invariant product to hoist
+string sequentialLoops(int count)
+{
+    string source = "int a;\nint b;\nint i;\nint j;\na = 0;\nb = 5;\n";
+    for (int k = 0; k < count; k++)
+    {
+        source += "i = 0;\nwhile (i < 4)\n{\n    if (a > " + to_string(k) +
+                  ")\n    {\n        a = a - i;\n    }\n    else\n    {\n        a = a + i * 3;\n    }\n"
+                  "    j = 0;\n    while (j < 3)\n    {\n        a = a + b * 7 + j;\n        j = j + 1;\n    }\n"
+                  "    i = i + 1;\n}\n";
+    }
+    return source;
+}
+
+// Compiles a source with many loops and one with four times as many, and
+// checks that the time grows about linearly: at most 8 times as long, where
+// work quadratic in the number of loops takes 16. Once with the CFG dump,
+// which finds the loops, and once at -O1, whose loop passes find them again
+// after each change.
+int runLoopScalingCheck()
+{
+    const int loops = 1000;
+    const double limit = 8;
+    string small = sequentialLoops(loops), large = sequentialLoops(4 * loops);
+
+    int failures = 0;
+    CompileOptions dumpCFG, optimized;
+    dumpCFG.dumpCFG = true;
+    optimized.optLevel = 1;
+    for (const CompileOptions &options : {dumpCFG, optimized})
+    {
+        double ratio = compileSeconds(large, options) / compileSeconds(small, options);
+        bool passed = ratio < limit;
+        cout << (passed ? "PASS " : "FAIL ") << (options.dumpCFG ? "-O0 --dump-cfg" : "-O1") << " on "
+             << 4 * loops << " loops takes " << ratio << " times as long as on " << loops << endl;
+        failures += passed ? 0 : 1;
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+#ifdef HAVE_UNIX_SOCKETS
+
+// A socket connected to the server at `path`, or -1
+int connectTo(const string &path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Sends only a request length above MAX_REQUEST_BYTES and checks that the
+// server hangs up without a reply
+bool refusesOversizedRequest(const string &path)
+{
+    int fd = connectTo(path);
+    if (fd < 0)
+    {
+        return false;
+    }
+    uint64_t length = MAX_REQUEST_BYTES + 1;
+    char reply;
+    bool refused = write(fd, &length, sizeof(length)) == sizeof(length) && read(fd, &reply, 1) <= 0;
+    close(fd);
+    return refused;
+}
+
+// Starts a server with two workers on a socket of its own and checks that
+// it answers as a local compile would: with the option bytes at their
+// limits, for a damaged IR file, after refusing an oversized request, and
+// for more clients at once than it has workers while another client stalls.
+// Also that a pipelined compile running out of memory fails only its own
+// request.
+int runServeCheck()
+{
+    const string source = "int a[8];\nint i;\ni = 0;\nwhile (i < 8)\n{\n    a[i] = i * 3;\n    i = i + 1;\n}\n";
+    string socketPath = "/tmp/compiler-check-" + to_string(getpid()) + ".sock";
+    signal(SIGPIPE, SIG_IGN);
+    CompileServer server(size_t(1) << 20, 2);
+    if (!server.listen(socketPath))
+    {
+        return 1;
+    }
+    thread serving([&server]()
+                   { server.serve(); });
+
+    int failures = 0;
+    auto check = [&failures](bool passed, const char *what)
+    {
+        cout << (passed ? "PASS " : "FAIL ") << what << endl;
+        failures += passed ? 0 : 1;
+    };
+
+    string reply;
+    string request = encodeRequest(source, CompileOptions());
+    check(sendRequest(socketPath, request, reply) && reply == encodeReply(compile(source, CompileOptions())),
+          "reply matches a local compile");
+
+    // Option bytes are unsigned: 200 is above -O2, not below -O0
+    CompileOptions optimized;
+    optimized.optLevel = 2;
+    request[0] = static_cast<char>(200);
+    check(sendRequest(socketPath, request, reply) && reply == encodeReply(compile(source, optimized)),
+          "optimization level 200 is clamped to -O2");
+
+    CompileOptions emitIR, fromIR;
+    emitIR.emitIR = true;
+    fromIR.fromIR = true;
+    string ir = compile(source, emitIR).ir;
+    ir[ir.size() / 2] ^= 0x55;
+    check(sendRequest(socketPath, encodeRequest(ir, fromIR), reply) && reply == encodeReply(compile(ir, fromIR)),
+          "damaged IR gets its error as the reply");
+
+    check(refusesOversizedRequest(socketPath), "oversized request is refused unread");
+
+    // The request fits under the limit, but the pipeline's listings do not
+    string large = "int a;\nint i;\n";
+    while (large.size() < 48 * 1024)
+    {
+        large += "i = " + to_string(large.size()) + ";\na = a + i * 3;\n";
+    }
+    CompileOptions pipelined;
+    pipelined.pipelined = true;
+    CompileResult failed;
+    failed.diagnostics.push_back(Diagnostic{DIAGNOSTIC_INPUT, 0, "Error: Internal compiler error: std::bad_alloc"});
+    request = encodeRequest(large, pipelined);
+    failAllocationsFrom = 64 * 1024;
+    bool sent = sendRequest(socketPath, request, reply);
+    failAllocationsFrom = SIZE_MAX;
+    check(sent && reply == encodeReply(failed), "pipelined compile out of memory gets an internal error");
+    check(sendRequest(socketPath, request, reply) && reply == encodeReply(compile(large, pipelined)),
+          "server still answers after it");
+
+    // Holds one worker until it is closed
+    int stalled = connectTo(socketPath);
+    const int clients = 24;
+    request = encodeRequest(source, CompileOptions());
+    string expected = encodeReply(compile(source, CompileOptions()));
+    atomic<int> answered(0);
+    vector<thread> threads;
+    for (int i = 0; i < clients; i++)
+    {
+        threads.emplace_back([&]()
+                             {
+            string own;
+            if (sendRequest(socketPath, request, own) && own == expected)
+            {
+                answered++;
+            } });
+    }
+    for (thread &client : threads)
+    {
+        client.join();
+    }
+    check(answered == clients, "concurrent clients answered while one stalls");
+    if (stalled >= 0)
+    {
+        close(stalled);
+    }
+
+    server.stop();
+    serving.join();
+    return failures == 0 ? 0 : 1;
+}
+
+#else
+
+int runServeCheck()
+{
+    cout << "SKIP the compile server needs Unix domain sockets" << endl;
+    return 0;
+}
+
+#endif
+
+int main(int argc, char *argv[])
+{
+    struct Check
+    {
+        const char *name;
+        int (*run)();
+    };
+    const Check checks[] = {{"serve", runServeCheck},
+                            {"optimizer", runOptimizerCheck},
+                            {"ir", runIRCheck},
+                            {"incremental", runIncrementalCheck},
+                            {"loops", runLoopScalingCheck}};
+
+    int status = 0;
+    bool found = false;
+    for (const Check &check : checks)
+    {
+        if (argc < 2 || string(argv[1]) == check.name)
+        {
+            found = true;
+            status = max(status, check.run());
+        }
+    }
+    if (!found)
+    {
+        cout << "Usage: " << argv[0] << " [serve|optimizer|ir|incremental|loops]" << endl;
+        return 2;
+    }
+    return status;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Runs the compiler given as $1 on every case in tests/cases:
+#   NAME.txt   the input (source, or binary IR for --from-ir cases)
+#   NAME.args  options, if any
+#   NAME.out   the expected stdout
+# A case fails if its output differs or the compiler exits with anything but
+# 0 (compiled) or 1 (compile error), which is what a sanitizer report or a
+# crash gives.
+compiler=$1
+cd "$(dirname "$0")/.." || exit 1
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+
+failed=0
+passed=0
+for input in tests/cases/*.txt; do
+    name=${input%.txt}
+    args=""
+    if [ -f "$name.args" ]; then
+        args=$(cat "$name.args")
+    fi
+    # shellcheck disable=SC2086 # args holds several options
+    "$compiler" $args "$input" > "$out/out" 2> "$out/err"
+    status=$?
+    if [ $status -gt 1 ]; then
+        echo "FAIL $name: exit status $status"
+        cat "$out/err"
+        failed=$((failed + 1))
+    elif ! cmp -s "$out/out" "$name.out"; then
+        echo "FAIL $name: output differs"
+        diff "$name.out" "$out/out" | head -20
+        failed=$((failed + 1))
+    else
+        passed=$((passed + 1))
+    fi
+done
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Regression tests. Builds the compiler and the self-tests in tests/checks.cpp
+# with AddressSanitizer and UndefinedBehaviorSanitizer and runs them all
+# through ctest: the cases in tests/cases (see run-cases.sh), then each
+# check. Run from anywhere; CXX picks the compiler (default g++).
+cd "$(dirname "$0")/.." || exit 1
+build=$(mktemp -d) || exit 1
+trap 'rm -rf "$build"' EXIT
+
+echo "Building with sanitizers..."
+CXX=${CXX:-g++} cmake -S . -B "$build" -DCMAKE_BUILD_TYPE=RelWithDebInfo \
+    -DCMAKE_CXX_FLAGS_RELWITHDEBINFO="-O1 -g -fsanitize=address,undefined -fno-sanitize-recover=all" \
+    > "$build/cmake.log" || { cat "$build/cmake.log"; exit 1; }
+cmake --build "$build" > "$build/build.log" 2>&1 || { cat "$build/build.log"; exit 1; }
+
+# Sanitizer reports must not pass for an ordinary compile error
+export ASAN_OPTIONS=exitcode=99
+export UBSAN_OPTIONS=exitcode=99
+
+ctest --test-dir "$build" --output-on-failure